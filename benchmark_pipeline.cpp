@@ -0,0 +1,541 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/calib3d.hpp>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "image_source.hpp"
+#include "planes.hpp"
+#include "point_cloud.hpp"
+#include "stereo.hpp"
+#include "timing.hpp"
+
+
+// for convenience
+using namespace std;
+
+
+// user defined types
+
+// one benchmarked stage; run() performs a single timed repetition
+struct Stage
+{
+    string name;
+    string description;
+    function<void(void)> run;
+};
+
+struct StageResult
+{
+    string name;
+    string description;
+    TimingSummary summary;
+};
+
+
+// globals
+
+// tunable parameters
+int    _warmup = 2;     // untimed repetitions before measuring each stage
+int    _repeat = 10;    // timed repetitions per stage
+string _pointsFile = "benchmark_points.pts";   // scratch file for the points parse stage; removed afterwards
+double _textureThreshold = 8.0;     // mean horizontal gradient below which the textured matcher skips a block
+
+
+bool matchesFilter(const string &name, const vector<string> &filters)
+{
+    if (filters.empty())
+    {
+        return true;
+    }
+    for (size_t filter_i = 0; filter_i < filters.size(); filter_i++)
+    {
+        if (name.find(filters[filter_i]) != string::npos)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+StageResult runStage(const Stage &stage)
+{
+    for (int warmup_i = 0; warmup_i < _warmup; warmup_i++)
+    {
+        stage.run();
+    }
+
+    vector<double> samples;
+    for (int repeat_i = 0; repeat_i < _repeat; repeat_i++)
+    {
+        Stopwatch stopwatch;
+        stage.run();
+        samples.push_back(stopwatch.elapsedMs());
+    }
+
+    StageResult result;
+    result.name = stage.name;
+    result.description = stage.description;
+    result.summary = summarizeTimings(samples);
+    return result;
+}
+
+
+void writeJson(ostream &out, const vector<StageResult> &results)
+{
+    char timestamp[64];
+    time_t now = time(0);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    out.setf(ios_base::fixed);
+    out.precision(4);
+    out << "{" << endl;
+    out << "  \"timestamp\": \"" << timestamp << "\"," << endl;
+    out << "  \"warmup\": " << _warmup << "," << endl;
+    out << "  \"repeat\": " << _repeat << "," << endl;
+    out << "  \"stages\": [" << endl;
+    for (size_t result_i = 0; result_i < results.size(); result_i++)
+    {
+        const TimingSummary &s = results[result_i].summary;
+        out << "    {\"name\": \"" << results[result_i].name << "\", \"description\": \"" << results[result_i].description << "\""
+            << ", \"count\": " << s.count << ", \"min_ms\": " << s.min << ", \"mean_ms\": " << s.mean << ", \"stddev_ms\": " << s.stddev
+            << ", \"p50_ms\": " << s.p50 << ", \"p90_ms\": " << s.p90 << ", \"p99_ms\": " << s.p99 << ", \"max_ms\": " << s.max << "}"
+            << (result_i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl;
+    out << "}" << endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+    // parse options
+    string dataDir = ".";
+    string jsonFile;
+    vector<string> filters;
+    for (int arg_i = 1; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        if (arg == "--data" && arg_i + 1 < argc)
+        {
+            dataDir = argv[++arg_i];
+        }
+        else if (arg == "--warmup" && arg_i + 1 < argc)
+        {
+            _warmup = max(0, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--repeat" && arg_i + 1 < argc)
+        {
+            _repeat = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--filter" && arg_i + 1 < argc)
+        {
+            filters.push_back(argv[++arg_i]);
+        }
+        else if (arg == "--json" && arg_i + 1 < argc)
+        {
+            jsonFile = argv[++arg_i];
+        }
+        else
+        {
+            cerr << "Usage: benchmark_pipeline [--data <repository_dir>] [--warmup <n>] [--repeat <n>] [--filter <stage_substring>]... [--json <file>]" << endl;
+            cerr << "times each pipeline stage on the repository's images; the summary goes to stderr and the JSON results to stdout (or --json <file>)" << endl;
+            return 1;
+        }
+    }
+
+    // load the checked-in data
+    // note: the cones pair is already rectified; the extra credit scenes are rectified with the calibration results
+    cv::Mat conesLeft = cv::imread(dataDir + "/conesH/im2.ppm", cv::IMREAD_COLOR);
+    cv::Mat conesRight = cv::imread(dataDir + "/conesH/im6.ppm", cv::IMREAD_COLOR);
+    cv::Mat conesTruth = cv::imread(dataDir + "/conesH/disp2.pgm", cv::IMREAD_GRAYSCALE);
+    cv::Mat sceneLeft = cv::imread(dataDir + "/extra_credit/scene00.jpg", cv::IMREAD_COLOR);
+    cv::Mat sceneRight = cv::imread(dataDir + "/extra_credit/scene01.jpg", cv::IMREAD_COLOR);
+    CameraData camera;
+    bool haveCamera = loadCameraData(dataDir + "/calibration/out_camera_data.xml", camera);
+    if (conesLeft.empty() || conesRight.empty() || conesTruth.empty() || sceneLeft.empty() || sceneRight.empty() || !haveCamera)
+    {
+        cerr << "error: could not load the images and calibration data under \"" << dataDir << "\"; use --data <repository_dir>" << endl;
+        return 1;
+    }
+
+    cv::Size boardSize;
+    vector<cv::Mat> calibrationImages;
+    {
+        cv::FileStorage fs(dataDir + "/calibration/out_camera_data.xml", cv::FileStorage::READ);
+        fs["board_width"] >> boardSize.width;
+        fs["board_height"] >> boardSize.height;
+    }
+    {
+        vector<string> calibrationFiles;
+        for (int image_i = 1; image_i <= 99; image_i++)
+        {
+            stringstream filename;
+            filename << dataDir << "/calibration/images/" << setw(2) << setfill('0') << image_i << ".jpg";
+            calibrationFiles.push_back(filename.str());
+        }
+        // note: the images are numbered from 01 and end at the first missing file; the few reads the source
+        // starts past it fail immediately
+        ImageSource source(calibrationFiles, cv::IMREAD_COLOR, 8);
+        SourceImage frame;
+        while (source.next(frame) && !frame.image.empty())
+        {
+            calibrationImages.push_back(frame.image);
+        }
+    }
+
+    // inputs and outputs of each stage
+    // note: every stage's inputs are prepared up front by running the stages before it once, so each one is timed in isolation
+    StereoRectification rectification;
+    computeRectification(camera, sceneLeft.size(), 10.0, rectification);
+    cv::Mat sceneLeftRectified, sceneRightRectified;
+    rectifyPair(rectification, sceneLeft, sceneRight, sceneLeftRectified, sceneRightRectified);
+
+    cv::Mat conesLeftGray, conesRightGray, sceneLeftGray, sceneRightGray;
+    cv::cvtColor(conesLeft, conesLeftGray, cv::COLOR_BGR2GRAY);
+    cv::cvtColor(conesRight, conesRightGray, cv::COLOR_BGR2GRAY);
+    cv::cvtColor(sceneLeftRectified, sceneLeftGray, cv::COLOR_BGR2GRAY);
+    cv::cvtColor(sceneRightRectified, sceneRightGray, cv::COLOR_BGR2GRAY);
+
+    DisparityMatcher matcher;
+    cv::Ptr<cv::StereoBM> sbm = cv::StereoBM::create(matcher.ndisparities(), matcher.SADWindowSize());
+    cv::Mat disparity16S, disparity8U;
+    sbm->compute(conesLeftGray, conesRightGray, disparity16S);
+    matcher.compute(conesLeftGray, conesRightGray, disparity8U);
+
+    cv::Mat Q = simpleQ();
+    cv::Mat XYZ;
+    reprojectDisparity(disparity8U, Q, XYZ);
+
+    if (!writePointCloud(_pointsFile, XYZ, conesLeft))
+    {
+        cerr << "error: could not write \"" << _pointsFile << "\"" << endl;
+        return 1;
+    }
+
+    // the stages
+    vector<Stage> stages;
+    Stage stage;
+
+    // note: the decode stages read the whole extra credit sequence plus the cones pair, with a fake per-frame workload
+    // standing in for the consumer, so the image source's overlap shows up in the timings
+    vector<string> sequenceFiles;
+    for (int scene_i = 0; scene_i < 8; scene_i++)
+    {
+        stringstream filename;
+        filename << dataDir << "/extra_credit/scene" << setw(2) << setfill('0') << scene_i << ".jpg";
+        sequenceFiles.push_back(filename.str());
+    }
+    sequenceFiles.push_back(dataDir + "/conesH/im2.ppm");
+    sequenceFiles.push_back(dataDir + "/conesH/im6.ppm");
+    cv::Mat consumerWork;
+    auto consume = [&](const cv::Mat &image) { cv::GaussianBlur(image, consumerWork, cv::Size(9, 9), 0); };
+
+    stage.name = "decode/imread_sequence";
+    stage.description = "imread then blur each image of the extra credit sequence and the cones pair, one after the other";
+    stage.run = [&]()
+    {
+        for (size_t file_i = 0; file_i < sequenceFiles.size(); file_i++)
+        {
+            consume(cv::imread(sequenceFiles[file_i], cv::IMREAD_COLOR));
+        }
+    };
+    stages.push_back(stage);
+
+    stage.name = "decode/image_source_sequence";
+    stage.description = "the same sequence through ImageSource (lookahead 4), decoding ahead while each image is blurred";
+    stage.run = [&]()
+    {
+        ImageSource source(sequenceFiles, cv::IMREAD_COLOR, 4);
+        SourceImage frame;
+        while (source.next(frame))
+        {
+            consume(frame.image);
+        }
+    };
+    stages.push_back(stage);
+
+    stage.name = "rectify/remap";
+    stage.description = "remap both extra credit scenes with the rectification maps";
+    stage.run = [&]() { rectifyPair(rectification, sceneLeft, sceneRight, sceneLeftRectified, sceneRightRectified); };
+    stages.push_back(stage);
+
+    cv::Mat sceneLeftValid, sceneRightValid;
+    stage.name = "rectify/remap_valid";
+    stage.description = "remap only the valid region of both extra credit scenes";
+    stage.run = [&]() { rectifyPair(rectification, sceneLeft, sceneRight, sceneLeftValid, sceneRightValid, true); };
+    stages.push_back(stage);
+
+    stage.name = "match/stereo_bm_cones";
+    stage.description = "StereoBM::compute on the cones pair (128 disparities, 21x21 window)";
+    stage.run = [&]() { sbm->compute(conesLeftGray, conesRightGray, disparity16S); };
+    stages.push_back(stage);
+
+    cv::Mat sceneDisparity16S;
+    stage.name = "match/stereo_bm_scene";
+    stage.description = "StereoBM::compute on the rectified extra credit pair";
+    stage.run = [&]() { sbm->compute(sceneLeftGray, sceneRightGray, sceneDisparity16S); };
+    stages.push_back(stage);
+
+    // note: the first four extra credit scenes, all rectified with the left maps; scene00 is the reference, 1 to 3
+    // steps from the others
+    vector<cv::Mat> railFrames;
+    for (int scene_i = 1; scene_i <= 3; scene_i++)
+    {
+        cv::Mat frame = cv::imread(sequenceFiles[scene_i], cv::IMREAD_GRAYSCALE), rectified;
+        cv::remap(frame, rectified, rectification.leftXMap, rectification.leftYMap, cv::INTER_LINEAR);
+        railFrames.push_back(rectified);
+    }
+    vector<int> railOffsets;
+    railOffsets.push_back(1);
+    railOffsets.push_back(2);
+    railOffsets.push_back(3);
+    MultiBaselineMatcher multiBaselineMatcher(matcher.ndisparities(), matcher.SADWindowSize());
+    cv::Mat multiBaselineDisparity8U;
+    stage.name = "match/multi_baseline_scene";
+    stage.description = "MultiBaselineMatcher of rectified scene00 against scenes 01 to 03 at once (summed costs)";
+    stage.run = [&]() { multiBaselineMatcher.compute(sceneLeftGray, railFrames, railOffsets, multiBaselineDisparity8U); };
+    stages.push_back(stage);
+
+    stage.name = "match/multi_baseline_scene_pairs";
+    stage.description = "MultiBaselineMatcher of rectified scene00 against scenes 01 to 03 one at a time (the pairs before fusing)";
+    stage.run = [&]()
+    {
+        for (size_t frame_i = 0; frame_i < railFrames.size(); frame_i++)
+        {
+            multiBaselineMatcher.compute(sceneLeftGray, vector<cv::Mat>(1, railFrames[frame_i]), vector<int>(1, railOffsets[frame_i]),
+                                         multiBaselineDisparity8U);
+        }
+    };
+    stages.push_back(stage);
+
+    // note: the extra credit scene's disparity is mostly invalid, so this is close to the worst case for filling
+    cv::Mat sceneFilled16S, sceneFilledMask;
+    sbm->compute(sceneLeftGray, sceneRightGray, sceneDisparity16S);
+    stage.name = "postprocess/fill_holes_scene";
+    stage.description = "fillDisparityHoles of the extra credit scene's StereoBM disparity (scanlines, then a 7x7 weighted median)";
+    stage.run = [&]() { fillDisparityHoles(sceneDisparity16S, sceneLeftGray, sceneFilled16S, sceneFilledMask); };
+    stages.push_back(stage);
+
+    // note: the extra credit scenes have large uniform regions, which the texture threshold skips
+    DisparityMatcher texturedMatcher;
+    texturedMatcher.setTextureThreshold(_textureThreshold);
+    cv::Mat texturedDisparity8U, blockMask;
+    stage.name = "match/texture_mask_scene";
+    stage.description = "Sobel and integral image texture mask of the rectified extra credit left scene (16x16 blocks)";
+    stage.run = [&]() { computeTextureMask(sceneLeftGray, 16, _textureThreshold, blockMask); };
+    stages.push_back(stage);
+
+    stage.name = "match/stereo_bm_textured_scene";
+    stage.description = "DisparityMatcher on the rectified extra credit pair, matching textured blocks only";
+    stage.run = [&]() { texturedMatcher.compute(sceneLeftGray, sceneRightGray, texturedDisparity8U); };
+    stages.push_back(stage);
+
+    // note: two radii, to show the guided filter's cost does not depend on the window size
+    GuidedFilterMatcher guidedMatcher4(matcher.ndisparities(), 4), guidedMatcher16(matcher.ndisparities(), 16);
+    cv::Mat guidedDisparity8U;
+    stage.name = "match/guided_cones_r4";
+    stage.description = "GuidedFilterMatcher on the color cones pair (128 disparities, radius 4)";
+    stage.run = [&]() { guidedMatcher4.compute(conesLeft, conesRight, guidedDisparity8U); };
+    stages.push_back(stage);
+
+    stage.name = "match/guided_cones_r16";
+    stage.description = "GuidedFilterMatcher on the color cones pair (128 disparities, radius 16)";
+    stage.run = [&]() { guidedMatcher16.compute(conesLeft, conesRight, guidedDisparity8U); };
+    stages.push_back(stage);
+
+    cv::Mat normalized;
+    stage.name = "normalize/minmax_convert";
+    stage.description = "minMaxLoc and convertTo 8 bits of the cones disparity";
+    stage.run = [&]()
+    {
+        double minVal, maxVal;
+        cv::minMaxLoc(disparity16S, &minVal, &maxVal);
+        disparity16S.convertTo(normalized, CV_8UC1, 255/(maxVal - minVal));
+    };
+    stages.push_back(stage);
+
+    stage.name = "reproject/reproject_image_to_3d";
+    stage.description = "reprojectImageTo3D of the cones disparity with the simple Q";
+    stage.run = [&]() { reprojectDisparity(disparity8U, Q, XYZ); };
+    stages.push_back(stage);
+
+    cv::Mat normals;
+    stage.name = "normals/integral_cones";
+    stage.description = "estimateNormals of the cones point cloud (7x7 window, integral images)";
+    stage.run = [&]() { estimateNormals(XYZ, 3, normals); };
+    stages.push_back(stage);
+
+    stage.name = "write/pts";
+    stage.description = "format the cones point cloud as pts text (in memory)";
+    stage.run = [&]()
+    {
+        ostringstream out;
+        writePointCloud(out, XYZ, conesLeft);
+    };
+    stages.push_back(stage);
+
+    stage.name = "parse/load_points";
+    stage.description = "render_point_cloud's points file parse of the cones point cloud";
+    stage.run = [&]()
+    {
+        vector<Point> points;
+        loadPointsFile(_pointsFile, points);
+    };
+    stages.push_back(stage);
+
+    // note: a synthetic cloud, since the cones cloud is well under a million points; three planes (a floor, a wall and
+    // a tilted plane) with 1% noise plus 25% uniform clutter
+    PlanePoints syntheticCloud;
+    {
+        std::mt19937 random(12345);
+        std::uniform_real_distribution<float> uniform(-1000.0F, 1000.0F);
+        std::normal_distribution<float> noise(0.0F, 2.0F);
+        const size_t npoints = 3000000;
+        for (size_t point_i = 0; point_i < npoints; point_i++)
+        {
+            float u = uniform(random), v = uniform(random);
+            float x, y, z;
+            switch (point_i % 4)
+            {
+            case 0: x = u; y = 500.0F + noise(random); z = 2000.0F + v; break;             // floor
+            case 1: x = u; y = v; z = 3000.0F + noise(random); break;                      // back wall
+            case 2: x = u; y = v; z = 2000.0F + 0.5F*u + 0.25F*v + noise(random); break;   // tilted plane
+            default: x = u; y = v; z = 2000.0F + uniform(random); break;                   // clutter
+            }
+            syntheticCloud.x.push_back(x);
+            syntheticCloud.y.push_back(y);
+            syntheticCloud.z.push_back(z);
+        }
+    }
+    PlaneExtractionOptions planeOptions;
+    planeOptions.threshold = 10.0F;
+    planeOptions.minInliers = syntheticCloud.size()/10;
+    stage.name = "planes/ransac_synthetic";
+    stage.description = "extractPlanes of 3 planes from a synthetic 3M point cloud (3 planes plus clutter)";
+    stage.run = [&]()
+    {
+        vector<ExtractedPlane> planes;
+        vector<uint32_t> residual;
+        extractPlanes(syntheticCloud, planeOptions, planes, residual);
+    };
+    stages.push_back(stage);
+
+    stage.name = "detect/chessboard";
+    stage.description = "findChessboardCorners and cornerSubPix over every image in calibration/images";
+    stage.run = [&]()
+    {
+        cv::Mat gray;
+        vector<cv::Point2f> corners;
+        for (size_t image_i = 0; image_i < calibrationImages.size(); image_i++)
+        {
+            if (cv::findChessboardCorners(calibrationImages[image_i], boardSize, corners,
+                                          cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_FAST_CHECK | cv::CALIB_CB_NORMALIZE_IMAGE))
+            {
+                cv::cvtColor(calibrationImages[image_i], gray, cv::COLOR_BGR2GRAY);
+                cv::cornerSubPix(gray, corners, cv::Size(11, 11), cv::Size(-1, -1),
+                                 cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.1));
+            }
+        }
+    };
+    stages.push_back(stage);
+
+    // run the selected stages
+    vector<StageResult> results;
+    cerr.setf(ios_base::fixed);
+    cerr.precision(3);
+    for (size_t stage_i = 0; stage_i < stages.size(); stage_i++)
+    {
+        if (!matchesFilter(stages[stage_i].name, filters))
+        {
+            continue;
+        }
+        results.push_back(runStage(stages[stage_i]));
+        const TimingSummary &s = results.back().summary;
+        cerr << setw(32) << left << stages[stage_i].name << right << " mean " << setw(9) << s.mean << " ms, stddev " << setw(8) << s.stddev
+             << ", p50 " << setw(9) << s.p50 << ", p90 " << setw(9) << s.p90 << ", max " << setw(9) << s.max << endl;
+    }
+    remove(_pointsFile.c_str());
+    if (matchesFilter("match/stereo_bm_textured_scene", filters))
+    {
+        cerr << "textured matching skipped " << 100.0*texturedMatcher.skippedFraction() << "% of the extra credit scene's pixels, matching "
+             << 100.0*texturedMatcher.windowFraction() << "% of the image" << endl;
+    }
+    if (matchesFilter("match/multi_baseline_scene", filters))
+    {
+        // its costs are means of integer sums, so exact ties between chunks are common; they must not change the result
+        MultiBaselineMatcher serialMatcher(multiBaselineMatcher.ndisparities(), multiBaselineMatcher.windowSize(), multiBaselineMatcher.truncation(), 1);
+        multiBaselineMatcher.compute(sceneLeftGray, railFrames, railOffsets, multiBaselineDisparity8U);
+        serialMatcher.compute(sceneLeftGray, railFrames, railOffsets, multiBaselineDisparity8U);
+        int differing = cv::countNonZero(serialMatcher.rawDisparity() != multiBaselineMatcher.rawDisparity());
+        if (differing > 0)
+        {
+            cerr << "error: multi-baseline matching on one thread differs from the default thread count at " << differing << " pixels" << endl;
+            return 1;
+        }
+    }
+    if (matchesFilter("postprocess/fill_holes_scene", filters))
+    {
+        cerr << "hole filling filled " << 100.0*cv::countNonZero(sceneFilledMask)/sceneFilledMask.total() << "% of the extra credit scene's pixels" << endl;
+    }
+    if (matchesFilter("match/guided_cones", filters))
+    {
+        // edge accuracy against the cones ground truth (disparities times 4)
+        guidedMatcher4.compute(conesLeft, conesRight, guidedDisparity8U);
+        guidedMatcher16.compute(conesLeft, conesRight, guidedDisparity8U);
+        DisparityAccuracy accuracy[3] = {evaluateDisparity(disparity16S, conesTruth), evaluateDisparity(guidedMatcher4.rawDisparity(), conesTruth),
+                                         evaluateDisparity(guidedMatcher16.rawDisparity(), conesTruth)};
+        const char *labels[3] = {"stereo BM (21x21)", "guided (radius 4)", "guided (radius 16)"};
+        for (int engine_i = 0; engine_i < 3; engine_i++)
+        {
+            cerr << "cones " << labels[engine_i] << ": bad " << 100.0*accuracy[engine_i].badFraction << "%, bad near depth edges "
+                 << 100.0*accuracy[engine_i].edgeBadFraction << "%, mean error " << accuracy[engine_i].meanError << " pixels" << endl;
+        }
+
+        // the chunks of disparities finish in any order, which must not change the result
+        GuidedFilterMatcher serialMatcher(matcher.ndisparities(), 4, guidedMatcher4.epsilon(), 1);
+        serialMatcher.compute(conesLeft, conesRight, guidedDisparity8U);
+        int differing = cv::countNonZero(serialMatcher.rawDisparity() != guidedMatcher4.rawDisparity());
+        if (differing > 0)
+        {
+            cerr << "error: guided matching on one thread differs from the default thread count at " << differing << " pixels" << endl;
+            return 1;
+        }
+    }
+
+    if (results.empty())
+    {
+        cerr << "error: no stage matches the filter" << endl;
+        return 1;
+    }
+
+    if (jsonFile.empty())
+    {
+        writeJson(cout, results);
+    }
+    else
+    {
+        ofstream fout(jsonFile.c_str());
+        if (!fout)
+        {
+            cerr << "error: couldn't open file \"" << jsonFile << "\" for output" << endl;
+            return 1;
+        }
+        writeJson(fout, results);
+    }
+
+    return 0;
+}
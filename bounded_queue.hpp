@@ -0,0 +1,100 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+
+// fixed capacity FIFO ring buffer connecting producer and consumer threads
+// note: once close() is called, pushes fail and pops drain what is left, then fail
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity): _slots(capacity), _head(0), _count(0), _closed(false){}
+
+    // blocks while the queue is full; returns false if the queue was closed
+    bool push(const T &item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_count == _slots.size() && !_closed)
+        {
+            _notFull.wait(lock);
+        }
+        if (_closed)
+        {
+            return false;
+        }
+        _slots[(_head + _count) % _slots.size()] = item;
+        _count++;
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    // never blocks; returns false if the queue is full or closed
+    bool tryPush(const T &item)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_count == _slots.size() || _closed)
+        {
+            return false;
+        }
+        _slots[(_head + _count) % _slots.size()] = item;
+        _count++;
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    // blocks while the queue is empty; returns false once it is closed and drained
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_count == 0 && !_closed)
+        {
+            _notEmpty.wait(lock);
+        }
+        if (_count == 0)
+        {
+            return false;
+        }
+        item = _slots[_head];
+        _slots[_head] = T();    // drop the queue's reference so buffers can be reused
+        _head = (_head + 1) % _slots.size();
+        _count--;
+        _notFull.notify_one();
+        return true;
+    }
+
+    void close(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    }
+
+    size_t size(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _count;
+    }
+
+    size_t capacity(void) const { return _slots.size(); }
+
+private:
+    std::vector<T> _slots;
+    size_t _head;
+    size_t _count;
+    bool _closed;
+    std::mutex _mutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+};
+
+#endif // BOUNDED_QUEUE_HPP
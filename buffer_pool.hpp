@@ -0,0 +1,163 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <opencv2/core.hpp>
+
+
+// recycled frame buffers for streaming stereo
+//
+// buffers are page-aligned, pre-faulted (every page touched once when the buffer is created, so first use does not
+// page-fault) and kept in buckets by page-rounded size; a stream of same-sized frames therefore allocates each
+// buffer once and reuses it from then on
+// note: buffers are handed out through a FrameBuffers, which returns all of them to the pool at the end of the frame;
+// Mats obtained from it do not own their memory and must not be used after the frame is released
+
+
+// counters for reporting
+struct BufferPoolStats
+{
+    size_t allocations;         // buffers created
+    size_t reuses;              // requests served from the pool, i.e. allocations avoided
+    size_t outstanding;         // buffers currently handed out
+    size_t pooledBytes;         // bytes currently owned by the pool (handed out or free)
+    size_t peakPooledBytes;
+    BufferPoolStats(void): allocations(0), reuses(0), outstanding(0), pooledBytes(0), peakPooledBytes(0){}
+};
+
+
+class BufferPool
+{
+public:
+    static const size_t pageSize = 4096;
+
+    BufferPool(void){}
+
+    ~BufferPool(void)
+    {
+        for (std::map<size_t, std::vector<void *> >::iterator it = _free.begin(); it != _free.end(); ++it)
+        {
+            for (size_t buffer_i = 0; buffer_i < it->second.size(); buffer_i++)
+            {
+                free(it->second[buffer_i]);
+            }
+        }
+    }
+
+    // a buffer of at least nbytes; bucketSize receives the size it must be returned with
+    void *acquire(size_t nbytes, size_t &bucketSize)
+    {
+        bucketSize = (nbytes + pageSize - 1)/pageSize*pageSize;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::vector<void *> &bucket = _free[bucketSize];
+            _stats.outstanding++;
+            if (!bucket.empty())
+            {
+                void *buffer = bucket.back();
+                bucket.pop_back();
+                _stats.reuses++;
+                return buffer;
+            }
+            _stats.allocations++;
+            _stats.pooledBytes += bucketSize;
+            _stats.peakPooledBytes = std::max(_stats.peakPooledBytes, _stats.pooledBytes);
+        }
+
+        // allocate and pre-fault outside the lock
+        void *buffer = 0;
+        if (posix_memalign(&buffer, pageSize, bucketSize) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        for (size_t offset = 0; offset < bucketSize; offset += pageSize)
+        {
+            static_cast<volatile char *>(buffer)[offset] = 0;
+        }
+        return buffer;
+    }
+
+    void release(void *buffer, size_t bucketSize)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _free[bucketSize].push_back(buffer);
+        _stats.outstanding--;
+    }
+
+    BufferPoolStats stats(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats;
+    }
+
+private:
+    BufferPool(const BufferPool &);
+    BufferPool &operator=(const BufferPool &);
+
+    std::mutex _mutex;
+    std::map<size_t, std::vector<void *> > _free;
+    BufferPoolStats _stats;
+};
+
+
+// the buffers used by one frame; all of them go back to the pool on release() or destruction
+class FrameBuffers
+{
+public:
+    explicit FrameBuffers(BufferPool &pool): _pool(&pool){}
+
+    ~FrameBuffers(void)
+    {
+        release();
+    }
+
+    // a rows x cols Mat of the given type backed by pooled memory
+    // note: OpenCV functions writing into it keep the buffer as long as the size and type they need match
+    cv::Mat mat(int rows, int cols, int type)
+    {
+        size_t step = static_cast<size_t>(cols)*CV_ELEM_SIZE(type);
+        Buffer buffer;
+        buffer.data = _pool->acquire(step*rows, buffer.size);
+        _buffers.push_back(buffer);
+        return cv::Mat(rows, cols, type, buffer.data, step);
+    }
+
+    cv::Mat mat(cv::Size size, int type)
+    {
+        return mat(size.height, size.width, type);
+    }
+
+    void release(void)
+    {
+        for (size_t buffer_i = 0; buffer_i < _buffers.size(); buffer_i++)
+        {
+            _pool->release(_buffers[buffer_i].data, _buffers[buffer_i].size);
+        }
+        _buffers.clear();
+    }
+
+private:
+    FrameBuffers(const FrameBuffers &);
+    FrameBuffers &operator=(const FrameBuffers &);
+
+    struct Buffer
+    {
+        void *data;
+        size_t size;
+    };
+
+    BufferPool *_pool;
+    std::vector<Buffer> _buffers;
+};
+
+#endif // BUFFER_POOL_HPP
@@ -2,8 +2,14 @@
 // paul_r_cannon@yahoo.com
 // 240-344-6081
 
+#include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <time.h>
 #include <stdio.h>
 
@@ -15,6 +21,12 @@
 #include <opencv2/videoio.hpp>
 #include <opencv2/highgui.hpp>
 
+#include "bounded_queue.hpp"
+#include "image_source.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
 #ifndef _CRT_SECURE_NO_WARNINGS
 # define _CRT_SECURE_NO_WARNINGS
 #endif
@@ -25,7 +37,13 @@ using namespace std;
 static void help()
 {
     cout <<  "This is a camera calibration sample." << endl
-         <<  "Usage: calibration configurationFile"  << endl
+         <<  "Usage: calibration configurationFile [--headless [--threads N]] [--compare-detection] [--async]"  << endl
+         <<  "--headless runs pattern detection for an image list across a thread pool, with no windows, "
+             "and reports the time spent in each phase." << endl
+         <<  "--compare-detection reports the latency and corner accuracy of pyramid chessboard detection "
+             "against full resolution detection for an image list." << endl
+         <<  "--async captures, detects and displays on separate threads, so slow detection "
+             "does not stall capture." << endl
          <<  "Near the sample file you'll find the configuration file, which has detailed help of "
              "how to edit it.  It may be any OpenCV supported file format XML/YAML." << endl;
 }
@@ -44,9 +62,11 @@ public:
                   << "Square_Size"         << squareSize
                   << "Calibrate_Pattern" << patternToUse
                   << "Calibrate_NrOfFrameToUse" << nrFrames
+                  << "Calibrate_CandidatePoolSize" << candidatePoolSize
                   << "Calibrate_FixAspectRatio" << aspectRatio
                   << "Calibrate_AssumeZeroTangentialDistortion" << calibZeroTangentDist
                   << "Calibrate_FixPrincipalPointAtTheCenter" << calibFixPrincipalPoint
+                  << "Calibrate_PyramidMaxWidth" << pyramidMaxWidth
 
                   << "Write_DetectedFeaturePoints" << writePoints
                   << "Write_extrinsicParameters"   << writeExtrinsics
@@ -56,6 +76,7 @@ public:
 
                   << "Input_FlipAroundHorizontalAxis" << flipVertical
                   << "Input_Delay" << delay
+                  << "Input_DetectionCache" << detectionCache
                   << "Input" << input
            << "}";
     }
@@ -66,16 +87,19 @@ public:
         node["Calibrate_Pattern"] >> patternToUse;
         node["Square_Size"]  >> squareSize;
         node["Calibrate_NrOfFrameToUse"] >> nrFrames;
+        node["Calibrate_CandidatePoolSize"] >> candidatePoolSize;
         node["Calibrate_FixAspectRatio"] >> aspectRatio;
         node["Write_DetectedFeaturePoints"] >> writePoints;
         node["Write_extrinsicParameters"] >> writeExtrinsics;
         node["Write_outputFileName"] >> outputFileName;
         node["Calibrate_AssumeZeroTangentialDistortion"] >> calibZeroTangentDist;
         node["Calibrate_FixPrincipalPointAtTheCenter"] >> calibFixPrincipalPoint;
+        node["Calibrate_PyramidMaxWidth"] >> pyramidMaxWidth;
         node["Input_FlipAroundHorizontalAxis"] >> flipVertical;
         node["Show_UndistortedImage"] >> showUndistorsed;
         node["Input"] >> input;
         node["Input_Delay"] >> delay;
+        node["Input_DetectionCache"] >> detectionCache;
         validate();
     }
     void validate()
@@ -146,10 +170,19 @@ public:
             goodInput = false;
         }
         atImageList = 0;
+        imageSource.reset();
 
     }
+    // Number of detections to capture before calibrating
+    size_t captureTarget() const
+    {
+        if( inputType != IMAGE_LIST && candidatePoolSize > nrFrames )
+            return (size_t)candidatePoolSize;
+        return (size_t)nrFrames;
+    }
     Mat nextImage()
     {
+        TRACE_SCOPE("next_image");
         Mat result;
         if( inputCapture.isOpened() )
         {
@@ -158,10 +191,32 @@ public:
             view0.copyTo(result);
         }
         else if( atImageList < imageList.size() )
-            result = imread(imageList[atImageList++], IMREAD_COLOR);
+            result = nextListImage();
 
         return result;
     }
+    // Read the next frame into result, reusing its buffer when the source allows; false at the end
+    bool nextImage(Mat& result)
+    {
+        TRACE_SCOPE("next_image");
+        if( inputCapture.isOpened() )
+            inputCapture >> result;
+        else if( atImageList < imageList.size() )
+            result = nextListImage();
+        else
+            result.release();
+        return !result.empty();
+    }
+    // The next image of the list; a background pool decodes the following ones while this one is processed
+    Mat nextListImage()
+    {
+        if( !imageSource )
+            imageSource = make_shared<ImageSource>(imageList, IMREAD_COLOR, 4);
+        SourceImage frame;
+        imageSource->next(frame);
+        atImageList++;
+        return frame.image;
+    }
 
     static bool readStringList( const string& filename, vector<string>& l )
     {
@@ -182,20 +237,24 @@ public:
     Pattern calibrationPattern;  // One of the Chessboard, circles, or asymmetric circle pattern
     float squareSize;            // The size of a square in your defined unit (point, millimeter,etc).
     int nrFrames;                // The number of frames to use from the input for calibration
+    int candidatePoolSize;       // For camera/video, detections to collect before selecting nrFrames of them (0 = no selection)
     float aspectRatio;           // The aspect ratio
     int delay;                   // In case of a video input
     bool writePoints;            // Write detected feature points
     bool writeExtrinsics;        // Write extrinsic parameters
     bool calibZeroTangentDist;   // Assume zero tangential distortion
     bool calibFixPrincipalPoint; // Fix the principal point at the center
+    int pyramidMaxWidth;         // Search for the chessboard on an image downscaled to at most this width (0 = full resolution)
     bool flipVertical;           // Flip the captured images around the horizontal axis
     string outputFileName;       // The name of the file where to write
     bool showUndistorsed;        // Show undistorted images after calibration
     string input;                // The input ->
+    string detectionCache;       // File caching the detected points of an image list (empty = no cache)
 
     int cameraID;
     vector<string> imageList;
     size_t atImageList;
+    shared_ptr<ImageSource> imageSource;  // Decodes the image list ahead of atImageList
     VideoCapture inputCapture;
     InputType inputType;
     bool goodInput;
@@ -220,18 +279,172 @@ static inline void write(FileStorage& fs, const String&, const Settings& s )
     s.write(fs);
 }
 
+//! [detection_cache]
+// Persistent cache of pattern detections for image list inputs, so that recalibrating with new flags
+// only redoes the solve. Entries are keyed by a hash of the image file contents; the whole cache is
+// discarded when the board, pattern or detection options it was built with differ from the settings.
+class DetectionCache
+{
+public:
+    struct Entry
+    {
+        Entry() : found(false) {}
+        Size imageSize;
+        bool found;
+        vector<Point2f> pointBuf;
+    };
+
+    DetectionCache() : hits(0), misses(0), dirty(false) {}
+
+    // returns false if there is no usable cache file yet
+    bool load(const Settings& s)
+    {
+        filename = s.detectionCache;
+        FileStorage fs(filename, FileStorage::READ);
+        if( !fs.isOpened() )
+            return false;
+        Size boardSize;
+        int pattern = Settings::NOT_EXISTING, flipVertical = 0, pyramidMaxWidth = 0;
+        fs["board_Size"] >> boardSize;
+        fs["pattern"] >> pattern;
+        fs["flip_vertical"] >> flipVertical;
+        fs["pyramid_max_width"] >> pyramidMaxWidth;
+        if( boardSize != s.boardSize || pattern != s.calibrationPattern ||
+            (flipVertical != 0) != s.flipVertical || pyramidMaxWidth != s.pyramidMaxWidth )
+        {
+            cout << "Detection settings changed, ignoring cache " << filename << endl;
+            return false;
+        }
+        FileNode images = fs["images"];
+        for( FileNodeIterator it = images.begin(); it != images.end(); ++it )
+        {
+            FileNode n = *it;
+            string hash;
+            int found = 0;
+            Entry e;
+            n["hash"] >> hash;
+            n["image_Size"] >> e.imageSize;
+            n["found"] >> found;
+            e.found = found != 0;
+            if( e.found )
+                n["points"] >> e.pointBuf;
+            entries[hash] = e;
+        }
+        return true;
+    }
+
+    bool save(const Settings& s) const
+    {
+        FileStorage fs(filename, FileStorage::WRITE);
+        if( !fs.isOpened() )
+            return false;
+        fs << "board_Size" << s.boardSize
+           << "pattern" << (int)s.calibrationPattern
+           << "flip_vertical" << (int)s.flipVertical
+           << "pyramid_max_width" << s.pyramidMaxWidth;
+        fs << "images" << "[";
+        for( map<string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it )
+        {
+            fs << "{" << "hash" << it->first
+                      << "image_Size" << it->second.imageSize
+                      << "found" << (int)it->second.found;
+            if( it->second.found )
+                fs << "points" << it->second.pointBuf;
+            fs << "}";
+        }
+        fs << "]";
+        return true;
+    }
+
+    // safe to call from several detection threads at once
+    bool lookup(const string& hash, Entry& e)
+    {
+        lock_guard<mutex> lock(guard);
+        map<string, Entry>::const_iterator it = entries.find(hash);
+        if( it == entries.end() )
+        {
+            misses++;
+            return false;
+        }
+        hits++;
+        e = it->second;
+        return true;
+    }
+
+    void store(const string& hash, const Entry& e)
+    {
+        lock_guard<mutex> lock(guard);
+        entries[hash] = e;
+        dirty = true;
+    }
+
+    string filename;
+    size_t hits, misses;
+    bool dirty;
+
+private:
+    map<string, Entry> entries;
+    mutex guard;
+};
+
+// Read a whole file and hash its contents with 64 bit FNV-1a; returns an empty hash if unreadable
+static string hashFileContents( const string& filename, vector<uchar>& contents )
+{
+    TRACE_SCOPE("hash_image");
+    ifstream file(filename.c_str(), ios::binary);
+    contents.clear();
+    if( !file )
+        return string();
+    contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+
+    unsigned long long hash = 14695981039346656037ULL;
+    for( size_t i = 0; i < contents.size(); i++ )
+    {
+        hash ^= contents[i];
+        hash *= 1099511628211ULL;
+    }
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", hash);
+    return text;
+}
+//! [detection_cache]
+
 enum { DETECTION = 0, CAPTURING = 1, CALIBRATED = 2 };
 
 bool runCalibrationAndSave(Settings& s, Size imageSize, Mat&  cameraMatrix, Mat& distCoeffs,
                            vector<vector<Point2f> > imagePoints );
+static bool findPattern( const Settings& s, const Mat& view, vector<Point2f>& pointBuf );
+static int runHeadless( Settings& s, DetectionCache* cache, int nthreads );
+static int compareDetection( Settings& s );
+static int runAsync( Settings& s );
 
 int main(int argc, char* argv[])
 {
     help();
 
+    // parse command line options
+    string inputSettingsFile = "default.xml";
+    bool headless = false;
+    bool compare = false;
+    bool async = false;
+    int nthreads = 0;
+    for( int i = 1; i < argc; i++ )
+    {
+        string arg = argv[i];
+        if( arg == "--headless" )
+            headless = true;
+        else if( arg == "--compare-detection" )
+            compare = true;
+        else if( arg == "--async" )
+            async = true;
+        else if( arg == "--threads" && i + 1 < argc )
+            nthreads = atoi(argv[++i]);
+        else
+            inputSettingsFile = arg;
+    }
+
     //! [file_read]
     Settings s;
-    const string inputSettingsFile = argc > 1 ? argv[1] : "default.xml";
     FileStorage fs(inputSettingsFile, FileStorage::READ); // Read the settings
     if (!fs.isOpened())
     {
@@ -251,8 +464,22 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    if( compare )
+        return compareDetection(s);
+    if( async )
+        return runAsync(s);
+
+    // reuse the detections of earlier runs for image files that have not changed
+    DetectionCache cache;
+    bool useCache = !s.detectionCache.empty() && s.inputType == Settings::IMAGE_LIST;
+    if( useCache )
+        cache.load(s);
+
+    if( headless )
+        return runHeadless(s, useCache ? &cache : 0, nthreads);
+
     vector<vector<Point2f> > imagePoints;
-    Mat cameraMatrix, distCoeffs;
+    Mat cameraMatrix, distCoeffs, map1, map2;
     Size imageSize;
     int mode = s.inputType == Settings::IMAGE_LIST ? CAPTURING : DETECTION;
     clock_t prevTimestamp = 0;
@@ -268,10 +495,15 @@ int main(int argc, char* argv[])
         view = s.nextImage();
 
         //-----  If no more image, or got enough, then stop calibration and show result -------------
-        if( mode == CAPTURING && imagePoints.size() >= (size_t)s.nrFrames )
+        if( mode == CAPTURING && imagePoints.size() >= s.captureTarget() )
         {
           if( runCalibrationAndSave(s, imageSize,  cameraMatrix, distCoeffs, imagePoints))
+          {
               mode = CALIBRATED;
+              // the undistortion maps only change with the calibration, so build them once
+              initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), cameraMatrix, imageSize, CV_16SC2,
+                                      map1, map2);
+          }
           else
               mode = DETECTION;
         }
@@ -289,38 +521,34 @@ int main(int argc, char* argv[])
 
         //! [find_pattern]
         vector<Point2f> pointBuf;
-
         bool found;
-        switch( s.calibrationPattern ) // Find feature points on the input format
+        string hash;
+        DetectionCache::Entry cached;
+        if( useCache )
         {
-        case Settings::CHESSBOARD:
-            found = findChessboardCorners( view, s.boardSize, pointBuf,
-                CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_FAST_CHECK | CALIB_CB_NORMALIZE_IMAGE);
-//            waitKey(0);
-            break;
-        case Settings::CIRCLES_GRID:
-            found = findCirclesGrid( view, s.boardSize, pointBuf );
-            break;
-        case Settings::ASYMMETRIC_CIRCLES_GRID:
-            found = findCirclesGrid( view, s.boardSize, pointBuf, CALIB_CB_ASYMMETRIC_GRID );
-            break;
-        default:
-            found = false;
-            break;
+            vector<uchar> contents;
+            hash = hashFileContents(s.imageList[s.atImageList - 1], contents);
+        }
+        if( !hash.empty() && cache.lookup(hash, cached) )
+        {
+            found = cached.found;
+            pointBuf = cached.pointBuf;
+        }
+        else
+        {
+            found = findPattern(s, view, pointBuf);
+            if( !hash.empty() )
+            {
+                cached.imageSize = imageSize;
+                cached.found = found;
+                cached.pointBuf = pointBuf;
+                cache.store(hash, cached);
+            }
         }
         //! [find_pattern]
         //! [pattern_found]
         if ( found)                // If done with success,
         {
-              // improve the found corners' coordinate accuracy for chessboard
-                if( s.calibrationPattern == Settings::CHESSBOARD)
-                {
-                    Mat viewGray;
-                    cvtColor(view, viewGray, COLOR_BGR2GRAY);
-                    cornerSubPix( viewGray, pointBuf, Size(11,11),
-                        Size(-1,-1), TermCriteria( TermCriteria::EPS+TermCriteria::COUNT, 30, 0.1 ));
-                }
-
                 if( mode == CAPTURING &&  // For camera only take new samples after delay time
                     (!s.inputCapture.isOpened() || clock() - prevTimestamp > s.delay*1e-3*CLOCKS_PER_SEC) )
                 {
@@ -345,9 +573,9 @@ int main(int argc, char* argv[])
         if( mode == CAPTURING )
         {
             if(s.showUndistorsed)
-                msg = format( "%d/%d Undist", (int)imagePoints.size(), s.nrFrames );
+                msg = format( "%d/%d Undist", (int)imagePoints.size(), (int)s.captureTarget() );
             else
-                msg = format( "%d/%d", (int)imagePoints.size(), s.nrFrames );
+                msg = format( "%d/%d", (int)imagePoints.size(), (int)s.captureTarget() );
         }
 
         putText( view, msg, textOrigin, 1, 1, mode == CALIBRATED ?  GREEN : RED);
@@ -359,8 +587,10 @@ int main(int argc, char* argv[])
         //! [output_undistorted]
         if( mode == CALIBRATED && s.showUndistorsed )
         {
-            Mat temp = view.clone();
-            undistort(temp, view, cameraMatrix, distCoeffs);
+            TRACE_SCOPE("undistort_remap");
+            Mat temp;
+            remap(view, temp, map1, map2, INTER_LINEAR);
+            view = temp;
         }
         //! [output_undistorted]
         //------------------------------ Show image and check for input commands -------------------
@@ -382,6 +612,9 @@ int main(int argc, char* argv[])
         //! [await_input]
     }
 
+    if( useCache && cache.dirty && !cache.save(s) )
+        cerr << "Could not write the detection cache " << s.detectionCache << endl;
+
     // -----------------------Show the undistorted image for the image list ------------------------
     //! [show_results]
     if( s.inputType == Settings::IMAGE_LIST && s.showUndistorsed )
@@ -391,9 +624,11 @@ int main(int argc, char* argv[])
             getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, imageSize, 1, imageSize, 0),
             imageSize, CV_16SC2, map1, map2);
 
-        for(size_t i = 0; i < s.imageList.size(); i++ )
+        ImageSource source(s.imageList, IMREAD_COLOR, 4);
+        SourceImage frame;
+        while( source.next(frame) )
         {
-            view = imread(s.imageList[i], 1);
+            view = frame.image;
             if(view.empty())
                 continue;
             remap(view, rview, map1, map2, INTER_LINEAR);
@@ -408,6 +643,466 @@ int main(int argc, char* argv[])
     return 0;
 }
 
+//! [find_pattern]
+// Find chessboard corners and refine them to subpixel accuracy.
+// If pyramidMaxWidth is positive and the image is wider, the board is first searched for on an image
+// halved (pyrDown) until it is at most that wide; the corners found there are scaled back up and refined
+// at full resolution. If the downscaled search fails, the full resolution image is searched instead.
+static bool findChessboard( const Mat& view, Size boardSize, vector<Point2f>& pointBuf, int pyramidMaxWidth,
+                            bool* usedPyramid = 0 )
+{
+    TRACE_SCOPE("find_chessboard");
+    const int flags = CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_FAST_CHECK | CALIB_CB_NORMALIZE_IMAGE;
+    bool found = false;
+    if( usedPyramid )
+        *usedPyramid = false;
+
+    if( pyramidMaxWidth > 0 && view.cols > pyramidMaxWidth )
+    {
+        TRACE_SCOPE("pyramid_search");
+        Mat small = view;
+        int scale = 1;
+        while( small.cols > pyramidMaxWidth )
+        {
+            Mat next;
+            pyrDown(small, next);
+            small = next;
+            scale *= 2;
+        }
+        found = findChessboardCorners( small, boardSize, pointBuf, flags );
+        if( found )
+        {
+            // pyrDown sample i is centered on full resolution pixel scale*i
+            for( size_t i = 0; i < pointBuf.size(); i++ )
+                pointBuf[i] *= (float)scale;
+            if( usedPyramid )
+                *usedPyramid = true;
+        }
+    }
+    if( !found )
+    {
+        TRACE_SCOPE("full_resolution_search");
+        found = findChessboardCorners( view, boardSize, pointBuf, flags );
+    }
+
+    // improve the found corners' coordinate accuracy; the 11x11 half window also absorbs the
+    // few pixels of error left by upscaling corners from the pyramid
+    if( found )
+    {
+        TRACE_SCOPE("corner_subpix");
+        Mat viewGray;
+        cvtColor(view, viewGray, COLOR_BGR2GRAY);
+        cornerSubPix( viewGray, pointBuf, Size(11,11),
+            Size(-1,-1), TermCriteria( TermCriteria::EPS+TermCriteria::COUNT, 30, 0.1 ));
+    }
+    return found;
+}
+
+// Find feature points on the input format; chessboard corners are refined to subpixel accuracy
+static bool findPattern( const Settings& s, const Mat& view, vector<Point2f>& pointBuf )
+{
+    TRACE_SCOPE("find_pattern");
+    bool found;
+    switch( s.calibrationPattern )
+    {
+    case Settings::CHESSBOARD:
+        found = findChessboard( view, s.boardSize, pointBuf, s.pyramidMaxWidth );
+        break;
+    case Settings::CIRCLES_GRID:
+        found = findCirclesGrid( view, s.boardSize, pointBuf );
+        break;
+    case Settings::ASYMMETRIC_CIRCLES_GRID:
+        found = findCirclesGrid( view, s.boardSize, pointBuf, CALIB_CB_ASYMMETRIC_GRID );
+        break;
+    default:
+        found = false;
+        break;
+    }
+    return found;
+}
+//! [find_pattern]
+
+//! [compare_detection]
+// Run full resolution and pyramid chessboard detection on every image of the list and report the
+// latency of each and how far the pyramid corners are from the full resolution ones
+static int compareDetection( Settings& s )
+{
+    if( s.inputType != Settings::IMAGE_LIST || s.calibrationPattern != Settings::CHESSBOARD )
+    {
+        cerr << "Detection comparison requires a chessboard pattern and an image list input." << endl;
+        return -1;
+    }
+    int pyramidMaxWidth = s.pyramidMaxWidth > 0 ? s.pyramidMaxWidth : 640;
+
+    vector<double> fullMs, pyramidMs;
+    double sumSquaredError = 0, maxError = 0;
+    size_t nCorners = 0, nFallbacks = 0, nReversed = 0;
+    // note: decoding runs ahead on the image source's threads, so only detection is on this thread
+    ImageSource source(s.imageList, IMREAD_COLOR, 4);
+    SourceImage frame;
+    for( size_t i = 0; source.next(frame); i++ )
+    {
+        Mat view = frame.image;
+        if( view.empty() )
+            continue;
+        if( s.flipVertical )
+            flip( view, view, 0 );
+
+        vector<Point2f> fullCorners, pyramidCorners;
+        Stopwatch timer;
+        bool fullFound = findChessboard(view, s.boardSize, fullCorners, 0);
+        fullMs.push_back(timer.elapsedMs());
+
+        bool usedPyramid;
+        timer.restart();
+        bool pyramidFound = findChessboard(view, s.boardSize, pyramidCorners, pyramidMaxWidth, &usedPyramid);
+        pyramidMs.push_back(timer.elapsedMs());
+        if( !usedPyramid )
+            nFallbacks++;
+
+        cout << s.imageList[i] << ": full " << fullMs.back() << " ms, pyramid " << pyramidMs.back() << " ms"
+             << (usedPyramid ? "" : " (fell back to full resolution)");
+        if( fullFound && pyramidFound )
+        {
+            // the two searches may number the corners from opposite ends (a square board, or a 180 degree turn
+            // between them); match the order before diffing so that this does not show up as a board-sized error
+            Point2f toFirst = pyramidCorners.front() - fullCorners.front(), toLast = pyramidCorners.front() - fullCorners.back();
+            bool reversed = toLast.dot(toLast) < toFirst.dot(toFirst);
+            if( reversed )
+            {
+                std::reverse(pyramidCorners.begin(), pyramidCorners.end());
+                nReversed++;
+            }
+            double imageMax = 0;
+            for( size_t j = 0; j < fullCorners.size(); j++ )
+            {
+                Point2f d = pyramidCorners[j] - fullCorners[j];
+                double err = std::sqrt(d.x*d.x + d.y*d.y);
+                sumSquaredError += err*err;
+                imageMax = std::max(imageMax, err);
+            }
+            nCorners += fullCorners.size();
+            maxError = std::max(maxError, imageMax);
+            cout << ", max corner difference " << imageMax << " px" << (reversed ? " (corner order reversed)" : "");
+        }
+        else if( fullFound != pyramidFound )
+            cout << ", found only at " << (fullFound ? "full resolution" : "pyramid level");
+        cout << endl;
+    }
+
+    TimingSummary full = summarizeTimings(fullMs), pyramid = summarizeTimings(pyramidMs);
+    cout << "Pyramid max width: " << pyramidMaxWidth << endl
+         << "Full resolution latency (ms): mean " << full.mean << ", p50 " << full.p50 << ", max " << full.max << endl
+         << "Pyramid latency (ms): mean " << pyramid.mean << ", p50 " << pyramid.p50 << ", max " << pyramid.max << endl
+         << "Fallbacks to full resolution: " << nFallbacks << " of " << pyramidMs.size() << endl
+         << "Corner order reversed between the two searches: " << nReversed << endl;
+    if( nCorners > 0 )
+        cout << "Corner difference vs full resolution: rms " << std::sqrt(sumSquaredError/nCorners)
+             << " px, max " << maxError << " px" << endl;
+    return 0;
+}
+//! [compare_detection]
+
+//! [headless]
+// Detection result for one image of the list
+struct ImageDetection
+{
+    ImageDetection() : decoded(false), found(false), cached(false), decodeMs(0), detectMs(0) {}
+    bool decoded;
+    bool found;
+    bool cached;
+    Size imageSize;
+    vector<Point2f> pointBuf;
+    double decodeMs;
+    double detectMs;
+};
+
+// Detect the pattern in every image of the list across a thread pool, then calibrate from the
+// detections in list order, so that the result does not depend on thread scheduling.
+// Images found in the cache are neither decoded nor searched.
+static int runHeadless( Settings& s, DetectionCache* cache, int nthreads )
+{
+    if( s.inputType != Settings::IMAGE_LIST )
+    {
+        cerr << "Headless mode requires an image list input." << endl;
+        return -1;
+    }
+
+    //----- Phase 1: decode and detect in parallel -----
+    vector<ImageDetection> detections(s.imageList.size());
+    Stopwatch phaseTimer;
+    parallelFor(s.imageList.size(), [&](size_t i)
+    {
+        ImageDetection& d = detections[i];
+        Stopwatch timer;
+        Mat view;
+        string hash;
+        if( cache )
+        {
+            vector<uchar> contents;
+            hash = hashFileContents(s.imageList[i], contents);
+            DetectionCache::Entry e;
+            if( !hash.empty() && cache->lookup(hash, e) )
+            {
+                d.decoded = d.cached = true;
+                d.found = e.found;
+                d.imageSize = e.imageSize;
+                d.pointBuf = e.pointBuf;
+                d.decodeMs = timer.elapsedMs();
+                return;
+            }
+            if( !contents.empty() )
+            {
+                TRACE_SCOPE("decode_image");
+                view = imdecode(contents, IMREAD_COLOR);
+            }
+        }
+        else
+        {
+            TRACE_SCOPE("decode_image");
+            view = imread(s.imageList[i], IMREAD_COLOR);
+        }
+        d.decodeMs = timer.elapsedMs();
+        if( view.empty() )
+            return;
+        d.decoded = true;
+        d.imageSize = view.size();
+        if( s.flipVertical )
+            flip( view, view, 0 );
+
+        timer.restart();
+        d.found = findPattern(s, view, d.pointBuf);
+        d.detectMs = timer.elapsedMs();
+
+        if( !hash.empty() )
+        {
+            DetectionCache::Entry e;
+            e.imageSize = d.imageSize;
+            e.found = d.found;
+            e.pointBuf = d.pointBuf;
+            cache->store(hash, e);
+        }
+    }, nthreads);
+    double detectWallMs = phaseTimer.elapsedMs();
+
+    if( cache )
+    {
+        cout << "Detection cache: " << cache->hits << " hits, " << cache->misses << " misses" << endl;
+        if( cache->dirty && !cache->save(s) )
+            cerr << "Could not write the detection cache " << s.detectionCache << endl;
+    }
+
+    //----- Phase 2: collect the detections in list order -----
+    vector<vector<Point2f> > imagePoints;
+    Size imageSize;
+    double decodeMs = 0, detectMs = 0;
+    for( size_t i = 0; i < detections.size(); i++ )
+    {
+        const ImageDetection& d = detections[i];
+        decodeMs += d.decodeMs;
+        detectMs += d.detectMs;
+        if( !d.decoded )
+            cerr << "Could not read image " << s.imageList[i] << endl;
+        else if( !d.found )
+            cout << "Pattern not found in " << s.imageList[i] << endl;
+        else if( imagePoints.size() < (size_t)s.nrFrames )
+        {
+            if( imagePoints.empty() )
+                imageSize = d.imageSize;
+            imagePoints.push_back(d.pointBuf);
+        }
+    }
+    cout << imagePoints.size() << " of " << detections.size() << " images used for calibration" << endl;
+
+    //----- Phase 3: calibrate -----
+    Mat cameraMatrix, distCoeffs;
+    bool ok = false;
+    phaseTimer.restart();
+    if( !imagePoints.empty() )
+        ok = runCalibrationAndSave(s, imageSize, cameraMatrix, distCoeffs, imagePoints);
+    double calibrateWallMs = phaseTimer.elapsedMs();
+
+    cout << "Threads: " << (nthreads > 0 ? nthreads : defaultThreadCount()) << endl
+         << "Decode + detect wall time: " << detectWallMs << " ms"
+         << " (decode " << decodeMs << " ms, detect " << detectMs << " ms summed over images)" << endl
+         << "Calibration wall time: " << calibrateWallMs << " ms" << endl;
+
+    return ok ? 0 : -1;
+}
+//! [headless]
+
+//! [async]
+// A frame on its way from the detection thread to the display
+struct DetectedFrame
+{
+    DetectedFrame() : found(false), detectMs(0) {}
+    Mat view;
+    bool found;
+    vector<Point2f> pointBuf;
+    double detectMs;
+};
+
+// Live calibration with capture, detection and display on separate threads connected by bounded
+// queues. Frame buffers circulate through a free list so capture reads into recycled memory. With a
+// camera, frames that arrive while detection is behind are dropped rather than stalling capture.
+static int runAsync( Settings& s )
+{
+    const size_t queueCapacity = 2;
+    const size_t frameBuffers = 2*queueCapacity + 3;    // both queues full plus one frame in each stage
+    BoundedQueue<Mat> freeFrames(frameBuffers), captured(queueCapacity);
+    BoundedQueue<DetectedFrame> detected(queueCapacity);
+    for( size_t i = 0; i < frameBuffers; i++ )
+        freeFrames.push(Mat());
+
+    const bool live = s.inputType == Settings::CAMERA;
+    atomic<bool> stop(false);
+    atomic<size_t> nCaptured(0), nDropped(0);
+
+    //----- capture thread -----
+    thread captureThread([&]()
+    {
+        trace::setThreadName("capture");
+        Mat frame;
+        while( !stop && freeFrames.pop(frame) )
+        {
+            if( !s.nextImage(frame) )
+                break;
+            nCaptured++;
+            if( !live )
+            {
+                if( !captured.push(frame) )
+                    break;
+            }
+            else if( !captured.tryPush(frame) )
+            {
+                nDropped++;
+                freeFrames.push(frame);
+            }
+        }
+        captured.close();
+    });
+
+    //----- detection thread -----
+    thread detectThread([&]()
+    {
+        trace::setThreadName("detect");
+        Mat frame;
+        while( captured.pop(frame) )
+        {
+            DetectedFrame d;
+            if( s.flipVertical )
+                flip( frame, frame, 0 );
+            Stopwatch timer;
+            d.found = findPattern(s, frame, d.pointBuf);
+            d.detectMs = timer.elapsedMs();
+            d.view = frame;
+            if( !detected.push(d) )
+                break;
+        }
+        detected.close();
+    });
+
+    //----- display and calibration on the main thread -----
+    vector<vector<Point2f> > imagePoints;
+    Mat cameraMatrix, distCoeffs, map1, map2, rview;
+    Size imageSize;
+    int mode = s.inputType == Settings::IMAGE_LIST ? CAPTURING : DETECTION;
+    clock_t prevTimestamp = 0;
+    const Scalar RED(0,0,255), GREEN(0,255,0);
+    const char ESC_KEY = 27;
+    vector<double> detectMs;
+    Stopwatch runTimer;
+
+    DetectedFrame d;
+    while( detected.pop(d) )
+    {
+        Mat& view = d.view;
+        bool blinkOutput = false;
+        imageSize = view.size();
+        detectMs.push_back(d.detectMs);
+
+        if( d.found )
+        {
+            if( mode == CAPTURING &&  // For camera only take new samples after delay time
+                (!s.inputCapture.isOpened() || clock() - prevTimestamp > s.delay*1e-3*CLOCKS_PER_SEC) )
+            {
+                imagePoints.push_back(d.pointBuf);
+                prevTimestamp = clock();
+                blinkOutput = s.inputCapture.isOpened();
+            }
+            drawChessboardCorners( view, s.boardSize, Mat(d.pointBuf), d.found );
+        }
+
+        if( mode == CAPTURING && imagePoints.size() >= s.captureTarget() )
+        {
+            if( runCalibrationAndSave(s, imageSize, cameraMatrix, distCoeffs, imagePoints) )
+            {
+                mode = CALIBRATED;
+                initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), cameraMatrix, imageSize, CV_16SC2,
+                                        map1, map2);
+            }
+            else
+                mode = DETECTION;
+        }
+
+        string msg = mode == CALIBRATED ? "Calibrated" : "Press 'g' to start";
+        if( mode == CAPTURING )
+            msg = format( s.showUndistorsed ? "%d/%d Undist" : "%d/%d",
+                          (int)imagePoints.size(), (int)s.captureTarget() );
+        int baseLine = 0;
+        Size textSize = getTextSize(msg, 1, 1, 1, &baseLine);
+        Point textOrigin(view.cols - 2*textSize.width - 10, view.rows - 2*baseLine - 10);
+        putText( view, msg, textOrigin, 1, 1, mode == CALIBRATED ?  GREEN : RED);
+        if( blinkOutput )
+            bitwise_not(view, view);
+
+        // cv::remap splits the image across its own worker threads
+        if( mode == CALIBRATED && s.showUndistorsed )
+        {
+            TRACE_SCOPE("undistort_remap");
+            remap(view, rview, map1, map2, INTER_LINEAR);
+            imshow("Image View", rview);
+        }
+        else
+            imshow("Image View", view);
+        char key = (char)waitKey(s.inputCapture.isOpened() ? 1 : s.delay);
+
+        freeFrames.push(view);    // hand the buffer back to the capture thread
+
+        if( key  == ESC_KEY )
+        {
+            stop = true;
+            break;
+        }
+        if( key == 'u' && mode == CALIBRATED )
+           s.showUndistorsed = !s.showUndistorsed;
+        if( s.inputCapture.isOpened() && key == 'g' )
+        {
+            mode = CAPTURING;
+            imagePoints.clear();
+        }
+    }
+
+    freeFrames.close();
+    captured.close();
+    detected.close();
+    captureThread.join();
+    detectThread.join();
+
+    // if calibration threshold was not reached yet, calibrate now
+    if( !stop && mode != CALIBRATED && !imagePoints.empty() )
+        runCalibrationAndSave(s, imageSize, cameraMatrix, distCoeffs, imagePoints);
+
+    double seconds = runTimer.elapsedMs()*1e-3;
+    TimingSummary detection = summarizeTimings(detectMs);
+    cout << "Frames captured: " << nCaptured << ", dropped: " << nDropped
+         << ", displayed: " << detectMs.size() << " (" << detectMs.size()/seconds << " fps)" << endl
+         << "Detection latency (ms): mean " << detection.mean << ", p90 " << detection.p90
+         << ", max " << detection.max << endl;
+    return 0;
+}
+//! [async]
+
 //! [compute_errors]
 static double computeReprojectionErrors( const vector<vector<Point3f> >& objectPoints,
                                          const vector<vector<Point2f> >& imagePoints,
@@ -415,6 +1110,7 @@ static double computeReprojectionErrors( const vector<vector<Point3f> >& objectP
                                          const Mat& cameraMatrix , const Mat& distCoeffs,
                                          vector<float>& perViewErrors)
 {
+    TRACE_SCOPE("reprojection_errors");
     vector<Point2f> imagePoints2;
     size_t totalPoints = 0;
     double totalErr = 0, err;
@@ -476,8 +1172,12 @@ static bool runCalibration( Settings& s, Size& imageSize, Mat& cameraMatrix, Mat
     objectPoints.resize(imagePoints.size(),objectPoints[0]);
 
     //Find intrinsic and extrinsic camera parameters
-    double rms = calibrateCamera(objectPoints, imagePoints, imageSize, cameraMatrix,
-                                 distCoeffs, rvecs, tvecs, s.flag|CALIB_FIX_K4|CALIB_FIX_K5);
+    double rms;
+    {
+        TRACE_SCOPE("calibrate_camera");
+        rms = calibrateCamera(objectPoints, imagePoints, imageSize, cameraMatrix,
+                              distCoeffs, rvecs, tvecs, s.flag|CALIB_FIX_K4|CALIB_FIX_K5);
+    }
 
     cout << "Re-projection error reported by calibrateCamera: "<< rms << endl;
 
@@ -495,6 +1195,7 @@ static void saveCameraParams( Settings& s, Size& imageSize, Mat& cameraMatrix, M
                               const vector<float>& reprojErrs, const vector<vector<Point2f> >& imagePoints,
                               double totalAvgErr )
 {
+    TRACE_SCOPE("save_camera_params");
     FileStorage fs( s.outputFileName, FileStorage::WRITE );
 
     time_t tm;
@@ -567,6 +1268,147 @@ static void saveCameraParams( Settings& s, Size& imageSize, Mat& cameraMatrix, M
     }
 }
 
+//! [select_views]
+// Cells of an 8x8 grid over the image that contain at least one detected point, one bit per cell
+static unsigned long long coverageMask( const vector<Point2f>& pointBuf, Size imageSize )
+{
+    unsigned long long mask = 0;
+    for( size_t i = 0; i < pointBuf.size(); i++ )
+    {
+        int cx = std::min(std::max((int)(pointBuf[i].x*8/imageSize.width), 0), 7);
+        int cy = std::min(std::max((int)(pointBuf[i].y*8/imageSize.height), 0), 7);
+        mask |= 1ULL << (cy*8 + cx);
+    }
+    return mask;
+}
+
+static int countBits( unsigned long long mask )
+{
+    int n = 0;
+    for( ; mask; mask &= mask - 1 )
+        n++;
+    return n;
+}
+
+// Image based description of the board pose, from its four outer points: center, apparent size,
+// foreshortening along both board axes and in-plane rotation. Views far apart in this space constrain
+// the intrinsics differently; near-duplicate views are close together.
+static void boardPoseDescriptor( const vector<Point2f>& pointBuf, Size boardSize, Size imageSize, double d[7] )
+{
+    const Point2f& tl = pointBuf[0];
+    const Point2f& tr = pointBuf[boardSize.width - 1];
+    const Point2f& bl = pointBuf[(boardSize.height - 1)*boardSize.width];
+    const Point2f& br = pointBuf[boardSize.height*boardSize.width - 1];
+
+    double top = norm(tr - tl), bottom = norm(br - bl), left = norm(bl - tl), right = norm(br - tr);
+    double area = 0.5*std::abs((br - tl).cross(tr - bl));
+    double diagonal = std::sqrt((double)imageSize.width*imageSize.width + (double)imageSize.height*imageSize.height);
+    double angle = std::atan2(tr.y - tl.y, tr.x - tl.x);
+
+    d[0] = (tl.x + tr.x + bl.x + br.x)/(4.0*imageSize.width);
+    d[1] = (tl.y + tr.y + bl.y + br.y)/(4.0*imageSize.height);
+    d[2] = std::log(std::sqrt(area)/diagonal + 1e-6);
+    d[3] = std::log((top + 1e-6)/(bottom + 1e-6));
+    d[4] = std::log((left + 1e-6)/(right + 1e-6));
+    d[5] = 0.5*std::cos(angle);
+    d[6] = 0.5*std::sin(angle);
+}
+
+// Greedily pick up to count views from the candidates: each step takes the view that adds the most
+// uncovered image cells plus the largest pose distance to the views already picked
+static vector<size_t> selectInformativeViews( const Settings& s, Size imageSize,
+                                              const vector<vector<Point2f> >& candidates, size_t count )
+{
+    size_t n = candidates.size();
+    vector<unsigned long long> masks(n);
+    vector<double> descriptors(n*7);
+    for( size_t i = 0; i < n; i++ )
+    {
+        masks[i] = coverageMask(candidates[i], imageSize);
+        boardPoseDescriptor(candidates[i], s.boardSize, imageSize, &descriptors[i*7]);
+    }
+
+    vector<size_t> selected;
+    vector<bool> used(n, false);
+    vector<double> poseNovelty(n, 0);    // distance to the closest selected view
+    unsigned long long covered = 0;
+    while( selected.size() < std::min(count, n) )
+    {
+        size_t best = n;
+        double bestScore = -1;
+        for( size_t i = 0; i < n; i++ )
+        {
+            if( used[i] )
+                continue;
+            double score = countBits(masks[i] & ~covered)/64.0 + poseNovelty[i];
+            if( score > bestScore )
+            {
+                bestScore = score;
+                best = i;
+            }
+        }
+        used[best] = true;
+        selected.push_back(best);
+        covered |= masks[best];
+
+        for( size_t i = 0; i < n; i++ )
+        {
+            double dist = 0;
+            for( int k = 0; k < 7; k++ )
+            {
+                double diff = descriptors[i*7 + k] - descriptors[best*7 + k];
+                dist += diff*diff;
+            }
+            dist = std::sqrt(dist);
+            poseNovelty[i] = selected.size() == 1 ? dist : std::min(poseNovelty[i], dist);
+        }
+    }
+    sort(selected.begin(), selected.end());
+    return selected;
+}
+
+// Calibrate from an informative subset of the candidate views, then repeatedly drop the view with the
+// largest reprojection error while it is well above the median and recalibrate
+static bool runSelectedCalibration( Settings& s, Size& imageSize, Mat& cameraMatrix, Mat& distCoeffs,
+                                    vector<vector<Point2f> >& imagePoints, vector<Mat>& rvecs,
+                                    vector<Mat>& tvecs, vector<float>& reprojErrs, double& totalAvgErr )
+{
+    const double outlierFactor = 2.0;                      // error relative to the median that marks an outlier
+    const size_t minViews = std::max(4, s.nrFrames/2);     // never drop below this many views
+
+    Stopwatch timer;
+    vector<size_t> selected = selectInformativeViews(s, imageSize, imagePoints, (size_t)s.nrFrames);
+    vector<vector<Point2f> > views;
+    for( size_t i = 0; i < selected.size(); i++ )
+        views.push_back(imagePoints[selected[i]]);
+    cout << "Selected " << views.size() << " of " << imagePoints.size() << " candidate views in "
+         << timer.elapsedMs() << " ms" << endl;
+
+    bool ok;
+    for( ;; )
+    {
+        timer.restart();
+        ok = runCalibration(s, imageSize, cameraMatrix, distCoeffs, views, rvecs, tvecs, reprojErrs,
+                            totalAvgErr);
+        cout << "Solve with " << views.size() << " views: " << timer.elapsedMs() << " ms" << endl;
+        if( !ok || views.size() <= minViews )
+            break;
+
+        vector<float> sorted(reprojErrs);
+        nth_element(sorted.begin(), sorted.begin() + sorted.size()/2, sorted.end());
+        double median = sorted[sorted.size()/2];
+        size_t worst = max_element(reprojErrs.begin(), reprojErrs.end()) - reprojErrs.begin();
+        if( reprojErrs[worst] <= outlierFactor*median )
+            break;
+        cout << "Dropping view with re projection error " << reprojErrs[worst]
+             << " (median " << median << ")" << endl;
+        views.erase(views.begin() + worst);
+    }
+    imagePoints.swap(views);
+    return ok;
+}
+//! [select_views]
+
 //! [run_and_save]
 bool runCalibrationAndSave(Settings& s, Size imageSize, Mat& cameraMatrix, Mat& distCoeffs,
                            vector<vector<Point2f> > imagePoints)
@@ -575,8 +1417,13 @@ bool runCalibrationAndSave(Settings& s, Size imageSize, Mat& cameraMatrix, Mat&
     vector<float> reprojErrs;
     double totalAvgErr = 0;
 
-    bool ok = runCalibration(s, imageSize, cameraMatrix, distCoeffs, imagePoints, rvecs, tvecs, reprojErrs,
-                             totalAvgErr);
+    bool ok;
+    if( imagePoints.size() > (size_t)s.nrFrames )
+        ok = runSelectedCalibration(s, imageSize, cameraMatrix, distCoeffs, imagePoints, rvecs, tvecs,
+                                    reprojErrs, totalAvgErr);
+    else
+        ok = runCalibration(s, imageSize, cameraMatrix, distCoeffs, imagePoints, rvecs, tvecs, reprojErrs,
+                            totalAvgErr);
     cout << (ok ? "Calibration succeeded" : "Calibration failed")
          << ". avg re projection error = " << totalAvgErr << endl;
 
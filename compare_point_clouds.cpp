@@ -0,0 +1,277 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include "parallel.hpp"
+#include "point_cloud.hpp"
+#include "point_grid.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+
+// for convenience
+using namespace std;
+
+
+// compare two point clouds (e.g. point_cloud.pts from two disparity engines or parameter sets)
+//
+// accuracy is the distance from each test point to the nearest reference point; completeness the distance from each
+// reference point to the nearest test point; coverage the fraction of reference points with a test point within the
+// coverage distance; the Hausdorff distance is the larger of the two largest distances
+// note: nearest neighbors are only searched for up to the maximum distance, so that stray points far from the other
+// cloud do not make the search sweep the whole grid; points with no neighbor that close are counted as unmatched
+
+
+// globals
+
+// tunable parameters
+double _maxDistanceFraction = 0.05;     // default maximum distance, as a fraction of the reference bounding box diagonal
+double _coverageFraction = 0.005;       // default coverage distance, as a fraction of the reference bounding box diagonal
+size_t _queryChunk = 4096;              // points per nearest neighbor task
+
+
+// distance from each query point to the nearest grid point, or -1 if there is none within maxDistance
+// note: queries are taken in the cell order of their own grid, so that consecutive queries search the same cells
+void nearestDistances(const PointGrid &grid, const vector<Point> &queries, const vector<uint32_t> &queryOrder, double maxDistance,
+                      vector<float> &distances, int nthreads)
+{
+    TRACE_SCOPE("nearest_distances");
+    distances.resize(queries.size());
+    parallelFor((queries.size() + _queryChunk - 1)/_queryChunk, [&](size_t chunk_i)
+    {
+        size_t end = min(queries.size(), (chunk_i + 1)*_queryChunk);
+        for (size_t order_i = chunk_i*_queryChunk; order_i < end; order_i++)
+        {
+            uint32_t query_i = queryOrder[order_i];
+            double distance;
+            long nearest = grid.nearest(&queries[query_i].coords.x, maxDistance, distance);
+            distances[query_i] = nearest >= 0 ? static_cast<float>(distance) : -1.0F;
+        }
+    }, nthreads);
+}
+
+
+// statistics of the matched distances of one direction of the comparison, in the points' units
+struct DistanceStats
+{
+    size_t unmatched;   // points with no neighbor within the maximum distance
+    double mean;
+    double median;
+    double p95;
+    double max;
+    DistanceStats(void): unmatched(0), mean(0), median(0), p95(0), max(0){}
+};
+
+
+// print the statistics of one direction of the comparison
+DistanceStats reportDistances(const string &label, const vector<float> &distances, double coverageDistance)
+{
+    vector<double> matched;
+    matched.reserve(distances.size());
+    size_t covered = 0;
+    double sum = 0.0;
+    for (size_t point_i = 0; point_i < distances.size(); point_i++)
+    {
+        if (distances[point_i] >= 0.0F)
+        {
+            matched.push_back(distances[point_i]);
+            covered += distances[point_i] <= coverageDistance;
+            sum += distances[point_i];
+        }
+    }
+    sort(matched.begin(), matched.end());
+
+    DistanceStats stats;
+    stats.unmatched = distances.size() - matched.size();
+    if (!matched.empty())
+    {
+        stats.mean = sum/matched.size();
+        stats.median = percentile(matched, 50);
+        stats.p95 = percentile(matched, 95);
+        stats.max = matched.back();
+    }
+    cout << label << ": mean " << stats.mean << ", median " << stats.median << ", p95 " << stats.p95
+         << ", max " << stats.max << "; " << stats.unmatched << " unmatched, " << 100.0*covered/max<size_t>(distances.size(), 1)
+         << "% within " << coverageDistance << endl;
+    return stats;
+}
+
+
+// write the test points colored by their distance: blue (0) through green to red (colorMax or more), magenta if unmatched
+bool writeErrorCloud(const string &filename, const vector<Point> &points, const vector<float> &distances, double colorMax)
+{
+    TRACE_SCOPE("write_error_cloud");
+    FILE *out = fopen(filename.c_str(), "w");
+    if (!out)
+    {
+        return false;
+    }
+    for (size_t point_i = 0; point_i < points.size(); point_i++)
+    {
+        int r = 255, g = 0, b = 255;
+        if (distances[point_i] >= 0.0F)
+        {
+            double t = colorMax > 0.0 ? min(1.0, distances[point_i]/colorMax) : 0.0;
+            r = static_cast<int>(255*max(0.0, 2.0*t - 1.0));
+            g = static_cast<int>(255*(1.0 - fabs(2.0*t - 1.0)));
+            b = static_cast<int>(255*max(0.0, 1.0 - 2.0*t));
+        }
+        // note: z is negated back to the points file convention
+        const Coords3D &c = points[point_i].coords;
+        fprintf(out, "%11.6f %11.6f %11.6f %3d %3d %3d \n", c.x, c.y, -c.z, r, g, b);
+    }
+    return fclose(out) == 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    TRACE_SCOPE("compare_point_clouds");
+    if (argc < 3)
+    {
+        cerr << "Usage: compare_point_clouds <reference_points_file> <test_points_file> [--max-distance <d>] [--coverage-distance <d>]" << endl;
+        cerr << "                            [--colored <output_points_file> [--color-max <d>]] [--threads <n>]" << endl;
+        cerr << "distances default to fractions of the reference bounding box diagonal (" << _maxDistanceFraction << " and " << _coverageFraction
+             << "); the colored cloud is the test cloud colored by distance to the reference, saturating at --color-max (default: the p95 distance)" << endl;
+        return 1;
+    }
+
+    // parse options
+    double maxDistance = 0.0;
+    double coverageDistance = 0.0;
+    double colorMax = 0.0;
+    string coloredFile;
+    int nthreads = 0;
+    for (int arg_i = 3; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        if (arg == "--max-distance" && arg_i + 1 < argc)
+        {
+            maxDistance = atof(argv[++arg_i]);
+        }
+        else if (arg == "--coverage-distance" && arg_i + 1 < argc)
+        {
+            coverageDistance = atof(argv[++arg_i]);
+        }
+        else if (arg == "--colored" && arg_i + 1 < argc)
+        {
+            coloredFile = argv[++arg_i];
+        }
+        else if (arg == "--color-max" && arg_i + 1 < argc)
+        {
+            colorMax = atof(argv[++arg_i]);
+        }
+        else if (arg == "--threads" && arg_i + 1 < argc)
+        {
+            nthreads = atoi(argv[++arg_i]);
+        }
+        else
+        {
+            cerr << "error: unrecognized option \"" << arg << "\"" << endl;
+            return 1;
+        }
+    }
+
+    // load both clouds
+    Stopwatch stopwatch;
+    vector<Point> reference, test;
+    {
+        TRACE_SCOPE("load_points");
+        for (int file_i = 1; file_i <= 2; file_i++)
+        {
+            if (!loadPointsFileParallel(argv[file_i], file_i == 1 ? reference : test, nthreads))
+            {
+                cerr << "error: problem loading points from \"" << argv[file_i] << "\"; exiting..." << endl;
+                return 1;
+            }
+        }
+    }
+    if (reference.empty() || test.empty())
+    {
+        cerr << "error: both points files must hold points; exiting..." << endl;
+        return 1;
+    }
+    cout.setf(ios_base::fixed);
+    cout.precision(3);
+    cout << reference.size() << " reference and " << test.size() << " test points loaded in " << stopwatch.elapsedMs() << " ms" << endl;
+
+    // default distances from the reference's extent
+    double lo[3] = {reference[0].coords.x, reference[0].coords.y, reference[0].coords.z};
+    double hi[3] = {lo[0], lo[1], lo[2]};
+    for (size_t point_i = 0; point_i < reference.size(); point_i++)
+    {
+        const double *p = &reference[point_i].coords.x;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = min(lo[axis], p[axis]);
+            hi[axis] = max(hi[axis], p[axis]);
+        }
+    }
+    double diagonal = sqrt((hi[0] - lo[0])*(hi[0] - lo[0]) + (hi[1] - lo[1])*(hi[1] - lo[1]) + (hi[2] - lo[2])*(hi[2] - lo[2]));
+    maxDistance = maxDistance > 0.0 ? maxDistance : _maxDistanceFraction*diagonal;
+    coverageDistance = coverageDistance > 0.0 ? coverageDistance : _coverageFraction*diagonal;
+    cout << "reference diagonal " << diagonal << ", maximum distance " << maxDistance << ", coverage distance " << coverageDistance << endl;
+
+    // index both clouds
+    // note: the two grids are independent, so they are built at the same time
+    stopwatch.restart();
+    PointGrid referenceGrid, testGrid;
+    {
+        TRACE_SCOPE("build_grids");
+        parallelFor(2, [&](size_t grid_i)
+        {
+            if (grid_i == 0)
+            {
+                referenceGrid.build(&reference[0].coords.x, reference.size(), sizeof(Point));
+            }
+            else
+            {
+                testGrid.build(&test[0].coords.x, test.size(), sizeof(Point));
+            }
+        }, nthreads);
+    }
+    cout << "grids built in " << stopwatch.elapsedMs() << " ms (" << referenceGrid.cellCount() << " and " << testGrid.cellCount() << " cells)" << endl;
+
+    // nearest neighbors both ways
+    stopwatch.restart();
+    vector<float> testToReference, referenceToTest;
+    nearestDistances(referenceGrid, test, testGrid.cellOrder(), maxDistance, testToReference, nthreads);
+    nearestDistances(testGrid, reference, referenceGrid.cellOrder(), maxDistance, referenceToTest, nthreads);
+    double searchMs = stopwatch.elapsedMs();
+    cout << test.size() + reference.size() << " nearest neighbor searches in " << searchMs << " ms ("
+         << (nthreads > 0 ? nthreads : defaultThreadCount()) << " threads)" << endl;
+
+    // report
+    DistanceStats accuracy = reportDistances("accuracy (test to reference)", testToReference, coverageDistance);
+    DistanceStats completeness = reportDistances("completeness (reference to test)", referenceToTest, coverageDistance);
+    if (accuracy.unmatched + completeness.unmatched > 0)
+    {
+        cout << "Hausdorff distance: more than " << maxDistance << " (" << accuracy.unmatched + completeness.unmatched << " unmatched points)" << endl;
+    }
+    else
+    {
+        cout << "Hausdorff distance: " << max(accuracy.max, completeness.max) << endl;
+    }
+
+    // the error-colored test cloud
+    if (!coloredFile.empty())
+    {
+        colorMax = colorMax > 0.0 ? colorMax : accuracy.p95;
+        if (!writeErrorCloud(coloredFile, test, testToReference, colorMax))
+        {
+            cerr << "error: couldn't write \"" << coloredFile << "\"; exiting..." << endl;
+            return 1;
+        }
+        cout << "error-colored test cloud written to " << coloredFile << " (red at " << colorMax << " and beyond)" << endl;
+    }
+
+    return 0;
+}
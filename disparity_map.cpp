@@ -2,55 +2,217 @@
 // paul_r_cannon@yahoo.com
 // 240-344-6081
 
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include "image_source.hpp"
+#include "stereo.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
 
 using namespace cv;
 using namespace std;
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    TRACE_SCOPE("disparity_map");
+    // parse the arguments
+    vector<string> files;
+    double textureThreshold = 0.0;
+    int textureBlockSize = 16;
+    string engine = "bm";
+    int radius = 9;
+    string groundTruthFile;
+    double groundTruthScale = 4.0;
+    bool fillHoles = false;
+    bool badArgument = false;
+    for (int arg_i = 1; arg_i < argc; arg_i++)
     {
-        cout << "Usage: disparity_map <left_image> <right_image>" << endl;
+        string arg = argv[arg_i];
+        if (arg == "--texture-threshold" && arg_i + 1 < argc)
+        {
+            textureThreshold = atof(argv[++arg_i]);
+        }
+        else if (arg == "--texture-block" && arg_i + 1 < argc)
+        {
+            textureBlockSize = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--engine" && arg_i + 1 < argc)
+        {
+            engine = argv[++arg_i];
+            badArgument = badArgument || (engine != "bm" && engine != "guided");
+        }
+        else if (arg == "--radius" && arg_i + 1 < argc)
+        {
+            radius = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--ground-truth" && arg_i + 1 < argc)
+        {
+            groundTruthFile = argv[++arg_i];
+        }
+        else if (arg == "--ground-truth-scale" && arg_i + 1 < argc)
+        {
+            groundTruthScale = atof(argv[++arg_i]);
+        }
+        else if (arg == "--fill-holes")
+        {
+            fillHoles = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            badArgument = true;
+        }
+        else
+        {
+            files.push_back(arg);
+        }
+    }
+    if (badArgument || files.size() < 2 || files.size() > 3)
+    {
+        cout << "Usage: disparity_map <left_image> <right_image> [<rectification_file>] [--texture-threshold <mean_gradient>] [--texture-block <pixels>]" << endl;
+        cout << "       [--engine bm|guided] [--radius <pixels>] [--ground-truth <disparity_image> [--ground-truth-scale <levels_per_pixel>]]" << endl;
+        cout << "       [--fill-holes]" << endl;
+        cout << "with the rectification.xml written by stereo_rectify_images, full size images are matched only within the valid region" << endl;
+        cout << "with --texture-threshold (e.g. 8), blocks (default 16x16) of the left image whose mean horizontal gradient is lower are not matched" << endl;
+        cout << "the guided engine filters the cost of each disparity with a guided filter of the given radius (default 9) instead of" << endl;
+        cout << "StereoBM's 21x21 window; with --ground-truth (e.g. conesH/disp2.pgm, scale 4), both engines are timed and scored" << endl;
+        cout << "with --fill-holes, invalid pixels are filled from the background around them, and filled_mask.png marks which ones were" << endl;
+        return 1;
+    }
+    if (textureThreshold > 0.0 && engine != "bm")
+    {
+        cout << "error: --texture-threshold only applies to the bm engine" << endl;
         return 1;
     }
 
     // load in the images
-    Mat imgLeft = imread(argv[1], IMREAD_GRAYSCALE);
-    Mat imgRight = imread(argv[2], IMREAD_GRAYSCALE);
+    // note: both are decoded at once; PGM/PPM files are memory-mapped. the guided engine matches color
+    Mat imgLeft, imgRight;
+    SourceImage leftSource, rightSource;
+    {
+        TRACE_SCOPE("decode_images");
+        bool color = engine == "guided" || !groundTruthFile.empty();
+        ImageSource source(vector<string>(files.begin(), files.begin() + 2), color ? IMREAD_COLOR : IMREAD_GRAYSCALE, 2);
+        source.next(leftSource);
+        source.next(rightSource);
+        imgLeft = leftSource.image;
+        imgRight = rightSource.image;
+    }
     if (imgLeft.empty())
     {
-        cout <<  "error: no image data for image \"" << argv[1] << "\"; exiting..." << endl;
+        cout <<  "error: no image data for image \"" << files[0] << "\"; exiting..." << endl;
         return 1;
     }
     if (imgRight.empty())
     {
-        cout <<  "error: no image data for image \"" << argv[2] << "\"; exiting..." << endl;
+        cout <<  "error: no image data for image \"" << files[1] << "\"; exiting..." << endl;
         return 1;
     }
 
-    // allocate image to save disparities
-    Mat imgDisparity16S = Mat(imgLeft.rows, imgLeft.cols, CV_16S);
-
-    // allocate image to save output disparity image
-    Mat imgDisparity8U = Mat(imgLeft.rows, imgLeft.cols, CV_8UC1);
-
-    // determine the disparity image
-    // note: the number of disparities must be positive and divisible by 16
-    int ndisparities = 16*8;  // = 128
-    int SADWindowSize = 21;   // default size of 21 yields best trade-off for this method
-    Ptr<StereoBM> sbm = StereoBM::create(ndisparities, SADWindowSize);
-    sbm->compute( imgLeft, imgRight, imgDisparity16S);
+    // crop to the region valid in both views
+    // note: images written by stereo_rectify_images are already cropped, in which case there is nothing to do
+    if (files.size() == 3)
+    {
+        Size imageSize;
+        Rect validROI;
+        if (!loadValidROI(files[2], imageSize, validROI))
+        {
+            cout << "error: could not read the valid region from \"" << files[2] << "\"; exiting..." << endl;
+            return 1;
+        }
+        if (imgLeft.size() == imageSize && imgRight.size() == imageSize)
+        {
+            imgLeft = imgLeft(validROI);
+            imgRight = imgRight(validROI);
+            cout << "matching the valid region " << validROI.width << "x" << validROI.height << " at (" << validROI.x << ", " << validROI.y << ")" << endl;
+        }
+    }
 
-    // determine image extreme values
+    // determine the disparity image, scaled to 8 bits
+    Mat imgDisparity8U;
     double minVal, maxVal;
-    minMaxLoc(imgDisparity16S, &minVal, &maxVal);
-    cout << "minVal = " << minVal << "; maxVal = " << maxVal << endl;
+    DisparityMatcher matcher;
+    GuidedFilterMatcher guidedMatcher(matcher.ndisparities(), radius);
+    if (!groundTruthFile.empty())
+    {
+        // score both engines, overall and near depth edges
+        Mat groundTruth = imread(groundTruthFile, IMREAD_GRAYSCALE);
+        if (groundTruth.size() != imgLeft.size())
+        {
+            cout << "error: no ground truth the size of the images in \"" << groundTruthFile << "\"; exiting..." << endl;
+            return 1;
+        }
+        Mat bmDisparity8U, guidedDisparity8U;
+        Stopwatch stopwatch;
+        matcher.compute(imgLeft, imgRight, bmDisparity8U);
+        double bmMs = stopwatch.elapsedMs();
+        stopwatch.restart();
+        guidedMatcher.compute(imgLeft, imgRight, guidedDisparity8U);
+        double guidedMs = stopwatch.elapsedMs();
+        DisparityAccuracy accuracy[2] = {evaluateDisparity(matcher.rawDisparity(), groundTruth, groundTruthScale),
+                                         evaluateDisparity(guidedMatcher.rawDisparity(), groundTruth, groundTruthScale)};
+        string labels[2] = {"bm (21x21 window)", "guided (radius " + to_string(radius) + ")"};
+        double ms[2] = {bmMs, guidedMs};
+        cout << accuracy[0].pixels << " ground truth pixels, " << accuracy[0].edgePixels << " near depth edges; bad means invalid or off by more than 1 pixel" << endl;
+        for (int engine_i = 0; engine_i < 2; engine_i++)
+        {
+            cout << labels[engine_i] << ": " << ms[engine_i]
+                 << " ms; bad " << 100.0*accuracy[engine_i].badFraction << "% (" << 100.0*accuracy[engine_i].invalidFraction << "% invalid), bad near edges "
+                 << 100.0*accuracy[engine_i].edgeBadFraction << "%, mean error " << accuracy[engine_i].meanError << " pixels" << endl;
+        }
+    }
+    if (engine == "guided")
+    {
+        Stopwatch stopwatch;
+        guidedMatcher.compute(imgLeft, imgRight, imgDisparity8U, &minVal, &maxVal);
+        cout << "guided filter matching (radius " << radius << "): " << stopwatch.elapsedMs() << " ms" << endl;
+    }
+    else if (textureThreshold > 0.0)
+    {
+        // note: the full search is timed too, so the time saved can be reported. both are warmed up untimed, then timed
+        // in alternation and compared by their medians, so neither gets the cold buffers or the other's cache state
+        const int rounds = 5;
+        DisparityMatcher fullMatcher;
+        Mat fullDisparity8U;
+        matcher.setTextureThreshold(textureThreshold, textureBlockSize);
+        fullMatcher.compute(imgLeft, imgRight, fullDisparity8U);
+        matcher.compute(imgLeft, imgRight, imgDisparity8U);
+        vector<double> fullMs, texturedMs;
+        for (int round_i = 0; round_i < rounds; round_i++)
+        {
+            Stopwatch stopwatch;
+            fullMatcher.compute(imgLeft, imgRight, fullDisparity8U);
+            fullMs.push_back(stopwatch.elapsedMs());
+            stopwatch.restart();
+            matcher.compute(imgLeft, imgRight, imgDisparity8U, &minVal, &maxVal);
+            texturedMs.push_back(stopwatch.elapsedMs());
+        }
+        double fullMedian = summarizeTimings(fullMs).p50, texturedMedian = summarizeTimings(texturedMs).p50;
+        cout << "full search: " << fullMedian << " ms; textured blocks only: " << texturedMedian << " ms (medians of " << rounds << ", "
+             << fullMedian - texturedMedian << " ms saved, " << 100.0*matcher.skippedFraction() << "% of pixels skipped, "
+             << 100.0*matcher.windowFraction() << "% of the image matched)" << endl;
+    }
+    else
+    {
+        matcher.compute(imgLeft, imgRight, imgDisparity8U, &minVal, &maxVal);
+    }
 
-    // create the output disparity image
-    imgDisparity16S.convertTo(imgDisparity8U, CV_8UC1, 255/(maxVal - minVal));
+    // fill the invalid pixels, and scale the result the same way
+    Mat filledMask;
+    if (fillHoles)
+    {
+        const Mat &rawDisparity = engine == "guided" ? guidedMatcher.rawDisparity() : matcher.rawDisparity();
+        Mat filled16S;
+        Stopwatch stopwatch;
+        size_t nfilled = fillDisparityHoles(rawDisparity, imgLeft, filled16S, filledMask);
+        cout << nfilled << " invalid pixels (" << 100.0*nfilled/rawDisparity.total() << "%) filled in " << stopwatch.elapsedMs() << " ms" << endl;
+        minMaxLoc(filled16S, &minVal, &maxVal);
+        filled16S.convertTo(imgDisparity8U, CV_8UC1, 255/(maxVal - minVal));
+    }
+    cout << "minVal = " << minVal << "; maxVal = " << maxVal << endl;
 
     // display the output disparity image
     namedWindow("Display window", WINDOW_AUTOSIZE);
@@ -58,8 +220,15 @@ int main(int argc, char *argv[])
     waitKey(0);
 
     // save the output disparity image
-    imwrite("disparity_image.png", imgDisparity8U);
-    cout << "disparity_image.png created..." << endl;
+    {
+        TRACE_SCOPE("encode_disparity_image");
+        imwrite("disparity_image.png", imgDisparity8U);
+        if (fillHoles)
+        {
+            imwrite("filled_mask.png", filledMask);
+        }
+    }
+    cout << "disparity_image.png created..." << (fillHoles ? " (and filled_mask.png)" : "") << endl;
     waitKey(0);
 
     return 0;
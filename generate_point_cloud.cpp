@@ -2,29 +2,117 @@
 // paul_r_cannon@yahoo.com
 // 240-344-6081
 
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
-#include <vector>
-#include <fstream>
-#include <cmath>
+#include "image_source.hpp"
+#include "planes.hpp"
+#include "stereo.hpp"
+#include "trace.hpp"
 
 using namespace std;
 using namespace cv;
 
+
+// write the given points of XYZ (CV_32FC3), colored from texture, in pts format
+bool writePointSubset(const string &filename, const Mat &XYZ, const Mat &texture, const vector<Point2i> &pixels, const vector<uint32_t> &subset)
+{
+    Mat subsetXYZ(static_cast<int>(subset.size()), 1, CV_32FC3);
+    Mat subsetTexture(static_cast<int>(subset.size()), 1, CV_8UC3);
+    for (size_t subset_i = 0; subset_i < subset.size(); subset_i++)
+    {
+        const Point2i &pixel = pixels[subset[subset_i]];
+        subsetXYZ.at<Vec3f>(static_cast<int>(subset_i)) = XYZ.at<Vec3f>(pixel.y, pixel.x);
+        subsetTexture.at<Vec3b>(static_cast<int>(subset_i)) = texture.at<Vec3b>(pixel.y, pixel.x);
+    }
+    return writePointCloud(filename, subsetXYZ, subsetTexture);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    TRACE_SCOPE("generate_point_cloud");
+
+    // parse the arguments
+    vector<string> files;
+    PlaneExtractionOptions planeOptions;
+    planeOptions.maxPlanes = 0;
+    planeOptions.threshold = 0.0F;
+    double minPlaneFraction = 0.05;
+    bool organized = false;
+    int normalRadius = 0;
+    string filledMaskFile;
+    bool badArgument = false;
+    for (int arg_i = 1; arg_i < argc; arg_i++)
     {
-        cout << "Usage: generate_point_cloud <disparity_image> <texture_image>" << endl;
+        string arg = argv[arg_i];
+        if (arg == "--planes" && arg_i + 1 < argc)
+        {
+            planeOptions.maxPlanes = max(0, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--plane-threshold" && arg_i + 1 < argc)
+        {
+            planeOptions.threshold = static_cast<float>(atof(argv[++arg_i]));
+        }
+        else if (arg == "--min-plane-fraction" && arg_i + 1 < argc)
+        {
+            minPlaneFraction = atof(argv[++arg_i]);
+        }
+        else if (arg == "--organized")
+        {
+            organized = true;
+        }
+        else if (arg == "--normals" && arg_i + 1 < argc)
+        {
+            normalRadius = max(0, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--filled-mask" && arg_i + 1 < argc)
+        {
+            filledMaskFile = argv[++arg_i];
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            badArgument = true;
+        }
+        else
+        {
+            files.push_back(arg);
+        }
+    }
+    if (badArgument || files.size() < 2 || files.size() > 3)
+    {
+        cout << "Usage: generate_point_cloud <disparity_image> <texture_image> [<rectification_file>] [--organized] [--normals <radius>]" << endl;
+        cout << "                            [--filled-mask <mask_image>]" << endl;
+        cout << "                            [--planes <n> [--plane-threshold <distance>] [--min-plane-fraction <f>]]" << endl;
+        cout << "with the rectification.xml written by stereo_rectify_images, only the valid region is reprojected" << endl;
+        cout << "with --organized, every pixel is written in image order (nan for invalid pixels); with --normals, each point" << endl;
+        cout << "gets the surface normal fitted to the (2*radius + 1)^2 pixels around it" << endl;
+        cout << "with --planes, up to n planes are extracted (default: inliers within 1% of the median depth, planes of at least 5% of the points)" << endl;
+        cout << "and written to plane_<i>.pts, and the remaining points to residual.pts" << endl;
+        cout << "with --filled-mask (the filled_mask.png of disparity_map --fill-holes), filled pixels are counted and left out of plane fitting" << endl;
         return 1;
     }
 
+    // the texture image is decoded in the background while the disparity image is decoded and shown
+    ImageSource textureSource(vector<string>(1, files[1]), IMREAD_COLOR, 1);
+
     // load the disparity image
-    Mat disparityImage = imread(argv[1], IMREAD_GRAYSCALE);
+    Mat disparityImage;
+    SourceImage disparitySource;
+    {
+        TRACE_SCOPE("decode_disparity_image");
+        if (!readMappedPNM(files[0], IMREAD_GRAYSCALE, disparitySource))
+        {
+            disparitySource.image = imread(files[0], IMREAD_GRAYSCALE);
+        }
+        disparityImage = disparitySource.image;
+    }
     if (disparityImage.empty())
     {
-        cout <<  "error: no image data for image \"" << argv[1] << "\"; exiting..." << endl;
+        cout <<  "error: no image data for image \"" << files[0] << "\"; exiting..." << endl;
         return 1;
     }
     cout << "disparityImage.rows = " << disparityImage.rows << endl;
@@ -35,10 +123,16 @@ int main(int argc, char *argv[])
     waitKey(0);
 
     // load the texture image
-    Mat textureImage = imread(argv[2], IMREAD_COLOR);
+    Mat textureImage;
+    SourceImage textureFrame;
+    {
+        TRACE_SCOPE("decode_texture_image");
+        textureSource.next(textureFrame);
+        textureImage = textureFrame.image;
+    }
     if (textureImage.empty())
     {
-        cout <<  "error: no image data for image \"" << argv[2] << "\"; exiting..." << endl;
+        cout <<  "error: no image data for image \"" << files[1] << "\"; exiting..." << endl;
         return 1;
     }
     cout << "textureImage.rows = " << textureImage.rows << endl;
@@ -48,31 +142,19 @@ int main(int argc, char *argv[])
     imshow("Display window", textureImage);
     waitKey(0);
 
-    // ensure that the disparity image and the texture image are the same size
-    if (disparityImage.size() != textureImage.size())
+    // load the mask of filled disparities
+    Mat filledMask;
+    if (!filledMaskFile.empty())
     {
-        cout << "error: disparity and texture images must be the same size; exiting..." << endl;
+        filledMask = imread(filledMaskFile, IMREAD_GRAYSCALE);
+        if (filledMask.empty())
+        {
+            cout << "error: no image data for mask \"" << filledMaskFile << "\"; exiting..." << endl;
+            return 1;
+        }
     }
 
     // create a simple Q matrix
-    Mat Q(4, 4, CV_64F);
-    Q.at<double>(0,0) = 1.0;
-    Q.at<double>(0,1) = 0.0;
-    Q.at<double>(0,2) = 0.0;
-    Q.at<double>(0,3) = -450.0; // -cx
-    Q.at<double>(1,0) = 0.0;
-    Q.at<double>(1,1) = 1.0;
-    Q.at<double>(1,2) = 0.0;
-    Q.at<double>(1,3) = -375.0; // -cy
-    Q.at<double>(2,0) = 0.0;
-    Q.at<double>(2,1) = 0.0;
-    Q.at<double>(2,2) = 0.0;
-    Q.at<double>(2,3) = 800.0; // focal length (in pixels)
-    Q.at<double>(3,0) = 0.0;
-    Q.at<double>(3,1) = 0.0;
-    Q.at<double>(3,2) = -1.0/100.0; // -1.0/baseline (baseline in world units: m or mm)
-    Q.at<double>(3,3) = 0.0; // (cx - cx')/baseline -- assume (cx - cx') is 0
-
     // note: Q is the disparity to depth conversion matrix
     // Z = f*B/d
     // where:
@@ -80,56 +162,138 @@ int main(int argc, char *argv[])
     // f = focal length (in pixels)
     // B = baseline (in metres)
     // d = disparity (in pixels)
+    Mat Q = simpleQ();
+
+    // reproject only the region valid in both rectified views
+    // note: full size images are cropped here, each on its own, since disparity_map already crops the disparity of a full
+    // size pair while the texture usually stays full size; either way Q is offset so the points land where the full
+    // image would put them
+    if (files.size() == 3)
+    {
+        Size imageSize;
+        Rect validROI;
+        if (!loadValidROI(files[2], imageSize, validROI))
+        {
+            cout << "error: could not read the valid region from \"" << files[2] << "\"; exiting..." << endl;
+            return 1;
+        }
+        if (disparityImage.size() == imageSize)
+        {
+            disparityImage = disparityImage(validROI);
+        }
+        if (textureImage.size() == imageSize)
+        {
+            textureImage = textureImage(validROI);
+        }
+        if (filledMask.size() == imageSize)
+        {
+            filledMask = filledMask(validROI);
+        }
+        if (disparityImage.size() == validROI.size())
+        {
+            Q = cropQ(Q, validROI);
+        }
+        cout << "valid region: " << validROI.width << "x" << validROI.height << " at (" << validROI.x << ", " << validROI.y << ")" << endl;
+    }
+
+    // ensure that the disparity image, the texture image and the mask are the same size
+    if (disparityImage.size() != textureImage.size())
+    {
+        cout << "error: disparity and texture images must be the same size; exiting..." << endl;
+        return 1;
+    }
+    if (!filledMask.empty() && filledMask.size() != disparityImage.size())
+    {
+        cout << "error: no mask the size of the disparity image in \"" << filledMaskFile << "\"; exiting..." << endl;
+        return 1;
+    }
 
     // determine 3D coordinates
-    Mat XYZ(disparityImage.size(), CV_32FC3);
-    reprojectImageTo3D(disparityImage, XYZ, Q, false, CV_32F);
+    Mat XYZ;
+    reprojectDisparity(disparityImage, Q, XYZ);
 
     // output point cloud points to pts file format
+    cout << "nrows = " << disparityImage.rows << endl;
+    cout << "ncols = " << disparityImage.cols << endl;
+    Mat normals;
+    if (normalRadius > 0)
+    {
+        Stopwatch stopwatch;
+        estimateNormals(XYZ, normalRadius, normals);
+        cout << "normals estimated in " << stopwatch.elapsedMs() << " ms (" << 2*normalRadius + 1 << "x" << 2*normalRadius + 1 << " window)" << endl;
+    }
+    size_t npoints;
+    if (!writePointCloud("point_cloud.pts", XYZ, textureImage, &npoints, normals, organized))
+    {
+        cout << "error: could not write \"point_cloud.pts\"; exiting..." << endl;
+        return 1;
+    }
+    cout << npoints << " points written to point_cloud.pts" << (organized ? " (organized)" : "") << endl;
+    if (!filledMask.empty())
+    {
+        cout << "  " << countNonZero(filledMask) << " pixels were filled rather than matched" << endl;
+    }
 
-    ofstream fout("point_cloud.pts");
-    fout.setf(ios_base::fixed);
-    fout.precision(6);
-    fout.setf(ios_base::showpoint);
-
-    // for convenience
-    float *XYZ_p = reinterpret_cast<float *>(XYZ.data);
-    uchar *textureImage_p = textureImage.data;
-    int nrows = disparityImage.rows;
-    int ncols = disparityImage.cols;
-    cout << "nrows = " << nrows << endl;
-    cout << "ncols = " << ncols << endl;
-
-    // iterate over the rows and columns
-    for (int row_i = 0; row_i < nrows; row_i++)
+    // extract the dominant planes
+    // note: filled pixels are interpolated rather than measured, so the planes are fitted without them
+    if (planeOptions.maxPlanes > 0)
     {
-        for (int col_i = 0; col_i < ncols; col_i++)
+        TRACE_SCOPE("plane_extraction");
+        PlanePoints cloud;
+        vector<Point2i> pixels;
+        vector<float> depths;
+        for (int row_i = 0; row_i < XYZ.rows; row_i++)
         {
-            // output xyz coordinates
-            if (isfinite(XYZ_p[row_i*ncols*3 + col_i*3 + 0]) && isfinite(XYZ_p[row_i*ncols*3 + col_i*3 + 1]) && isfinite(XYZ_p[row_i*ncols*3 + col_i*3 + 2]))
+            const Vec3f *XYZ_p = XYZ.ptr<Vec3f>(row_i);
+            for (int col_i = 0; col_i < XYZ.cols; col_i++)
             {
-                fout.width(11);
-                fout << XYZ_p[row_i*ncols*3 + col_i*3 + 0] << ' ';
-                fout.width(11);
-                fout << XYZ_p[row_i*ncols*3 + col_i*3 + 1] << ' ';
-                fout.width(11);
-                fout << XYZ_p[row_i*ncols*3 + col_i*3 + 2] << ' ';
-
-                // output color in RGB order; note: opencv uses BGR order by default
-                fout.width(3);
-                fout << static_cast<int>(textureImage_p[row_i*ncols*3 + col_i*3 + 2]) << ' '; // R
-                fout.width(3);
-                fout << static_cast<int>(textureImage_p[row_i*ncols*3 + col_i*3 + 1]) << ' '; // G
-                fout.width(3);
-                fout << static_cast<int>(textureImage_p[row_i*ncols*3 + col_i*3 + 0]) << ' '; // B
-
-                // end the line
-                fout << endl;
+                const Vec3f &p = XYZ_p[col_i];
+                if (std::isfinite(p[0]) && std::isfinite(p[1]) && std::isfinite(p[2]) && (filledMask.empty() || !filledMask.at<uchar>(row_i, col_i)))
+                {
+                    cloud.x.push_back(p[0]);
+                    cloud.y.push_back(p[1]);
+                    cloud.z.push_back(p[2]);
+                    pixels.push_back(Point2i(col_i, row_i));
+                }
             }
         }
+        if (planeOptions.threshold <= 0.0F && !cloud.z.empty())
+        {
+            depths = cloud.z;
+            nth_element(depths.begin(), depths.begin() + depths.size()/2, depths.end());
+            planeOptions.threshold = 0.01F*std::fabs(depths[depths.size()/2]);
+        }
+        planeOptions.minInliers = max<size_t>(3, static_cast<size_t>(minPlaneFraction*cloud.size()));
+
+        vector<ExtractedPlane> planes;
+        vector<uint32_t> residual;
+        Stopwatch stopwatch;
+        extractPlanes(cloud, planeOptions, planes, residual);
+        double extractMs = stopwatch.elapsedMs();
+
+        cout << planes.size() << " planes extracted from " << cloud.size() << " points in " << extractMs << " ms (inlier distance "
+             << planeOptions.threshold << ")" << endl;
+        for (size_t plane_i = 0; plane_i < planes.size(); plane_i++)
+        {
+            const ExtractedPlane &extracted = planes[plane_i];
+            stringstream filename;
+            filename << "plane_" << plane_i << ".pts";
+            if (!writePointSubset(filename.str(), XYZ, textureImage, pixels, extracted.inliers))
+            {
+                cout << "error: could not write \"" << filename.str() << "\"; exiting..." << endl;
+                return 1;
+            }
+            cout << "  " << filename.str() << ": " << extracted.inliers.size() << " points on " << extracted.plane.a << "x + " << extracted.plane.b
+                 << "y + " << extracted.plane.c << "z + " << extracted.plane.d << " = 0 (" << extracted.hypotheses << " hypotheses, "
+                 << extracted.ms << " ms)" << endl;
+        }
+        if (!writePointSubset("residual.pts", XYZ, textureImage, pixels, residual))
+        {
+            cout << "error: could not write \"residual.pts\"; exiting..." << endl;
+            return 1;
+        }
+        cout << "  residual.pts: " << residual.size() << " points on no plane" << endl;
     }
-    fout << endl;
-    fout.close();
 
     return 0;
 }
@@ -0,0 +1,305 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef IMAGE_SOURCE_HPP
+#define IMAGE_SOURCE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cctype>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+
+// in-order image sequence decoded ahead of the consumer on a pool of background threads
+//
+// usage:
+//     ImageSource source(filenames, cv::IMREAD_COLOR, 4);
+//     SourceImage frame;
+//     while (source.next(frame)) { ... frame.image ... }
+// note: at most lookahead images are decoded (or being decoded) ahead of the one last handed out, which bounds memory
+// note: binary 8 bit PGM/PPM files (P5/P6, e.g. the cones images) are memory-mapped instead of read; a PGM read as
+// grayscale is handed out without any copy, other combinations take one conversion pass straight from the mapping
+
+
+// a read-only file mapping; unmapped when the last SourceImage referring to it goes away
+class MappedFile
+{
+public:
+    MappedFile(void): _data(0), _size(0){}
+
+    ~MappedFile(void)
+    {
+        if (_data)
+        {
+            munmap(_data, _size);
+        }
+    }
+
+    bool open(const std::string &filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat status;
+        if (fstat(fd, &status) == 0 && status.st_size > 0)
+        {
+            _size = static_cast<size_t>(status.st_size);
+            void *data = mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            _data = data == MAP_FAILED ? 0 : data;
+        }
+        close(fd);
+        return _data != 0;
+    }
+
+    const unsigned char *data(void) const { return static_cast<const unsigned char *>(_data); }
+    size_t size(void) const { return _size; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    void *_data;
+    size_t _size;
+};
+
+
+// one decoded image; keep it while using image, which may point into a file mapping
+// note: an image that points into a mapping (a PGM read as grayscale) is read only; clone it before modifying it in place
+struct SourceImage
+{
+    size_t index;
+    std::string filename;
+    cv::Mat image;      // empty if the file could not be read or decoded
+    std::shared_ptr<MappedFile> mapping;
+    SourceImage(void): index(0){}
+};
+
+
+// read a binary PGM/PPM with 8 bit samples through a file mapping; returns false for anything else (the caller then
+// falls back to imread)
+inline bool readMappedPNM(const std::string &filename, int flags, SourceImage &frame)
+{
+    size_t length = filename.size();
+    if (length < 4 || (filename.compare(length - 4, 4, ".pgm") != 0 && filename.compare(length - 4, 4, ".ppm") != 0))
+    {
+        return false;
+    }
+    std::shared_ptr<MappedFile> mapping(new MappedFile());
+    if (!mapping->open(filename) || mapping->size() < 2 || mapping->data()[0] != 'P' ||
+        (mapping->data()[1] != '5' && mapping->data()[1] != '6'))
+    {
+        return false;
+    }
+    int channels = mapping->data()[1] == '5' ? 1 : 3;
+
+    // header: magic, width, height and maxval separated by whitespace and # comments, then one whitespace character
+    const unsigned char *p = mapping->data() + 2;
+    const unsigned char *end = mapping->data() + mapping->size();
+    int fields[3];
+    for (int field_i = 0; field_i < 3; field_i++)
+    {
+        while (p < end && (std::isspace(*p) || *p == '#'))
+        {
+            if (*p == '#')
+            {
+                while (p < end && *p != '\n')
+                {
+                    p++;
+                }
+            }
+            else
+            {
+                p++;
+            }
+        }
+        if (p == end || !std::isdigit(*p))
+        {
+            return false;
+        }
+        fields[field_i] = 0;
+        while (p < end && std::isdigit(*p) && fields[field_i] < (1 << 24))
+        {
+            fields[field_i] = fields[field_i]*10 + (*p++ - '0');
+        }
+    }
+    int width = fields[0], height = fields[1], maxval = fields[2];
+    if (p == end || !std::isspace(*p) || maxval <= 0 || maxval > 255 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    p++;
+    if (static_cast<size_t>(end - p) < static_cast<size_t>(width)*height*channels)
+    {
+        return false;
+    }
+
+    // note: the Mat header refers to the mapping, which the SourceImage keeps alive
+    cv::Mat mapped(height, width, CV_8UC(channels), const_cast<unsigned char *>(p));
+    bool gray = flags == cv::IMREAD_GRAYSCALE;
+    if (channels == 1 && gray)
+    {
+        frame.image = mapped;
+        frame.mapping = mapping;
+    }
+    else if (channels == 1)
+    {
+        cv::cvtColor(mapped, frame.image, cv::COLOR_GRAY2BGR);
+    }
+    else
+    {
+        cv::cvtColor(mapped, frame.image, gray ? cv::COLOR_RGB2GRAY : cv::COLOR_RGB2BGR);
+    }
+    return true;
+}
+
+
+class ImageSource
+{
+public:
+    // flags as for imread (IMREAD_COLOR or IMREAD_GRAYSCALE); lookahead of at least 1; nthreads 0 = one per core
+    // note: no more threads than the lookahead are started, since more could never all be busy
+    ImageSource(const std::vector<std::string> &filenames, int flags = cv::IMREAD_COLOR, size_t lookahead = 4, int nthreads = 0):
+        _filenames(filenames),
+        _flags(flags),
+        _lookahead(std::max<size_t>(lookahead, 1)),
+        _next(0),
+        _delivered(0),
+        _stopping(false),
+        _waitMs(0.0)
+    {
+        if (nthreads <= 0)
+        {
+            nthreads = defaultThreadCount();
+        }
+        nthreads = static_cast<int>(std::min(std::min<size_t>(nthreads, _lookahead), _filenames.size()));
+        for (int thread_i = 0; thread_i < nthreads; thread_i++)
+        {
+            _workers.push_back(std::thread(&ImageSource::work, this));
+        }
+    }
+
+    ~ImageSource(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wake.notify_all();
+        for (size_t thread_i = 0; thread_i < _workers.size(); thread_i++)
+        {
+            _workers[thread_i].join();
+        }
+    }
+
+    // the next image in file order; false once every file has been handed out
+    bool next(SourceImage &frame)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_delivered >= _filenames.size())
+        {
+            return false;
+        }
+        std::map<size_t, SourceImage>::iterator it = _ready.find(_delivered);
+        if (it == _ready.end())
+        {
+            TRACE_SCOPE("wait_for_decode");
+            Stopwatch stopwatch;
+            while ((it = _ready.find(_delivered)) == _ready.end())
+            {
+                _decoded.wait(lock);
+            }
+            _waitMs += stopwatch.elapsedMs();
+        }
+        frame = it->second;
+        _ready.erase(it);
+        _delivered++;
+        lock.unlock();
+        _wake.notify_all();
+        return true;
+    }
+
+    size_t size(void) const { return _filenames.size(); }
+
+    // time next() spent waiting for a decode to finish, i.e. decoding that was not overlapped with the consumer
+    double waitMs(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _waitMs;
+    }
+
+private:
+    ImageSource(const ImageSource &);
+    ImageSource &operator=(const ImageSource &);
+
+    void work(void)
+    {
+        trace::setThreadName("decode");
+        for (;;)
+        {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while (!_stopping && _next < _filenames.size() && _next >= _delivered + _lookahead)
+                {
+                    _wake.wait(lock);
+                }
+                if (_stopping || _next >= _filenames.size())
+                {
+                    return;
+                }
+                index = _next++;
+            }
+
+            SourceImage frame;
+            frame.index = index;
+            frame.filename = _filenames[index];
+            {
+                TRACE_SCOPE("decode_image");
+                if (!readMappedPNM(frame.filename, _flags, frame))
+                {
+                    frame.image = cv::imread(frame.filename, _flags);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _ready[index] = frame;
+            }
+            _decoded.notify_all();
+        }
+    }
+
+    std::vector<std::string> _filenames;
+    int _flags;
+    size_t _lookahead;
+    size_t _next;           // next file to start decoding
+    size_t _delivered;      // files handed out so far
+    bool _stopping;
+    double _waitMs;
+    std::map<size_t, SourceImage> _ready;
+    std::mutex _mutex;
+    std::condition_variable _wake;      // a worker may start another file
+    std::condition_variable _decoded;   // an image was added to _ready
+    std::vector<std::thread> _workers;
+};
+
+#endif // IMAGE_SOURCE_HPP
@@ -0,0 +1,60 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+
+// number of worker threads to use when none is requested
+inline int defaultThreadCount(void)
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+
+// call task(i) for every i in [0, n) on up to nthreads threads (0 = one per core)
+// note: tasks are handed out one at a time from a shared counter, so uneven tasks balance themselves
+template <typename Task>
+void parallelFor(size_t n, Task task, int nthreads = 0)
+{
+    if (nthreads <= 0)
+    {
+        nthreads = defaultThreadCount();
+    }
+    nthreads = static_cast<int>(std::min<size_t>(nthreads, n));
+    if (nthreads <= 1)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int thread_i = 0; thread_i < nthreads; thread_i++)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            for (size_t i = next++; i < n; i = next++)
+            {
+                task(i);
+            }
+        }));
+    }
+    for (size_t thread_i = 0; thread_i < workers.size(); thread_i++)
+    {
+        workers[thread_i].join();
+    }
+}
+
+#endif // PARALLEL_HPP
@@ -0,0 +1,336 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef PLANES_HPP
+#define PLANES_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <stdint.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <opencv2/core.hpp>
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+
+// RANSAC extraction of the dominant planes (table, walls, floor) of a point cloud
+//
+// planes are found one after another: each is the best of batches of random three-point hypotheses, scored in
+// parallel with an SSE point-to-plane distance kernel, then refit to its inliers by least squares; its inliers are
+// removed and the search repeats on what is left
+// note: sampling stops as soon as enough hypotheses have been tried to find the best plane with the requested
+// confidence, and scoring a hypothesis stops as soon as it can no longer beat the best one so far
+
+
+// points in structure-of-arrays form so that distances can be computed with SIMD
+struct PlanePoints
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    size_t size(void) const { return x.size(); }
+};
+
+// a*x + b*y + c*z + d = 0 with (a, b, c) of unit length
+struct Plane
+{
+    float a, b, c, d;
+};
+
+struct ExtractedPlane
+{
+    Plane plane;
+    std::vector<uint32_t> inliers;  // indices into the original points
+    size_t hypotheses;              // hypotheses scored to find it
+    double ms;
+};
+
+struct PlaneExtractionOptions
+{
+    float threshold;        // largest point-to-plane distance of an inlier
+    int maxPlanes;
+    size_t minInliers;      // stop when the best plane left has fewer inliers
+    double confidence;      // of having sampled an all-inlier triple of the best plane
+    size_t maxHypotheses;   // per plane
+    int batchSize;          // hypotheses scored in parallel between checks of the stopping criterion
+    int nthreads;           // 0 = one per core
+    unsigned seed;
+    PlaneExtractionOptions(void): threshold(1.0F), maxPlanes(3), minInliers(1000), confidence(0.999), maxHypotheses(2000),
+                                  batchSize(64), nthreads(0), seed(12345){}
+};
+
+
+// the number of the n points within threshold of plane
+// note: gives up early, returning a count below giveUpBelow, once the remaining points could not bring the count to it
+inline size_t countPlaneInliers(const float *x, const float *y, const float *z, size_t n, const Plane &plane, float threshold, size_t giveUpBelow = 0)
+{
+    const size_t blockSize = 4096;
+    size_t count = 0;
+    for (size_t begin = 0; begin < n; begin += blockSize)
+    {
+        if (count + (n - begin) < giveUpBelow)
+        {
+            return count;
+        }
+        size_t end = std::min(n, begin + blockSize);
+        size_t i = begin;
+#ifdef __SSE2__
+        const __m128 a = _mm_set1_ps(plane.a), b = _mm_set1_ps(plane.b), c = _mm_set1_ps(plane.c), d = _mm_set1_ps(plane.d);
+        const __m128 t = _mm_set1_ps(threshold);
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+        __m128i counts = _mm_setzero_si128();
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(x + i)), _mm_mul_ps(b, _mm_loadu_ps(y + i))),
+                                         _mm_add_ps(_mm_mul_ps(c, _mm_loadu_ps(z + i)), d));
+            // note: the comparison gives -1 in the lanes of inliers
+            counts = _mm_sub_epi32(counts, _mm_castps_si128(_mm_cmple_ps(_mm_and_ps(distance, absMask), t)));
+        }
+        int32_t lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), counts);
+        count += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+        for (; i < end; i++)
+        {
+            count += std::fabs((plane.a*x[i] + plane.b*y[i]) + (plane.c*z[i] + plane.d)) <= threshold;
+        }
+    }
+    return count;
+}
+
+
+// the plane through three points; false if they are (nearly) collinear
+inline bool planeThrough(const PlanePoints &points, size_t i, size_t j, size_t k, Plane &plane)
+{
+    double u[3] = {points.x[j] - points.x[i], points.y[j] - points.y[i], points.z[j] - points.z[i]};
+    double v[3] = {points.x[k] - points.x[i], points.y[k] - points.y[i], points.z[k] - points.z[i]};
+    double n[3] = {u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0]};
+    double length = std::sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    double scale = std::sqrt((u[0]*u[0] + u[1]*u[1] + u[2]*u[2])*(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]));
+    if (!(length > 1e-6*scale))
+    {
+        return false;
+    }
+    plane.a = static_cast<float>(n[0]/length);
+    plane.b = static_cast<float>(n[1]/length);
+    plane.c = static_cast<float>(n[2]/length);
+    plane.d = static_cast<float>(-(n[0]*points.x[i] + n[1]*points.y[i] + n[2]*points.z[i])/length);
+    return true;
+}
+
+
+// least squares plane through the given points: through their centroid, normal to the direction of least variance
+inline Plane fitPlane(const PlanePoints &points, const std::vector<uint32_t> &indices)
+{
+    double centroid[3] = {0, 0, 0};
+    for (size_t index_i = 0; index_i < indices.size(); index_i++)
+    {
+        centroid[0] += points.x[indices[index_i]];
+        centroid[1] += points.y[indices[index_i]];
+        centroid[2] += points.z[indices[index_i]];
+    }
+    for (int axis = 0; axis < 3; axis++)
+    {
+        centroid[axis] /= indices.size();
+    }
+    cv::Mat covariance = cv::Mat::zeros(3, 3, CV_64F);
+    for (size_t index_i = 0; index_i < indices.size(); index_i++)
+    {
+        double p[3] = {points.x[indices[index_i]] - centroid[0], points.y[indices[index_i]] - centroid[1], points.z[indices[index_i]] - centroid[2]};
+        for (int row_i = 0; row_i < 3; row_i++)
+        {
+            for (int col_i = 0; col_i < 3; col_i++)
+            {
+                covariance.at<double>(row_i, col_i) += p[row_i]*p[col_i];
+            }
+        }
+    }
+    cv::Mat eigenvalues, eigenvectors;
+    cv::eigen(covariance, eigenvalues, eigenvectors);
+
+    // note: eigenvalues are in descending order, so the normal is the last eigenvector
+    Plane plane;
+    plane.a = static_cast<float>(eigenvectors.at<double>(2, 0));
+    plane.b = static_cast<float>(eigenvectors.at<double>(2, 1));
+    plane.c = static_cast<float>(eigenvectors.at<double>(2, 2));
+    plane.d = static_cast<float>(-(plane.a*centroid[0] + plane.b*centroid[1] + plane.c*centroid[2]));
+    return plane;
+}
+
+
+inline void collectPlaneInliers(const PlanePoints &points, const Plane &plane, float threshold, std::vector<uint32_t> &inliers)
+{
+    inliers.clear();
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        if (std::fabs((plane.a*points.x[i] + plane.b*points.y[i]) + (plane.c*points.z[i] + plane.d)) <= threshold)
+        {
+            inliers.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+
+// the number of hypotheses after which three inliers of a plane holding the fraction w of the points have been drawn
+// at least once with the given confidence
+// note: this also bounds the search when there is no plane left: one with the smallest acceptable number of inliers
+// would have been found by then
+inline size_t hypothesesNeeded(double w, double confidence)
+{
+    double miss = 1.0 - w*w*w;
+    if (miss <= 0.0)
+    {
+        return 1;
+    }
+    if (miss >= 1.0)
+    {
+        return static_cast<size_t>(-1);
+    }
+    double estimate = std::log(1.0 - confidence)/std::log(miss);
+    return estimate < 1e18 ? static_cast<size_t>(std::max(estimate, 0.0)) + 1 : static_cast<size_t>(-1);
+}
+
+
+// find up to options.maxPlanes planes; residual receives the indices of the points on none of them
+inline void extractPlanes(const PlanePoints &cloud, const PlaneExtractionOptions &options, std::vector<ExtractedPlane> &planes,
+                          std::vector<uint32_t> &residual)
+{
+    TRACE_SCOPE("extract_planes");
+    planes.clear();
+
+    // the points still unassigned, and their indices in cloud
+    PlanePoints points = cloud;
+    residual.resize(cloud.size());
+    for (size_t i = 0; i < residual.size(); i++)
+    {
+        residual[i] = static_cast<uint32_t>(i);
+    }
+
+    std::mt19937 rng(options.seed);
+    std::vector<Plane> hypotheses(options.batchSize);
+    std::vector<char> valid(options.batchSize);   // false where every draw was degenerate, so the slot holds no plane
+    std::vector<size_t> scores(options.batchSize);
+    std::vector<uint32_t> inliers;
+    while (static_cast<int>(planes.size()) < options.maxPlanes && points.size() >= std::max<size_t>(options.minInliers, 3))
+    {
+        TRACE_SCOPE("extract_plane");
+        Stopwatch stopwatch;
+        size_t n = points.size();
+        std::uniform_int_distribution<size_t> pick(0, n - 1);
+        Plane best = Plane();
+        bool found = false;
+        std::atomic<size_t> bestScore(0);
+        size_t tried = 0;
+        size_t needed = std::min(options.maxHypotheses, hypothesesNeeded(static_cast<double>(options.minInliers)/n, options.confidence));
+        while (tried < needed)
+        {
+            // draw a batch of hypotheses on this thread, so the result does not depend on the thread count
+            int batch = static_cast<int>(std::min<size_t>(options.batchSize, needed - tried));
+            for (int hypothesis_i = 0; hypothesis_i < batch; hypothesis_i++)
+            {
+                size_t i, j, k;
+                int attempts = 0;
+                bool drawn;
+                do
+                {
+                    i = pick(rng);
+                    j = pick(rng);
+                    k = pick(rng);
+                    drawn = i != j && j != k && i != k && planeThrough(points, i, j, k, hypotheses[hypothesis_i]);
+                }
+                while (!drawn && ++attempts < 100);
+                valid[hypothesis_i] = drawn;
+            }
+
+            // score them in parallel; each one is abandoned once it cannot reach the best score known at the time
+            // note: a hypothesis that ties the best is counted in full, so every one with the batch's top score is known
+            // whichever finishes first, and the lowest-numbered of them is taken. a slot without a plane scores 0 rather
+            // than being scored, since the zero plane it may hold would count every point as an inlier
+            size_t previousBest = bestScore.load();
+            parallelFor(batch, [&](size_t hypothesis_i)
+            {
+                if (!valid[hypothesis_i])
+                {
+                    scores[hypothesis_i] = 0;
+                    return;
+                }
+                scores[hypothesis_i] = countPlaneInliers(&points.x[0], &points.y[0], &points.z[0], n, hypotheses[hypothesis_i],
+                                                         options.threshold, bestScore.load());
+                size_t known = bestScore.load();
+                while (scores[hypothesis_i] > known && !bestScore.compare_exchange_weak(known, scores[hypothesis_i]))
+                {
+                }
+            }, options.nthreads);
+            for (int hypothesis_i = 0; hypothesis_i < batch; hypothesis_i++)
+            {
+                // note: an earlier batch's plane is kept unless this batch beat it
+                if (valid[hypothesis_i] && scores[hypothesis_i] == bestScore.load() && (!found || bestScore.load() > previousBest))
+                {
+                    best = hypotheses[hypothesis_i];
+                    found = true;
+                    break;
+                }
+            }
+            tried += batch;
+
+            // note: a better plane would only lower this, so once it is reached the best plane has been found
+            needed = std::min(needed, hypothesesNeeded(static_cast<double>(bestScore.load())/n, options.confidence));
+        }
+        if (!found || bestScore.load() < options.minInliers)
+        {
+            break;
+        }
+
+        // refine by least squares; the refit is kept if it does not lose inliers
+        collectPlaneInliers(points, best, options.threshold, inliers);
+        Plane refined = fitPlane(points, inliers);
+        if (countPlaneInliers(&points.x[0], &points.y[0], &points.z[0], n, refined, options.threshold) >= inliers.size())
+        {
+            best = refined;
+            collectPlaneInliers(points, best, options.threshold, inliers);
+        }
+
+        ExtractedPlane extracted;
+        extracted.plane = best;
+        extracted.hypotheses = tried;
+        extracted.inliers.resize(inliers.size());
+        for (size_t inlier_i = 0; inlier_i < inliers.size(); inlier_i++)
+        {
+            extracted.inliers[inlier_i] = residual[inliers[inlier_i]];
+        }
+
+        // remove the inliers from the points still to be assigned
+        size_t kept = 0;
+        size_t inlier_i = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (inlier_i < inliers.size() && inliers[inlier_i] == i)
+            {
+                inlier_i++;
+                continue;
+            }
+            points.x[kept] = points.x[i];
+            points.y[kept] = points.y[i];
+            points.z[kept] = points.z[i];
+            residual[kept] = residual[i];
+            kept++;
+        }
+        points.x.resize(kept);
+        points.y.resize(kept);
+        points.z.resize(kept);
+        residual.resize(kept);
+
+        extracted.ms = stopwatch.elapsedMs();
+        planes.push_back(extracted);
+    }
+}
+
+#endif // PLANES_HPP
@@ -0,0 +1,296 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef POINT_CLOUD_HPP
+#define POINT_CLOUD_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "parallel.hpp"
+
+
+// point cloud types and parsers shared by the point cloud tools
+// note: points are stored in OpenGL eye-space convention, i.e. with z negated relative to the points file
+// note: a points file line is "x y z r g b", optionally followed by a normal "nx ny nz"; organized files (see
+// writePointCloud in stereo.hpp) start with a "# organized <width> <height>" line and mark invalid pixels with nan
+// coordinates, which are skipped
+
+struct Coords3D {
+    double x;
+    double y;
+    double z;
+    Coords3D(void){}
+    Coords3D(double x, double y, double z): x(x), y(y), z(z){}
+};
+
+struct ColorRGB {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    ColorRGB(void){}
+    ColorRGB(uint8_t r, uint8_t g, uint8_t b): r(r), g(g), b(b){}
+};
+
+struct Point
+{
+    Coords3D coords;
+    ColorRGB color;
+    float normal[3];    // unit surface normal; all zero if the points file has none
+    Point(void){}
+    Point(const Coords3D &coords, const ColorRGB &color): coords(coords), color(color){ setNormal(0.0F, 0.0F, 0.0F); }
+    Point(float x, float y, float z, int r, int g, int b): coords(x, y, z), color(r, g, b){ setNormal(0.0F, 0.0F, 0.0F); }
+    void setNormal(float x, float y, float z){ normal[0] = x; normal[1] = y; normal[2] = z; }
+};
+
+// a camera path keyframe; nframes is the number of frames spent moving from the previous keyframe to this one (for the first keyframe, the number of frames to hold it)
+struct CameraKeyframe
+{
+    int nframes;
+    Coords3D rotation;
+    Coords3D translation;
+};
+
+
+// parse one line of a points file
+// returns 1 for a valid point, 0 for an incomplete line or an invalid pixel of an organized file, and -1 for invalid data
+inline int parsePointLine(const char *line, Point &point)
+{
+    const char *p = line;
+    char *end;
+    float xyz[3];
+    long rgb[3];
+    float normal[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        xyz[i] = strtof(p, &end);
+        if (end == p)
+        {
+            return 0;
+        }
+        p = end;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        rgb[i] = strtol(p, &end, 10);
+        if (end == p)
+        {
+            return 0;
+        }
+        p = end;
+    }
+
+    // the normal is optional
+    bool hasNormal = true;
+    for (int i = 0; i < 3 && hasNormal; i++)
+    {
+        normal[i] = strtof(p, &end);
+        hasNormal = end != p;
+        p = end;
+    }
+
+    // we have a complete set of data; verify data integrity
+    if (std::isnan(xyz[0]) && std::isnan(xyz[1]) && std::isnan(xyz[2]))
+    {
+        return 0;
+    }
+    if (!std::isfinite(xyz[0]) || !std::isfinite(xyz[1]) || !std::isfinite(xyz[2]))
+    {
+        std::cerr << "error: x, y, or z not finite" << std::endl;
+        return -1;
+    }
+    if (rgb[0] < 0 || rgb[0] > 255 || rgb[1] < 0 || rgb[1] > 255 || rgb[2] < 0 || rgb[2] > 255)
+    {
+        std::cerr << "error: r, b, or g not within [0, 255]" << std::endl;
+        return -1;
+    }
+
+    point = Point(xyz[0], xyz[1], -xyz[2], rgb[0], rgb[1], rgb[2]);
+    if (hasNormal && std::isfinite(normal[0]) && std::isfinite(normal[1]) && std::isfinite(normal[2]))
+    {
+        point.setNormal(normal[0], normal[1], -normal[2]);
+    }
+    return 1;
+}
+
+
+// load every point of a points file; returns false if the file can't be read or holds invalid data
+inline bool loadPointsFile(const std::string &filename, std::vector<Point> &points)
+{
+    std::ifstream fin(filename.c_str());
+    if (!fin)
+    {
+        std::cerr << "error: couldn't open file \"" << filename << "\" for input" << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(fin, line))
+    {
+        Point point;
+        int status = parsePointLine(line.c_str(), point);
+        if (status < 0)
+        {
+            return false;
+        }
+        if (status > 0)
+        {
+            points.push_back(point);
+        }
+    }
+    return true;
+}
+
+
+// loadPointsFile with the parsing spread over up to nthreads threads (0 = one per core); the points come out in file order
+// note: the file is read in one go and split at line boundaries into chunks that are parsed independently
+inline bool loadPointsFileParallel(const std::string &filename, std::vector<Point> &points, int nthreads = 0)
+{
+    std::ifstream fin(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    if (!fin)
+    {
+        std::cerr << "error: couldn't open file \"" << filename << "\" for input" << std::endl;
+        return false;
+    }
+    size_t fileSize = static_cast<size_t>(fin.tellg());
+    std::vector<char> text(fileSize + 1, '\0');
+    fin.seekg(0);
+    if (fileSize > 0 && !fin.read(&text[0], fileSize))
+    {
+        std::cerr << "error: couldn't read file \"" << filename << "\"" << std::endl;
+        return false;
+    }
+
+    // chunk boundaries at the first line start at or after each nominal offset
+    const size_t nchunks = std::max<size_t>(1, std::min<size_t>(256, fileSize/(1 << 16)));
+    std::vector<size_t> chunkStart(nchunks + 1, fileSize);
+    chunkStart[0] = 0;
+    for (size_t chunk_i = 1; chunk_i < nchunks; chunk_i++)
+    {
+        const char *newline = static_cast<const char *>(memchr(&text[fileSize*chunk_i/nchunks], '\n', fileSize - fileSize*chunk_i/nchunks));
+        chunkStart[chunk_i] = std::max(chunkStart[chunk_i - 1], newline ? static_cast<size_t>(newline - &text[0]) + 1 : fileSize);
+    }
+
+    // parse each chunk's lines in place, terminating each at its newline
+    std::vector<std::vector<Point> > chunkPoints(nchunks);
+    std::atomic<bool> failed(false);
+    parallelFor(nchunks, [&](size_t chunk_i)
+    {
+        char *line = &text[0] + chunkStart[chunk_i];
+        char *end = &text[0] + chunkStart[chunk_i + 1];
+        while (line < end && !failed.load())
+        {
+            char *newline = static_cast<char *>(memchr(line, '\n', end - line));
+            char *next = newline ? newline + 1 : end;
+            if (newline)
+            {
+                *newline = '\0';
+            }
+            Point point;
+            int status = parsePointLine(line, point);
+            if (status < 0)
+            {
+                failed = true;
+            }
+            else if (status > 0)
+            {
+                chunkPoints[chunk_i].push_back(point);
+            }
+            line = next;
+        }
+    }, nthreads);
+    if (failed)
+    {
+        return false;
+    }
+
+    size_t npoints = points.size();
+    for (size_t chunk_i = 0; chunk_i < nchunks; chunk_i++)
+    {
+        npoints += chunkPoints[chunk_i].size();
+    }
+    points.reserve(npoints);
+    for (size_t chunk_i = 0; chunk_i < nchunks; chunk_i++)
+    {
+        points.insert(points.end(), chunkPoints[chunk_i].begin(), chunkPoints[chunk_i].end());
+    }
+    return true;
+}
+
+
+// read camera path keyframes (see CameraKeyframe)
+inline bool loadCameraPath(std::istream &is, std::vector<CameraKeyframe> &keyframes)
+{
+    std::string line;
+    int line_i = 0;
+
+    // each non-empty, non-comment line is: nframes rx ry rz tx ty tz
+    while (std::getline(is, line))
+    {
+        line_i++;
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        CameraKeyframe keyframe;
+        std::stringstream ss(line);
+        ss >> keyframe.nframes;
+        ss >> keyframe.rotation.x >> keyframe.rotation.y >> keyframe.rotation.z;
+        ss >> keyframe.translation.x >> keyframe.translation.y >> keyframe.translation.z;
+        if (!ss || keyframe.nframes < 1)
+        {
+            std::cerr << "error: malformed camera path keyframe on line " << line_i << std::endl;
+            return false;
+        }
+        keyframes.push_back(keyframe);
+    }
+
+    if (keyframes.empty())
+    {
+        std::cerr << "error: camera path contains no keyframes" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+inline Coords3D interpolate(const Coords3D &a, const Coords3D &b, double t)
+{
+    return Coords3D(a.x + t*(b.x - a.x), a.y + t*(b.y - a.y), a.z + t*(b.z - a.z));
+}
+
+
+// expand the keyframes into one rotation/translation pair per frame using linear interpolation
+inline void expandCameraPath(const std::vector<CameraKeyframe> &keyframes, std::vector<Coords3D> &rotations, std::vector<Coords3D> &translations)
+{
+    for (int frame_i = 0; frame_i < keyframes[0].nframes; frame_i++)
+    {
+        rotations.push_back(keyframes[0].rotation);
+        translations.push_back(keyframes[0].translation);
+    }
+    for (size_t key_i = 1; key_i < keyframes.size(); key_i++)
+    {
+        const CameraKeyframe &from = keyframes[key_i - 1];
+        const CameraKeyframe &to = keyframes[key_i];
+        for (int frame_i = 1; frame_i <= to.nframes; frame_i++)
+        {
+            double t = static_cast<double>(frame_i)/to.nframes;
+            rotations.push_back(interpolate(from.rotation, to.rotation, t));
+            translations.push_back(interpolate(from.translation, to.translation, t));
+        }
+    }
+}
+
+#endif // POINT_CLOUD_HPP
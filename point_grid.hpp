@@ -0,0 +1,506 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef POINT_GRID_HPP
+#define POINT_GRID_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+
+// sparse uniform grid over a point cloud for picking and neighborhood queries
+// note: only occupied cells are stored; they are found through an open-addressing hash table, and the points of each cell are stored contiguously
+class PointGrid
+{
+public:
+    PointGrid(void): _npoints(0), _cellSize(1.0), _tableMask(0) {}
+
+    // build the index over npoints xyz triples; stride is the distance in bytes between consecutive points (as for glVertexPointer)
+    void build(const double *xyz, size_t npoints, size_t stride, double pointsPerCell = 8.0);
+
+    size_t size(void) const { return _npoints; }
+    size_t cellCount(void) const { return _cellKeys.size(); }
+    double cellSize(void) const { return _cellSize; }
+
+    // the point indices in cell order; visiting points in this order keeps neighboring queries on neighboring memory
+    const std::vector<uint32_t> &cellOrder(void) const { return _sortedIndex; }
+
+    // find the point closest to the origin along a ray (direction must be unit length) that lies within tolerance + slope*t of the ray at distance t; returns -1 if there is none
+    // note: the allowed distance is capped at one cell; beyond that the cloud is denser than the cone and a hit is found anyway
+    long pickRay(const double origin[3], const double direction[3], double tolerance, double slope) const;
+
+    // append the indices of all points within radius of center
+    void radiusQuery(const double center[3], double radius, std::vector<uint32_t> &indices) const;
+
+    // the index of the point nearest to center, or -1 if there is none within maxDistance; distance receives its distance
+    // note: cells are searched in shells of growing radius around center's cell, stopping as soon as the next shell cannot
+    // hold a nearer point, and cells farther away than the best point so far are skipped without being looked up, so a
+    // query near the cloud touches only a few cells whatever the cloud's size
+    long nearest(const double center[3], double maxDistance, double &distance) const;
+
+private:
+    long findCell(long ix, long iy, long iz) const;
+    long cellCoord(double value, int axis) const { return static_cast<long>(std::floor((value - _min[axis])/_cellSize)); }
+    static uint64_t cellKey(long ix, long iy, long iz) { return static_cast<uint64_t>(ix) | (static_cast<uint64_t>(iy) << 21) | (static_cast<uint64_t>(iz) << 42); }
+    static uint64_t hashKey(uint64_t key) { return (key*0x9E3779B97F4A7C15ULL) >> 20; }
+    bool nearOccupied(long ix, long iy, long iz) const;
+
+    size_t _npoints;
+    double _min[3];
+    double _max[3];
+    double _cellSize;
+    long _dims[3];
+    std::vector<uint64_t> _cellKeys;   // occupied cells, sorted by key
+    std::vector<uint32_t> _cellStart;  // first point of each cell in _sortedXYZ (plus a final sentinel)
+    std::vector<float> _sortedXYZ;     // point coordinates in cell order
+    std::vector<uint32_t> _sortedIndex; // original index of each point in cell order
+    std::vector<int32_t> _table;       // hash table of cell numbers (-1 = empty slot)
+    size_t _tableMask;
+    static const int _blockShift = 2;  // blocks are 4x4x4 cells
+    long _blockDims[3];
+    std::vector<bool> _blockNearOccupied; // dense block mask, dilated by one block, for skipping empty space
+};
+
+
+inline void PointGrid::build(const double *xyz, size_t npoints, size_t stride, double pointsPerCell)
+{
+    const char *base = reinterpret_cast<const char *>(xyz);
+    _npoints = npoints;
+    _cellKeys.clear();
+    _cellStart.clear();
+    _sortedXYZ.clear();
+    _sortedIndex.clear();
+    _table.clear();
+    if (npoints == 0)
+    {
+        return;
+    }
+
+    // determine the bounding box
+    for (int axis = 0; axis < 3; axis++)
+    {
+        _min[axis] = _max[axis] = xyz[axis];
+    }
+    for (size_t point_i = 0; point_i < npoints; point_i++)
+    {
+        const double *p = reinterpret_cast<const double *>(base + point_i*stride);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            _min[axis] = std::min(_min[axis], p[axis]);
+            _max[axis] = std::max(_max[axis], p[axis]);
+        }
+    }
+    double extent = std::max(std::max(_max[0] - _min[0], _max[1] - _min[1]), _max[2] - _min[2]);
+    extent = std::max(extent, 1e-6);
+
+    // pick the cell size from the occupancy of a coarse grid
+    // note: clouds from depth maps are surfaces, so the number of fine cells per occupied coarse cell grows with the square of the refinement
+    const int ncoarse = 64;
+    double coarseSize = extent/ncoarse*(1.0 + 1e-9);
+    std::vector<bool> occupied(ncoarse*ncoarse*ncoarse, false);
+    size_t noccupied = 0;
+    for (size_t point_i = 0; point_i < npoints; point_i++)
+    {
+        const double *p = reinterpret_cast<const double *>(base + point_i*stride);
+        int cx = std::min(ncoarse - 1, static_cast<int>((p[0] - _min[0])/coarseSize));
+        int cy = std::min(ncoarse - 1, static_cast<int>((p[1] - _min[1])/coarseSize));
+        int cz = std::min(ncoarse - 1, static_cast<int>((p[2] - _min[2])/coarseSize));
+        size_t cell = (static_cast<size_t>(cz)*ncoarse + cy)*ncoarse + cx;
+        if (!occupied[cell])
+        {
+            occupied[cell] = true;
+            noccupied++;
+        }
+    }
+    double refinement = std::sqrt(npoints/(pointsPerCell*noccupied));
+    _cellSize = coarseSize/std::max(refinement, 1.0);
+    _cellSize = std::max(_cellSize, extent/((1 << 21) - 2)); // cell coordinates must fit in 21 bits
+    for (int axis = 0; axis < 3; axis++)
+    {
+        _dims[axis] = cellCoord(_max[axis], axis) + 1;
+    }
+
+    // sort the points by cell
+    std::vector<std::pair<uint64_t, uint32_t> > keyed(npoints);
+    for (size_t point_i = 0; point_i < npoints; point_i++)
+    {
+        const double *p = reinterpret_cast<const double *>(base + point_i*stride);
+        keyed[point_i] = std::make_pair(cellKey(cellCoord(p[0], 0), cellCoord(p[1], 1), cellCoord(p[2], 2)), static_cast<uint32_t>(point_i));
+    }
+    std::sort(keyed.begin(), keyed.end());
+
+    // lay out the cells and their points contiguously
+    _sortedXYZ.resize(3*npoints);
+    _sortedIndex.resize(npoints);
+    for (size_t sorted_i = 0; sorted_i < npoints; sorted_i++)
+    {
+        if (sorted_i == 0 || keyed[sorted_i].first != keyed[sorted_i - 1].first)
+        {
+            _cellKeys.push_back(keyed[sorted_i].first);
+            _cellStart.push_back(static_cast<uint32_t>(sorted_i));
+        }
+        const double *p = reinterpret_cast<const double *>(base + keyed[sorted_i].second*stride);
+        _sortedXYZ[3*sorted_i + 0] = static_cast<float>(p[0]);
+        _sortedXYZ[3*sorted_i + 1] = static_cast<float>(p[1]);
+        _sortedXYZ[3*sorted_i + 2] = static_cast<float>(p[2]);
+        _sortedIndex[sorted_i] = keyed[sorted_i].second;
+    }
+    _cellStart.push_back(static_cast<uint32_t>(npoints));
+
+    // hash the occupied cells (load factor at most 1/2)
+    size_t capacity = 1;
+    while (capacity < 2*_cellKeys.size())
+    {
+        capacity <<= 1;
+    }
+    _table.assign(capacity, -1);
+    _tableMask = capacity - 1;
+    for (size_t cell_i = 0; cell_i < _cellKeys.size(); cell_i++)
+    {
+        size_t slot = hashKey(_cellKeys[cell_i]) & _tableMask;
+        while (_table[slot] >= 0)
+        {
+            slot = (slot + 1) & _tableMask;
+        }
+        _table[slot] = static_cast<int32_t>(cell_i);
+    }
+
+    // mark the blocks that have an occupied cell within one block of them, so that ray walks can skip empty space without hash lookups
+    double nblocks = 1.0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        _blockDims[axis] = (_dims[axis] >> _blockShift) + 1;
+        nblocks *= _blockDims[axis];
+    }
+    _blockNearOccupied.clear();
+    if (nblocks <= 64e6)
+    {
+        _blockNearOccupied.assign(static_cast<size_t>(nblocks), false);
+        for (size_t cell_i = 0; cell_i < _cellKeys.size(); cell_i++)
+        {
+            long bx = static_cast<long>(_cellKeys[cell_i] & 0x1FFFFF) >> _blockShift;
+            long by = static_cast<long>((_cellKeys[cell_i] >> 21) & 0x1FFFFF) >> _blockShift;
+            long bz = static_cast<long>(_cellKeys[cell_i] >> 42) >> _blockShift;
+            for (long z = std::max(0L, bz - 1); z <= std::min(_blockDims[2] - 1, bz + 1); z++)
+            {
+                for (long y = std::max(0L, by - 1); y <= std::min(_blockDims[1] - 1, by + 1); y++)
+                {
+                    for (long x = std::max(0L, bx - 1); x <= std::min(_blockDims[0] - 1, bx + 1); x++)
+                    {
+                        _blockNearOccupied[(z*_blockDims[1] + y)*_blockDims[0] + x] = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// false only if no occupied cell lies within one cell of (ix, iy, iz)
+inline bool PointGrid::nearOccupied(long ix, long iy, long iz) const
+{
+    if (_blockNearOccupied.empty())
+    {
+        return true;
+    }
+    if (ix < -1 || iy < -1 || iz < -1 || ix > _dims[0] || iy > _dims[1] || iz > _dims[2])
+    {
+        return false;
+    }
+    long bx = std::max(0L, ix) >> _blockShift;
+    long by = std::max(0L, iy) >> _blockShift;
+    long bz = std::max(0L, iz) >> _blockShift;
+    bx = std::min(bx, _blockDims[0] - 1);
+    by = std::min(by, _blockDims[1] - 1);
+    bz = std::min(bz, _blockDims[2] - 1);
+    return _blockNearOccupied[(bz*_blockDims[1] + by)*_blockDims[0] + bx];
+}
+
+
+inline long PointGrid::findCell(long ix, long iy, long iz) const
+{
+    if (_table.empty() || ix < 0 || iy < 0 || iz < 0 || ix >= _dims[0] || iy >= _dims[1] || iz >= _dims[2])
+    {
+        return -1;
+    }
+    uint64_t key = cellKey(ix, iy, iz);
+    size_t slot = hashKey(key) & _tableMask;
+    while (_table[slot] >= 0)
+    {
+        if (_cellKeys[_table[slot]] == key)
+        {
+            return _table[slot];
+        }
+        slot = (slot + 1) & _tableMask;
+    }
+    return -1;
+}
+
+
+inline long PointGrid::pickRay(const double origin[3], const double direction[3], double tolerance, double slope) const
+{
+    if (_npoints == 0)
+    {
+        return -1;
+    }
+
+    // clip the ray against the bounding box grown by one cell
+    double tEnter = 0.0;
+    double tExit = HUGE_VAL;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double lo = _min[axis] - _cellSize;
+        double hi = _max[axis] + _cellSize;
+        if (std::fabs(direction[axis]) < 1e-12)
+        {
+            if (origin[axis] < lo || origin[axis] > hi)
+            {
+                return -1;
+            }
+            continue;
+        }
+        double t0 = (lo - origin[axis])/direction[axis];
+        double t1 = (hi - origin[axis])/direction[axis];
+        tEnter = std::max(tEnter, std::min(t0, t1));
+        tExit = std::min(tExit, std::max(t0, t1));
+    }
+    if (tEnter > tExit)
+    {
+        return -1;
+    }
+
+    // walk the cells along the ray front to back (Amanatides & Woo)
+    long cell[3];
+    long step[3];
+    double tNext[3];
+    double tDelta[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double entry = origin[axis] + tEnter*direction[axis];
+        cell[axis] = cellCoord(entry, axis);
+        if (direction[axis] > 0)
+        {
+            step[axis] = 1;
+            tDelta[axis] = _cellSize/direction[axis];
+            tNext[axis] = tEnter + ((_min[axis] + (cell[axis] + 1)*_cellSize) - entry)/direction[axis];
+        }
+        else if (direction[axis] < 0)
+        {
+            step[axis] = -1;
+            tDelta[axis] = -_cellSize/direction[axis];
+            tNext[axis] = tEnter + ((_min[axis] + cell[axis]*_cellSize) - entry)/direction[axis];
+        }
+        else
+        {
+            step[axis] = 0;
+            tDelta[axis] = HUGE_VAL;
+            tNext[axis] = HUGE_VAL;
+        }
+    }
+
+    long best = -1;
+    double bestT = HUGE_VAL;
+    double tCell = tEnter;
+    while (tCell <= tExit)
+    {
+        // check the cell and its neighbors, which hold every point within one cell of the ray
+        if (nearOccupied(cell[0], cell[1], cell[2]))
+        {
+            for (long dz = -1; dz <= 1; dz++)
+            {
+                for (long dy = -1; dy <= 1; dy++)
+                {
+                    for (long dx = -1; dx <= 1; dx++)
+                    {
+                        long cell_i = findCell(cell[0] + dx, cell[1] + dy, cell[2] + dz);
+                        if (cell_i < 0)
+                        {
+                            continue;
+                        }
+                        for (uint32_t sorted_i = _cellStart[cell_i]; sorted_i < _cellStart[cell_i + 1]; sorted_i++)
+                        {
+                            const float *p = &_sortedXYZ[3*sorted_i];
+                            double v[3] = {p[0] - origin[0], p[1] - origin[1], p[2] - origin[2]};
+                            double t = v[0]*direction[0] + v[1]*direction[1] + v[2]*direction[2];
+                            if (t < 0 || t >= bestT)
+                            {
+                                continue;
+                            }
+                            double allowed = std::min(tolerance + slope*t, _cellSize);
+                            double distanceSquared = v[0]*v[0] + v[1]*v[1] + v[2]*v[2] - t*t;
+                            if (distanceSquared <= allowed*allowed)
+                            {
+                                best = _sortedIndex[sorted_i];
+                                bestT = t;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // nothing further along the ray can be in front of the best point found so far
+        if (tCell > bestT + 2.0*_cellSize*1.7320508)
+        {
+            break;
+        }
+
+        // advance to the next cell
+        int axis = (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2);
+        tCell = tNext[axis];
+        tNext[axis] += tDelta[axis];
+        cell[axis] += step[axis];
+    }
+
+    return best;
+}
+
+
+inline void PointGrid::radiusQuery(const double center[3], double radius, std::vector<uint32_t> &indices) const
+{
+    if (_npoints == 0)
+    {
+        return;
+    }
+
+    long lo[3];
+    long hi[3];
+    double ncells = 1.0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        lo[axis] = std::max(0L, cellCoord(center[axis] - radius, axis));
+        hi[axis] = std::min(_dims[axis] - 1, cellCoord(center[axis] + radius, axis));
+        if (lo[axis] > hi[axis])
+        {
+            return;
+        }
+        ncells *= hi[axis] - lo[axis] + 1;
+    }
+
+    double radiusSquared = radius*radius;
+    if (ncells > _cellKeys.size())
+    {
+        // the query box covers more cells than are occupied; a straight scan is cheaper
+        for (size_t sorted_i = 0; sorted_i < _npoints; sorted_i++)
+        {
+            const float *p = &_sortedXYZ[3*sorted_i];
+            double dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+            if (dx*dx + dy*dy + dz*dz <= radiusSquared)
+            {
+                indices.push_back(_sortedIndex[sorted_i]);
+            }
+        }
+        return;
+    }
+
+    for (long iz = lo[2]; iz <= hi[2]; iz++)
+    {
+        for (long iy = lo[1]; iy <= hi[1]; iy++)
+        {
+            for (long ix = lo[0]; ix <= hi[0]; ix++)
+            {
+                long cell_i = findCell(ix, iy, iz);
+                if (cell_i < 0)
+                {
+                    continue;
+                }
+                for (uint32_t sorted_i = _cellStart[cell_i]; sorted_i < _cellStart[cell_i + 1]; sorted_i++)
+                {
+                    const float *p = &_sortedXYZ[3*sorted_i];
+                    double dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+                    if (dx*dx + dy*dy + dz*dz <= radiusSquared)
+                    {
+                        indices.push_back(_sortedIndex[sorted_i]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+inline long PointGrid::nearest(const double center[3], double maxDistance, double &distance) const
+{
+    if (_npoints == 0)
+    {
+        return -1;
+    }
+
+    // start from the cell nearest to center (center itself may lie outside the grid)
+    long cell[3];
+    long maxShell = 0;
+    double faceDistance = HUGE_VAL;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        cell[axis] = std::min(std::max(cellCoord(center[axis], axis), 0L), _dims[axis] - 1);
+        maxShell = std::max(maxShell, std::max(cell[axis], _dims[axis] - 1 - cell[axis]));
+        double lo = _min[axis] + cell[axis]*_cellSize;
+        faceDistance = std::min(faceDistance, std::max(0.0, std::min(center[axis] - lo, lo + _cellSize - center[axis])));
+    }
+
+    long best = -1;
+    double bestSquared = maxDistance*maxDistance;
+    for (long shell = 0; shell <= maxShell; shell++)
+    {
+        // every point in this shell or beyond lies outside the cube of the inner shells around center
+        double bound = shell > 0 ? faceDistance + (shell - 1)*_cellSize : 0.0;
+        if (bound*bound > bestSquared)
+        {
+            break;
+        }
+
+        // the cells at Chebyshev distance shell from the start cell: whole rows on the shell's faces, two cells elsewhere
+        for (long dz = -shell; dz <= shell; dz++)
+        {
+            for (long dy = -shell; dy <= shell; dy++)
+            {
+                bool face = dz == -shell || dz == shell || dy == -shell || dy == shell;
+                long dxStep = face || shell == 0 ? 1 : 2*shell;
+                for (long dx = -shell; dx <= shell; dx += dxStep)
+                {
+                    long offset[3] = {dx, dy, dz};
+                    double cellSquared = 0.0;
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        double lo = _min[axis] + (cell[axis] + offset[axis])*_cellSize;
+                        double gap = std::max(0.0, std::max(lo - center[axis], center[axis] - lo - _cellSize));
+                        cellSquared += gap*gap;
+                    }
+                    if (cellSquared > bestSquared || !nearOccupied(cell[0] + dx, cell[1] + dy, cell[2] + dz))
+                    {
+                        continue;
+                    }
+                    long cell_i = findCell(cell[0] + dx, cell[1] + dy, cell[2] + dz);
+                    if (cell_i < 0)
+                    {
+                        continue;
+                    }
+                    for (uint32_t sorted_i = _cellStart[cell_i]; sorted_i < _cellStart[cell_i + 1]; sorted_i++)
+                    {
+                        const float *p = &_sortedXYZ[3*sorted_i];
+                        double v[3] = {p[0] - center[0], p[1] - center[1], p[2] - center[2]};
+                        double distanceSquared = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+                        if (distanceSquared < bestSquared || (best < 0 && distanceSquared <= bestSquared))
+                        {
+                            best = _sortedIndex[sorted_i];
+                            bestSquared = distanceSquared;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (best >= 0)
+    {
+        distance = std::sqrt(bestSquared);
+    }
+    return best;
+}
+
+#endif // POINT_GRID_HPP
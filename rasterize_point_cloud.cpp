@@ -0,0 +1,458 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <vector>
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <limits>
+#include <iomanip>
+#include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "parallel.hpp"
+#include "point_cloud.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+
+// for convenience
+using namespace std;
+
+
+// user defined types
+
+// points in structure-of-arrays form so that they can be transformed with SIMD
+struct PointArrays
+{
+    vector<float> x;
+    vector<float> y;
+    vector<float> z;
+    vector<uint32_t> bgr; // B | G << 8 | R << 16, the byte order of an OpenCV image
+};
+
+// a point that has been projected into a tile
+struct Splat
+{
+    int32_t x;
+    int32_t y;
+    float depth;
+    uint32_t bgr;
+};
+
+// modelview and projection, set up to match render_point_cloud
+struct Camera
+{
+    float m[12];  // row-major 3x4 modelview
+    float ax, ay; // projection scale: sx = cx + ax*xe/(-ze), sy = cy - ay*ye/(-ze)
+    float cx, cy;
+    float farPlane;
+};
+
+
+// globals
+
+// tunable parameters
+int    _tileSize = 64;       // screen tiles are _tileSize x _tileSize pixels
+size_t _chunkSize = 65536;   // points per transform/binning task
+double _fovy = 60.0;         // matches gluPerspective in render_point_cloud
+double _farPlane = 200.0;
+
+
+Camera makeCamera(const Coords3D &rotation, const Coords3D &translation, int width, int height)
+{
+    // modelview = T * Rx * Ry * Rz, with the angles truncated to whole degrees as render_point_cloud does
+    double rx = static_cast<int>(rotation.x)*M_PI/180.0;
+    double ry = static_cast<int>(rotation.y)*M_PI/180.0;
+    double rz = static_cast<int>(rotation.z)*M_PI/180.0;
+    double Rx[3][3] = {{1, 0, 0}, {0, cos(rx), -sin(rx)}, {0, sin(rx), cos(rx)}};
+    double Ry[3][3] = {{cos(ry), 0, sin(ry)}, {0, 1, 0}, {-sin(ry), 0, cos(ry)}};
+    double Rz[3][3] = {{cos(rz), -sin(rz), 0}, {sin(rz), cos(rz), 0}, {0, 0, 1}};
+    double Rxy[3][3], R[3][3];
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            Rxy[i][j] = Rx[i][0]*Ry[0][j] + Rx[i][1]*Ry[1][j] + Rx[i][2]*Ry[2][j];
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            R[i][j] = Rxy[i][0]*Rz[0][j] + Rxy[i][1]*Rz[1][j] + Rxy[i][2]*Rz[2][j];
+        }
+    }
+
+    Camera camera;
+    double t[3] = {translation.x, translation.y, translation.z};
+    for (int i = 0; i < 3; i++)
+    {
+        camera.m[i*4 + 0] = R[i][0];
+        camera.m[i*4 + 1] = R[i][1];
+        camera.m[i*4 + 2] = R[i][2];
+        camera.m[i*4 + 3] = t[i];
+    }
+
+    double f = 1.0/tan(_fovy*M_PI/360.0);
+    camera.ax = f*height/2.0; // (f/aspect)*width/2
+    camera.ay = f*height/2.0;
+    camera.cx = width/2.0;
+    camera.cy = height/2.0;
+    camera.farPlane = _farPlane;
+    return camera;
+}
+
+
+// transform and project points [begin, end) to screen coordinates and depth
+void projectPoints(const PointArrays &points, const Camera &camera, size_t begin, size_t end, float *sx, float *sy, float *depth)
+{
+    const float *m = camera.m;
+    size_t i = begin;
+#ifdef __SSE2__
+    const __m128 m00 = _mm_set1_ps(m[0]), m01 = _mm_set1_ps(m[1]), m02 = _mm_set1_ps(m[2]), m03 = _mm_set1_ps(m[3]);
+    const __m128 m10 = _mm_set1_ps(m[4]), m11 = _mm_set1_ps(m[5]), m12 = _mm_set1_ps(m[6]), m13 = _mm_set1_ps(m[7]);
+    const __m128 m20 = _mm_set1_ps(m[8]), m21 = _mm_set1_ps(m[9]), m22 = _mm_set1_ps(m[10]), m23 = _mm_set1_ps(m[11]);
+    const __m128 ax = _mm_set1_ps(camera.ax), ay = _mm_set1_ps(camera.ay);
+    const __m128 cx = _mm_set1_ps(camera.cx), cy = _mm_set1_ps(camera.cy);
+    const __m128 one = _mm_set1_ps(1.0F);
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&points.x[i]);
+        __m128 y = _mm_loadu_ps(&points.y[i]);
+        __m128 z = _mm_loadu_ps(&points.z[i]);
+        __m128 xe = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m01, y)), _mm_add_ps(_mm_mul_ps(m02, z), m03));
+        __m128 ye = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, x), _mm_mul_ps(m11, y)), _mm_add_ps(_mm_mul_ps(m12, z), m13));
+        __m128 ze = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, x), _mm_mul_ps(m21, y)), _mm_add_ps(_mm_mul_ps(m22, z), m23));
+        __m128 d = _mm_sub_ps(_mm_setzero_ps(), ze);
+        __m128 inv = _mm_div_ps(one, d);
+        _mm_storeu_ps(sx + i, _mm_add_ps(cx, _mm_mul_ps(ax, _mm_mul_ps(xe, inv))));
+        _mm_storeu_ps(sy + i, _mm_sub_ps(cy, _mm_mul_ps(ay, _mm_mul_ps(ye, inv))));
+        _mm_storeu_ps(depth + i, d);
+    }
+#endif
+    for (; i < end; i++)
+    {
+        float xe = m[0]*points.x[i] + m[1]*points.y[i] + m[2]*points.z[i] + m[3];
+        float ye = m[4]*points.x[i] + m[5]*points.y[i] + m[6]*points.z[i] + m[7];
+        float ze = m[8]*points.x[i] + m[9]*points.y[i] + m[10]*points.z[i] + m[11];
+        float d = -ze;
+        sx[i] = camera.cx + camera.ax*xe/d;
+        sy[i] = camera.cy - camera.ay*ye/d;
+        depth[i] = d;
+    }
+}
+
+
+// renders point clouds into a depth-tested framebuffer
+// each frame runs in three parallel passes: project and count points per screen tile, scatter them into per-tile bins, then rasterize each tile on its own thread
+class SplatRenderer
+{
+public:
+    SplatRenderer(int width, int height, int pointSize, int nthreads)
+        : _width(width), _height(height), _pointSize(pointSize), _nthreads(nthreads)
+    {
+        _tilesX = (width + _tileSize - 1)/_tileSize;
+        _tilesY = (height + _tileSize - 1)/_tileSize;
+        _depth.resize(static_cast<size_t>(width)*height);
+    }
+
+    void render(const PointArrays &points, const Camera &camera, cv::Mat &frame, double &projectMs, double &rasterMs)
+    {
+        TRACE_SCOPE("render_frame");
+        size_t npoints = points.x.size();
+        size_t nchunks = (npoints + _chunkSize - 1)/_chunkSize;
+        size_t ntiles = static_cast<size_t>(_tilesX)*_tilesY;
+        _sx.resize(npoints);
+        _sy.resize(npoints);
+        _sdepth.resize(npoints);
+        _counts.assign(nchunks*ntiles, 0);
+
+        // pass 1: project each chunk and count the splats that land in each tile
+        Stopwatch stopwatch;
+        parallelFor(nchunks, [&](size_t chunk_i)
+        {
+            TRACE_SCOPE("project_chunk");
+            size_t begin = chunk_i*_chunkSize;
+            size_t end = min(begin + _chunkSize, npoints);
+            projectPoints(points, camera, begin, end, &_sx[0], &_sy[0], &_sdepth[0]);
+            uint32_t *counts = &_counts[chunk_i*ntiles];
+            for (size_t point_i = begin; point_i < end; point_i++)
+            {
+                int tx0, ty0, tx1, ty1;
+                if (tileRange(point_i, camera, tx0, ty0, tx1, ty1))
+                {
+                    for (int ty = ty0; ty <= ty1; ty++)
+                    {
+                        for (int tx = tx0; tx <= tx1; tx++)
+                        {
+                            counts[ty*_tilesX + tx]++;
+                        }
+                    }
+                }
+            }
+        }, _nthreads);
+
+        // lay out the bins tile by tile, with each chunk's splats contiguous within a tile
+        _cursors.resize(nchunks*ntiles);
+        _tileStart.resize(ntiles + 1);
+        size_t offset = 0;
+        for (size_t tile_i = 0; tile_i < ntiles; tile_i++)
+        {
+            _tileStart[tile_i] = offset;
+            for (size_t chunk_i = 0; chunk_i < nchunks; chunk_i++)
+            {
+                _cursors[chunk_i*ntiles + tile_i] = offset;
+                offset += _counts[chunk_i*ntiles + tile_i];
+            }
+        }
+        _tileStart[ntiles] = offset;
+        _splats.resize(offset);
+
+        // pass 2: scatter the splats into their bins
+        parallelFor(nchunks, [&](size_t chunk_i)
+        {
+            TRACE_SCOPE("scatter_chunk");
+            size_t begin = chunk_i*_chunkSize;
+            size_t end = min(begin + _chunkSize, npoints);
+            size_t *cursors = &_cursors[chunk_i*ntiles];
+            for (size_t point_i = begin; point_i < end; point_i++)
+            {
+                int tx0, ty0, tx1, ty1;
+                if (tileRange(point_i, camera, tx0, ty0, tx1, ty1))
+                {
+                    Splat splat;
+                    splat.x = static_cast<int32_t>(floor(_sx[point_i])) - (_pointSize - 1)/2;
+                    splat.y = static_cast<int32_t>(floor(_sy[point_i])) - (_pointSize - 1)/2;
+                    splat.depth = _sdepth[point_i];
+                    splat.bgr = points.bgr[point_i];
+                    for (int ty = ty0; ty <= ty1; ty++)
+                    {
+                        for (int tx = tx0; tx <= tx1; tx++)
+                        {
+                            _splats[cursors[ty*_tilesX + tx]++] = splat;
+                        }
+                    }
+                }
+            }
+        }, _nthreads);
+        projectMs = stopwatch.elapsedMs();
+
+        // pass 3: rasterize each tile with a depth test; tiles own disjoint pixels, so no locking is needed
+        stopwatch.restart();
+        frame.create(_height, _width, CV_8UC3);
+        parallelFor(ntiles, [&](size_t tile_i)
+        {
+            TRACE_SCOPE("rasterize_tile");
+            int x0 = (tile_i % _tilesX)*_tileSize;
+            int y0 = (tile_i/_tilesX)*_tileSize;
+            int x1 = min(x0 + _tileSize, _width);
+            int y1 = min(y0 + _tileSize, _height);
+
+            // clear the tile to black at infinite depth
+            for (int y = y0; y < y1; y++)
+            {
+                fill(&_depth[static_cast<size_t>(y)*_width + x0], &_depth[static_cast<size_t>(y)*_width + x1], numeric_limits<float>::infinity());
+                memset(frame.ptr(y) + 3*x0, 0, 3*(x1 - x0));
+            }
+
+            for (size_t splat_i = _tileStart[tile_i]; splat_i < _tileStart[tile_i + 1]; splat_i++)
+            {
+                const Splat &splat = _splats[splat_i];
+                int sx0 = max(splat.x, x0), sx1 = min(splat.x + _pointSize, x1);
+                int sy0 = max(splat.y, y0), sy1 = min(splat.y + _pointSize, y1);
+                for (int y = sy0; y < sy1; y++)
+                {
+                    float *depth = &_depth[static_cast<size_t>(y)*_width];
+                    uchar *pixel = frame.ptr(y);
+                    for (int x = sx0; x < sx1; x++)
+                    {
+                        if (splat.depth < depth[x])
+                        {
+                            depth[x] = splat.depth;
+                            pixel[3*x + 0] = splat.bgr & 0xFF;
+                            pixel[3*x + 1] = (splat.bgr >> 8) & 0xFF;
+                            pixel[3*x + 2] = (splat.bgr >> 16) & 0xFF;
+                        }
+                    }
+                }
+            }
+        }, _nthreads);
+        rasterMs = stopwatch.elapsedMs();
+    }
+
+private:
+    // find the tiles covered by a projected point; false if the point is clipped
+    bool tileRange(size_t point_i, const Camera &camera, int &tx0, int &ty0, int &tx1, int &ty1) const
+    {
+        float depth = _sdepth[point_i];
+        if (!(depth > 0.0F && depth <= camera.farPlane))
+        {
+            return false;
+        }
+        float sx = _sx[point_i];
+        float sy = _sy[point_i];
+        if (!(sx > -_pointSize && sx < _width + _pointSize && sy > -_pointSize && sy < _height + _pointSize))
+        {
+            return false;
+        }
+        int x0 = static_cast<int>(floor(sx)) - (_pointSize - 1)/2;
+        int y0 = static_cast<int>(floor(sy)) - (_pointSize - 1)/2;
+        int x1 = min(x0 + _pointSize - 1, _width - 1);
+        int y1 = min(y0 + _pointSize - 1, _height - 1);
+        x0 = max(x0, 0);
+        y0 = max(y0, 0);
+        if (x0 > x1 || y0 > y1)
+        {
+            return false;
+        }
+        tx0 = x0/_tileSize;
+        ty0 = y0/_tileSize;
+        tx1 = x1/_tileSize;
+        ty1 = y1/_tileSize;
+        return true;
+    }
+
+    int _width;
+    int _height;
+    int _pointSize;
+    int _nthreads;
+    int _tilesX;
+    int _tilesY;
+    vector<float> _sx;
+    vector<float> _sy;
+    vector<float> _sdepth;
+    vector<uint32_t> _counts;   // per chunk, per tile
+    vector<size_t> _cursors;    // per chunk, per tile
+    vector<size_t> _tileStart;
+    vector<Splat> _splats;
+    vector<float> _depth;
+};
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cerr << "Usage: rasterize_point_cloud <points_file> <camera_path_file> [--size <width>x<height>] [--point-size <pixels>] [--threads <n>] [--output <png_prefix>]" << endl;
+        return 1;
+    }
+
+    // parse options
+    int width = 640;
+    int height = 480;
+    int pointSize = 1;
+    int nthreads = 0;
+    string outputPrefix = "snapshot_";
+    for (int arg_i = 3; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        if (arg == "--size" && arg_i + 1 < argc)
+        {
+            char x;
+            stringstream ss(argv[++arg_i]);
+            ss >> width >> x >> height;
+            if (!ss || x != 'x' || width <= 0 || height <= 0)
+            {
+                cerr << "error: --size expects <width>x<height>" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--point-size" && arg_i + 1 < argc)
+        {
+            pointSize = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--threads" && arg_i + 1 < argc)
+        {
+            nthreads = atoi(argv[++arg_i]);
+        }
+        else if (arg == "--output" && arg_i + 1 < argc)
+        {
+            outputPrefix = argv[++arg_i];
+        }
+        else
+        {
+            cerr << "error: unrecognized option \"" << arg << "\"" << endl;
+            return 1;
+        }
+    }
+
+    // load the points and convert them to structure-of-arrays form
+    Stopwatch stopwatch;
+    vector<Point> loaded;
+    {
+        TRACE_SCOPE("load_points");
+        if (!loadPointsFile(argv[1], loaded))
+        {
+            cerr << "error: problem loading points from \"" << argv[1] << "\"; exiting..." << endl;
+            return 1;
+        }
+    }
+    PointArrays points;
+    points.x.resize(loaded.size());
+    points.y.resize(loaded.size());
+    points.z.resize(loaded.size());
+    points.bgr.resize(loaded.size());
+    for (size_t point_i = 0; point_i < loaded.size(); point_i++)
+    {
+        points.x[point_i] = loaded[point_i].coords.x;
+        points.y[point_i] = loaded[point_i].coords.y;
+        points.z[point_i] = loaded[point_i].coords.z;
+        points.bgr[point_i] = loaded[point_i].color.b | (loaded[point_i].color.g << 8) | (loaded[point_i].color.r << 16);
+    }
+    vector<Point>().swap(loaded);
+    cerr << points.x.size() << " points loaded in " << stopwatch.elapsedMs() << " ms" << endl;
+
+    // load the camera poses
+    fstream pathIn(argv[2], fstream::in);
+    if (!pathIn)
+    {
+        cerr << "error: couldn't open file \"" << argv[2] << "\" for input; exiting..." << endl;
+        return 1;
+    }
+    vector<CameraKeyframe> keyframes;
+    if (!loadCameraPath(pathIn, keyframes))
+    {
+        cerr << "error: problem loading camera path from \"" << argv[2] << "\"; exiting..." << endl;
+        return 1;
+    }
+    vector<Coords3D> rotations, translations;
+    expandCameraPath(keyframes, rotations, translations);
+
+    // render and save a snapshot for each pose
+    SplatRenderer renderer(width, height, pointSize, nthreads);
+    cv::Mat frame;
+    vector<double> frameTimes;
+    cout.setf(ios_base::fixed);
+    cout.precision(3);
+    for (size_t frame_i = 0; frame_i < rotations.size(); frame_i++)
+    {
+        Camera camera = makeCamera(rotations[frame_i], translations[frame_i], width, height);
+        double projectMs, rasterMs;
+        renderer.render(points, camera, frame, projectMs, rasterMs);
+        frameTimes.push_back(projectMs + rasterMs);
+
+        stringstream filename;
+        filename << outputPrefix << setw(5) << setfill('0') << frame_i << ".png";
+        {
+            TRACE_SCOPE("encode_png");
+            cv::imwrite(filename.str(), frame);
+        }
+        cout << filename.str() << ": project/bin " << projectMs << " ms, rasterize " << rasterMs << " ms" << endl;
+    }
+
+    // report throughput
+    TimingSummary summary = summarizeTimings(frameTimes);
+    cout << "threads: " << (nthreads > 0 ? nthreads : defaultThreadCount()) << endl;
+    cout << "frame time (ms): min " << summary.min << ", mean " << summary.mean << ", p50 " << summary.p50
+         << ", p90 " << summary.p90 << ", p99 " << summary.p99 << ", max " << summary.max << endl;
+    cout.precision(0);
+    cout << "points per second: " << points.x.size()/(summary.mean*1e-3) << endl;
+
+    return 0;
+}
@@ -5,13 +5,27 @@
 #include <GL/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <vector>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <cstddef>
+#include <cstdlib>
 #include <iomanip>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include "point_cloud.hpp"
+#include "point_grid.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
 
 
 // for convenience
@@ -21,38 +35,17 @@ using namespace std;
 // prototypes
 void myInit(void);
 void drawDisplay(void);
+void renderScene(bool drawAxisLabels);
 void resizeDisplay(int width, int height);
 void mouseMotion(int mouseX, int mouseY);
 void mouseFunction(int button, int state, int mouseX, int mouseY);
-bool loadPoints(istream &is);
-
-
-// user defined types
-
-struct Coords3D {
-    double x;
-    double y;
-    double z;
-    Coords3D(void){}
-    Coords3D(double x, double y, double z): x(x), y(y), z(z){}
-};
-
-struct ColorRGB {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-    ColorRGB(void){}
-    ColorRGB(uint8_t r, uint8_t g, uint8_t b): r(r), g(g), b(b){}
-};
-
-struct Point
-{
-    Coords3D coords;
-    ColorRGB color;
-    Point(void){}
-    Point(const Coords3D &coords, const ColorRGB &color): coords(coords), color(color){}
-    Point(float x, float y, float z, int r, int g, int b): coords(x, y, z), color(r, g, b){}
-};
+void keyboardFunction(unsigned char key, int mouseX, int mouseY);
+bool startLoadingPoints(const char *filename);
+bool finishLoadingPoints(void);
+void stopLoadingPoints(void);
+void loadingTimer(int value);
+int runBenchmark(int argc, char *argv[]);
+bool initOffscreenContext(int width, int height);
 
 
 // globals
@@ -64,6 +57,13 @@ double _wheelTranslationIncrement = 10;
 double _pointSize = 1.0;
 bool   _drawCoordinateAxes = true;
 double _coordinateAxesLength = 50;
+int    _loadStrata = 64;          // number of file regions that are read round-robin
+int    _loadBatchLines = 1024;    // lines read from one region before moving on to the next
+int    _loadingRefreshMs = 100;   // redisplay interval while points are still arriving
+bool   _buildPickingIndex = true;
+double _pickRadiusPixels = 4.0;   // how far from the cursor a point may be and still be picked
+double _selectionRadius = 10.0;   // radius (in world units) of ctrl+click selections
+bool   _lighting = true;          // light the points with a headlight when the points file has normals ('l' toggles)
 
 // state for callbacks
 vector<Point> _points;
@@ -73,9 +73,36 @@ int _savedMouseX;
 int _savedMouseY;
 int _savedMouseButton;
 
+// state for background loading
+thread _loaderThread;
+atomic<size_t> _npointsLoaded(0);
+atomic<bool> _loadingDone(false);
+atomic<bool> _loadingCancelled(false);  // set at exit so the loader stops writing into _points before it is destroyed
+atomic<bool> _hasNormals(false);
+bool _loadingFailed = false;
+Stopwatch _startupStopwatch;
+bool _firstFrameReported = false;
+
+// state for picking and selection
+PointGrid _grid;
+bool _pointsReady = false;
+vector<long> _pickedPoints;       // the last two picked points, for measuring
+vector<uint32_t> _selection;
+
 
 int main(int argc, char *argv[])
 {
+    // the benchmark runs offscreen, so it must not touch GLUT (which requires a display)
+    if (argc > 1 && string(argv[1]) == "--benchmark")
+    {
+#ifdef HAVE_EGL
+        return runBenchmark(argc, argv);
+#else
+        cerr << "error: built without EGL, which the benchmark needs for offscreen rendering" << endl;
+        return 1;
+#endif
+    }
+
     // initialize GLUT
     glutInit(&argc, argv);
     myInit();
@@ -84,25 +111,19 @@ int main(int argc, char *argv[])
     if (argc != 2)
     {
         cerr << "Usage: render_point_cloud <points_file>" << endl;
+        cerr << "       render_point_cloud --benchmark <points_file> <camera_path_file> [--size <width>x<height>] [--dump <png_prefix>]" << endl;
         return 1;
     }
 
-    // try to load in the points from the points file
+    // start loading the points from the points file in the background; the display draws them as they arrive
     cout << "try to open file" << endl;
-    fstream fin(argv[1], fstream::in);
-    if (!fin)
+    if (!startLoadingPoints(argv[1]))
     {
         cerr << "error: couldn't open file \"" << argv[1] << "\" for input; exiting...";
         return 1;
     }
     cout << "file opened" << endl;
-    if (!loadPoints(fin))
-    {
-        cerr << "error: problem loading points from \"" << argv[1] << "\"; exiting...";
-        return 1;
-    }
-    fin.close();
-    cerr << _points.size() << " points successfully loaded" << endl;
+    glutTimerFunc(_loadingRefreshMs, loadingTimer, 0);
 
 //    // output some points for verification
 //    cout.setf(ios_base::fixed);
@@ -143,6 +164,7 @@ void myInit(void)
     glutReshapeFunc(resizeDisplay);
     glutMotionFunc(mouseMotion);
     glutMouseFunc(mouseFunction);
+    glutKeyboardFunc(keyboardFunction);
 
     // set background color to black
     glClearColor(0.0F, 0.0F, 0.0F, 0.0F);
@@ -151,10 +173,38 @@ void myInit(void)
 
 void drawDisplay(void)
 {
+    TRACE_SCOPE("draw_display");
+    renderScene(true);
+    glutSwapBuffers();
+
+    if (!_firstFrameReported)
+    {
+        cerr << "first frame drawn after " << _startupStopwatch.elapsedMs() << " ms with " << _npointsLoaded.load() << " points" << endl;
+        _firstFrameReported = true;
+    }
+}
+
+
+void renderScene(bool drawAxisLabels)
+{
+    TRACE_SCOPE("render_scene");
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // apply current translation and rotate
+    // note: the headlight is positioned before the modelview transform, so it stays at the eye
     glLoadIdentity();
+    bool lit = _lighting && _hasNormals.load(memory_order_acquire);
+    if (lit)
+    {
+        const GLfloat headlight[4] = {0.0F, 0.0F, 1.0F, 0.0F};
+        const GLfloat ambient[4] = {0.3F, 0.3F, 0.3F, 1.0F};
+        glLightfv(GL_LIGHT0, GL_POSITION, headlight);
+        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
+        glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+        glEnable(GL_COLOR_MATERIAL);
+        glEnable(GL_LIGHT0);
+        glEnable(GL_LIGHTING);
+    }
     glTranslatef(_translation.x, _translation.y, _translation.z);
     glRotatef( (int) _rotation.x, 1, 0, 0 );
     glRotatef( (int) _rotation.y, 0, 1, 0 );
@@ -170,13 +220,51 @@ void drawDisplay(void)
     // set vertex and color pointers
     glVertexPointer(3, GL_DOUBLE, sizeof(Point), _points.data());
     glColorPointer(3, GL_UNSIGNED_BYTE, sizeof(Point), reinterpret_cast<uint8_t *>(_points.data()) + sizeof(Coords3D));
+    if (lit)
+    {
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glNormalPointer(GL_FLOAT, sizeof(Point), reinterpret_cast<uint8_t *>(_points.data()) + offsetof(Point, normal));
+    }
 
     // draw point cloud
-    glDrawArrays(GL_POINTS, 0, _points.size());
+    // note: only the points published so far by the loader are drawn; the buffer itself never moves while loading
+    size_t npoints = _npointsLoaded.load(memory_order_acquire);
+    glDrawArrays(GL_POINTS, 0, npoints);
 
-    // disable vertex and color array client states
-    glDisableClientState(GL_VERTEX_ARRAY);
+    // highlight the current selection (yellow) and picked points (red)
+    if (lit)
+    {
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisable(GL_LIGHTING);
+    }
     glDisableClientState(GL_COLOR_ARRAY);
+    if (!_selection.empty())
+    {
+        glPointSize(_pointSize*3);
+        glColor3f(1.0F, 1.0F, 0.0F);
+        glDrawElements(GL_POINTS, _selection.size(), GL_UNSIGNED_INT, _selection.data());
+    }
+    if (!_pickedPoints.empty())
+    {
+        glPointSize(_pointSize*6);
+        glColor3f(1.0F, 0.0F, 0.0F);
+        glBegin(GL_POINTS);
+        for (size_t pick_i = 0; pick_i < _pickedPoints.size(); pick_i++)
+        {
+            glArrayElement(_pickedPoints[pick_i]);
+        }
+        glEnd();
+        if (_pickedPoints.size() == 2)
+        {
+            glBegin(GL_LINES);
+            glArrayElement(_pickedPoints[0]);
+            glArrayElement(_pickedPoints[1]);
+            glEnd();
+        }
+    }
+
+    // disable vertex array client state
+    glDisableClientState(GL_VERTEX_ARRAY);
 
     // draw coordinate axes
     if (_drawCoordinateAxes)
@@ -185,12 +273,16 @@ void drawDisplay(void)
         glColor4f(0.0F, 1.0F, 0.0F, 0.0F);
 
         // draw axis labels
-        glRasterPos3f(_coordinateAxesLength, 0.0F, 0.0F);
-        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, 'X');
-        glRasterPos3f(0.0F, _coordinateAxesLength, 0.0F);
-        glutBitmapCharacter( GLUT_BITMAP_8_BY_13, 'Y');
-        glRasterPos3f(0.0F, 0.0F, _coordinateAxesLength);
-        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, 'Z');
+        // note: GLUT fonts are unavailable without a GLUT window, so offscreen rendering skips the labels
+        if (drawAxisLabels)
+        {
+            glRasterPos3f(_coordinateAxesLength, 0.0F, 0.0F);
+            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, 'X');
+            glRasterPos3f(0.0F, _coordinateAxesLength, 0.0F);
+            glutBitmapCharacter( GLUT_BITMAP_8_BY_13, 'Y');
+            glRasterPos3f(0.0F, 0.0F, _coordinateAxesLength);
+            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, 'Z');
+        }
 
         // draw axes
         glBegin(GL_LINES);
@@ -206,8 +298,6 @@ void drawDisplay(void)
         glVertex3i(0, 0, _coordinateAxesLength);
         glEnd();
     }
-
-    glutSwapBuffers();
 }
 
 
@@ -249,11 +339,101 @@ void mouseMotion(int mouseX, int mouseY)
 }
 
 
+// cast a ray from the eye through the given window pixel and return the index of the first point it hits, or -1
+long pickPoint(int mouseX, int mouseY)
+{
+    // recover the eye ray in world coordinates from the modelview matrix of the last frame (a rigid transform, so its inverse is its transpose)
+    GLdouble m[16];
+    glGetDoublev(GL_MODELVIEW_MATRIX, m);
+    int width = glutGet(GLUT_WINDOW_WIDTH);
+    int height = glutGet(GLUT_WINDOW_HEIGHT);
+    double tanHalfFovy = tan(30.0*M_PI/180.0); // matches gluPerspective in resizeDisplay
+    double eye[3] = {
+        (2.0*(mouseX + 0.5)/width - 1.0)*tanHalfFovy*width/height,
+        (1.0 - 2.0*(mouseY + 0.5)/height)*tanHalfFovy,
+        -1.0
+    };
+    double eyeLength = sqrt(eye[0]*eye[0] + eye[1]*eye[1] + eye[2]*eye[2]);
+    double origin[3], direction[3];
+    for (int i = 0; i < 3; i++)
+    {
+        origin[i] = -(m[i*4 + 0]*m[12] + m[i*4 + 1]*m[13] + m[i*4 + 2]*m[14]);
+        direction[i] = (m[i*4 + 0]*eye[0] + m[i*4 + 1]*eye[1] + m[i*4 + 2]*eye[2])/eyeLength;
+    }
+
+    // the pick tolerance is a cone that covers _pickRadiusPixels at any depth
+    double slope = _pickRadiusPixels*2.0*tanHalfFovy/height;
+    TRACE_SCOPE("pick_point");
+    Stopwatch stopwatch;
+    long point_i = _grid.pickRay(origin, direction, 0.0, slope);
+    cout << "pick query: " << stopwatch.elapsedMs() << " ms" << endl;
+    return point_i;
+}
+
+
+// print a point in the coordinates of the points file (z is negated on load)
+void printPoint(long point_i)
+{
+    const Coords3D &c = _points[point_i].coords;
+    double range = sqrt(c.x*c.x + c.y*c.y + c.z*c.z);
+    cout << "point " << point_i << ": xyz = (" << c.x << ", " << c.y << ", " << -c.z << "), distance from origin = " << range << endl;
+}
+
+
+double pointDistance(long a, long b)
+{
+    const Coords3D &p = _points[a].coords;
+    const Coords3D &q = _points[b].coords;
+    return sqrt((p.x - q.x)*(p.x - q.x) + (p.y - q.y)*(p.y - q.y) + (p.z - q.z)*(p.z - q.z));
+}
+
+
 void mouseFunction(int button, int state, int mouseX, int mouseY)
 {
     if (state == GLUT_DOWN)
     {
-        if (button == GLUT_LEFT_BUTTON || button == GLUT_MIDDLE_BUTTON || button == GLUT_RIGHT_BUTTON)
+        int modifiers = glutGetModifiers();
+        if (button == GLUT_LEFT_BUTTON && (modifiers & (GLUT_ACTIVE_SHIFT | GLUT_ACTIVE_CTRL)))
+        {
+            // shift+click picks a point (and measures to the previous pick); ctrl+click selects the points around it
+            _savedMouseButton = -1;
+            if (!_pointsReady)
+            {
+                cout << "picking is available once loading has finished" << endl;
+                return;
+            }
+            long point_i = pickPoint(mouseX, mouseY);
+            if (point_i < 0)
+            {
+                cout << "no point under the cursor" << endl;
+                return;
+            }
+            printPoint(point_i);
+            if (modifiers & GLUT_ACTIVE_SHIFT)
+            {
+                if (_pickedPoints.size() == 2)
+                {
+                    _pickedPoints.erase(_pickedPoints.begin());
+                }
+                _pickedPoints.push_back(point_i);
+                if (_pickedPoints.size() == 2)
+                {
+                    cout << "distance between picked points = " << pointDistance(_pickedPoints[0], _pickedPoints[1]) << endl;
+                }
+            }
+            else
+            {
+                const Coords3D &c = _points[point_i].coords;
+                double center[3] = {c.x, c.y, c.z};
+                TRACE_SCOPE("radius_select");
+                Stopwatch stopwatch;
+                _selection.clear();
+                _grid.radiusQuery(center, _selectionRadius, _selection);
+                cout << _selection.size() << " points within " << _selectionRadius << " selected (" << stopwatch.elapsedMs() << " ms)" << endl;
+            }
+            glutPostRedisplay();
+        }
+        else if (button == GLUT_LEFT_BUTTON || button == GLUT_MIDDLE_BUTTON || button == GLUT_RIGHT_BUTTON)
         {
             _savedMouseButton = button;
             _savedMouseX = mouseX;
@@ -273,70 +453,416 @@ void mouseFunction(int button, int state, int mouseX, int mouseY)
 }
 
 
-bool loadPoints(istream &is)
+void keyboardFunction(unsigned char key, int mouseX, int mouseY)
 {
-    string line;
-    float x, y, z;
-    int r, g, b;
-    int npoints = 0;
+    if (key == '+' || key == '=')
+    {
+        _selectionRadius *= 1.25;
+        cout << "selection radius = " << _selectionRadius << endl;
+    }
+    else if (key == '-')
+    {
+        _selectionRadius /= 1.25;
+        cout << "selection radius = " << _selectionRadius << endl;
+    }
+    else if (key == 'c')
+    {
+        _selection.clear();
+        _pickedPoints.clear();
+        glutPostRedisplay();
+    }
+    else if (key == 'l')
+    {
+        _lighting = !_lighting;
+        cout << "lighting " << (_lighting ? "on" : "off") << (_hasNormals.load() ? "" : " (the points have no normals)") << endl;
+        glutPostRedisplay();
+    }
+}
 
-    // first pass: verify data and count points
 
-    // read a line from standard input
-    getline(is, line);
+// loader thread body
+// the file is split into strata that are read round-robin a batch at a time, so that the points published early on are a representative subsample of the whole cloud rather than its first rows
+void loadPointsStratified(string filename, streamoff fileSize)
+{
+    trace::setThreadName("loader");
+    TRACE_SCOPE("load_points");
+    ifstream fin(filename.c_str(), ios::in | ios::binary);
+    string line;
 
-    // while a line was successfully read in
-    while (is)
+    // find the first line start at or after each stratum's nominal offset
+    vector<streamoff> stratumStart(_loadStrata + 1);
+    stratumStart[0] = 0;
+    for (int stratum_i = 1; stratum_i < _loadStrata; stratum_i++)
+    {
+        streamoff nominal = fileSize*stratum_i/_loadStrata;
+        fin.clear();
+        fin.seekg(nominal - 1);
+        getline(fin, line);
+        stratumStart[stratum_i] = fin ? static_cast<streamoff>(fin.tellg()) : fileSize;
+        stratumStart[stratum_i] = max(stratumStart[stratum_i], stratumStart[stratum_i - 1]);
+    }
+    stratumStart[_loadStrata] = fileSize;
+    vector<streamoff> position(stratumStart.begin(), stratumStart.end() - 1);
+
+    size_t npoints = 0;
+    bool failed = false;
+    bool remaining = true;
+    bool hasNormals = false;
+    bool cancelled = false;
+    while (remaining && !failed && !cancelled)
     {
-        // we have line; try to read the data for a point
-        stringstream ss(line);
-        ss >> x >> y >> z >> r >> g >> b;
-        if (!ss)
+        remaining = false;
+        for (int stratum_i = 0; stratum_i < _loadStrata && !failed; stratum_i++)
         {
-            // line is incomplete; assume that we are done
-            break;
+            streamoff stratumEnd = stratumStart[stratum_i + 1];
+            if (position[stratum_i] >= stratumEnd)
+            {
+                continue;
+            }
+
+            fin.clear();
+            fin.seekg(position[stratum_i]);
+            for (int line_i = 0; line_i < _loadBatchLines && position[stratum_i] < stratumEnd; line_i++)
+            {
+                if (!getline(fin, line))
+                {
+                    position[stratum_i] = stratumEnd;
+                    break;
+                }
+                position[stratum_i] += line.size() + 1;
+
+                Point point;
+                int status = parsePointLine(line.c_str(), point);
+                if (status < 0)
+                {
+                    failed = true;
+                    break;
+                }
+                if (status > 0)
+                {
+                    if (!hasNormals && (point.normal[0] != 0.0F || point.normal[1] != 0.0F || point.normal[2] != 0.0F))
+                    {
+                        hasNormals = true;
+                        _hasNormals.store(true, memory_order_release);
+                    }
+                    _points[npoints++] = point;
+                }
+            }
+            remaining = remaining || position[stratum_i] < stratumEnd;
+
+            // publish the batch to the display callback
+            _npointsLoaded.store(npoints, memory_order_release);
+            if (_loadingCancelled.load(memory_order_acquire))
+            {
+                cancelled = true;
+                break;
+            }
         }
+    }
+
+    // index the points for picking
+    if (_buildPickingIndex && !failed && !cancelled)
+    {
+        TRACE_SCOPE("build_picking_index");
+        Stopwatch stopwatch;
+        _grid.build(&_points[0].coords.x, npoints, sizeof(Point));
+        cerr << "picking index built in " << stopwatch.elapsedMs() << " ms (" << _grid.cellCount() << " cells)" << endl;
+    }
+
+    _loadingFailed = failed;
+    _loadingDone.store(true, memory_order_release);
+}
+
+
+bool startLoadingPoints(const char *filename)
+{
+    ifstream fin(filename, ios::in | ios::binary | ios::ate);
+    if (!fin)
+    {
+        return false;
+    }
+    streamoff fileSize = fin.tellg();
+    fin.close();
 
-        // we have a complete set of data; verify data integrity
-        if (!isfinite(x) || !isfinite(y) || !isfinite(x))
+    // size the buffer for the most points the file could hold (the shortest line is "0 0 0 0 0 0\n"), so that it never moves while the display callback draws from it
+    // note: Point's constructor does not touch memory, so untouched pages of the buffer cost address space rather than RAM
+    _points.resize(fileSize/12 + 1);
+
+    _npointsLoaded.store(0);
+    _loadingDone.store(false);
+    _hasNormals.store(false);
+    _loadingCancelled.store(false);
+    _loaderThread = thread(loadPointsStratified, string(filename), fileSize);
+
+    // GLUT exits the process when the window is closed, possibly mid-load; the handler must be registered after the globals are constructed so that it runs before they are destroyed
+    static bool exitHandlerRegistered = false;
+    if (!exitHandlerRegistered)
+    {
+        atexit(stopLoadingPoints);
+        exitHandlerRegistered = true;
+    }
+    return true;
+}
+
+
+// wait for the loader to finish and trim the buffer to the points actually loaded
+bool finishLoadingPoints(void)
+{
+    _loaderThread.join();
+    _points.resize(_npointsLoaded.load());
+    return !_loadingFailed;
+}
+
+
+// exit handler: cancel a load still in progress and wait for the loader, so that no joinable thread is destroyed and no points are written into a destroyed buffer
+void stopLoadingPoints(void)
+{
+    _loadingCancelled.store(true, memory_order_release);
+    if (_loaderThread.joinable())
+    {
+        _loaderThread.join();
+    }
+}
+
+
+void loadingTimer(int value)
+{
+    if (_loadingDone.load(memory_order_acquire))
+    {
+        if (finishLoadingPoints())
         {
-            cerr << "error: x, y, or z not finite on line " << npoints + 1 << endl;
-            return false;
+            cerr << _points.size() << " points successfully loaded" << endl;
+            _pointsReady = true;
         }
-        if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+        else
         {
-            cerr << "error: r, b, or g not within [0, 255]" << endl;
-            return false;
+            cerr << "error: problem loading points; displaying the " << _points.size() << " points loaded before the error" << endl;
         }
+    }
+    else
+    {
+        glutTimerFunc(_loadingRefreshMs, loadingTimer, value);
+    }
+    glutPostRedisplay();
+}
 
-        // we have a valid point; count it
-        npoints++;
 
-        // read a line from standard input
-        getline(is, line);
+// the offscreen benchmark, built only where EGL is available
+#ifdef HAVE_EGL
+
+// try the default display first; on machines without a window system, fall back to the first EGL device
+EGLDisplay getOffscreenDisplay(void)
+{
+    EGLint major, minor;
+
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, &major, &minor))
+    {
+        return display;
+    }
+
+    PFNEGLQUERYDEVICESEXTPROC queryDevices = reinterpret_cast<PFNEGLQUERYDEVICESEXTPROC>(eglGetProcAddress("eglQueryDevicesEXT"));
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (queryDevices == NULL || getPlatformDisplay == NULL)
+    {
+        return EGL_NO_DISPLAY;
+    }
+
+    EGLDeviceEXT devices[16];
+    EGLint ndevices = 0;
+    if (!queryDevices(16, devices, &ndevices))
+    {
+        return EGL_NO_DISPLAY;
+    }
+    for (EGLint device_i = 0; device_i < ndevices; device_i++)
+    {
+        display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[device_i], NULL);
+        if (display != EGL_NO_DISPLAY && eglInitialize(display, &major, &minor))
+        {
+            return display;
+        }
     }
 
-    // allocate space for points
-    _points.resize(npoints);
+    return EGL_NO_DISPLAY;
+}
+
 
-    // reset the stream
-    is.clear();
-    is.seekg(0);
+bool initOffscreenContext(int width, int height)
+{
+    EGLDisplay display = getOffscreenDisplay();
+    if (display == EGL_NO_DISPLAY)
+    {
+        cerr << "error: couldn't initialize an EGL display" << endl;
+        return false;
+    }
 
-    // second pass: read in the points
-    for (int point_i = 0; point_i < npoints; point_i++)
+    // request the same buffers as the GLUT window: RGB color plus depth
+    const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint nconfigs = 0;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &nconfigs) || nconfigs < 1)
     {
-        // read a line from the input stream
-        getline(is, line);
+        cerr << "error: no EGL config supports an OpenGL pbuffer" << endl;
+        return false;
+    }
 
-        // read the data for a point
-        stringstream ss(line);
-        ss >> x >> y >> z >> r >> g >> b;
+    const EGLint pbufferAttributes[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+    EGLSurface surface = eglCreatePbufferSurface(display, config, pbufferAttributes);
+    if (surface == EGL_NO_SURFACE)
+    {
+        cerr << "error: couldn't create a " << width << "x" << height << " EGL pbuffer" << endl;
+        return false;
+    }
 
-        // assign the point
-        _points[point_i] = Point(x, y, -z, r, g, b);
+    // note: the renderer uses fixed-function desktop GL, so bind the OpenGL (not OpenGL ES) API
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context))
+    {
+        cerr << "error: couldn't create an OpenGL context for the EGL pbuffer" << endl;
+        return false;
     }
 
-    // report success
     return true;
 }
+
+
+int runBenchmark(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        cerr << "Usage: render_point_cloud --benchmark <points_file> <camera_path_file> [--size <width>x<height>] [--dump <png_prefix>]" << endl;
+        return 1;
+    }
+
+    // parse options
+    int width = 640;
+    int height = 480;
+    string dumpPrefix;
+    for (int arg_i = 4; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        if (arg == "--size" && arg_i + 1 < argc)
+        {
+            char x;
+            stringstream ss(argv[++arg_i]);
+            ss >> width >> x >> height;
+            if (!ss || x != 'x' || width <= 0 || height <= 0)
+            {
+                cerr << "error: --size expects <width>x<height>" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--dump" && arg_i + 1 < argc)
+        {
+            dumpPrefix = argv[++arg_i];
+        }
+        else
+        {
+            cerr << "error: unrecognized benchmark option \"" << arg << "\"" << endl;
+            return 1;
+        }
+    }
+
+    // load the points; the benchmark needs the whole cloud, so wait for the loader to finish
+    _buildPickingIndex = false;
+    if (!startLoadingPoints(argv[2]))
+    {
+        cerr << "error: couldn't open file \"" << argv[2] << "\" for input; exiting..." << endl;
+        return 1;
+    }
+    if (!finishLoadingPoints())
+    {
+        cerr << "error: problem loading points from \"" << argv[2] << "\"; exiting..." << endl;
+        return 1;
+    }
+    cerr << _points.size() << " points successfully loaded" << endl;
+
+    // load the camera path
+    fstream pathIn(argv[3], fstream::in);
+    if (!pathIn)
+    {
+        cerr << "error: couldn't open file \"" << argv[3] << "\" for input; exiting..." << endl;
+        return 1;
+    }
+    vector<CameraKeyframe> keyframes;
+    if (!loadCameraPath(pathIn, keyframes))
+    {
+        cerr << "error: problem loading camera path from \"" << argv[3] << "\"; exiting..." << endl;
+        return 1;
+    }
+    vector<Coords3D> rotations, translations;
+    expandCameraPath(keyframes, rotations, translations);
+
+    // set up the offscreen context with the same GL state as the interactive window
+    if (!initOffscreenContext(width, height))
+    {
+        return 1;
+    }
+    glClearColor(0.0F, 0.0F, 0.0F, 0.0F);
+    resizeDisplay(width, height);
+    cerr << "renderer: " << glGetString(GL_RENDERER) << endl;
+
+    // warm up once so that driver-side setup is not charged to the first frame
+    _rotation = rotations[0];
+    _translation = translations[0];
+    renderScene(false);
+    glFinish();
+
+    // replay the camera path
+    vector<double> frameTimes;
+    cv::Mat frame(height, width, CV_8UC3);
+    for (size_t frame_i = 0; frame_i < rotations.size(); frame_i++)
+    {
+        _rotation = rotations[frame_i];
+        _translation = translations[frame_i];
+
+        // note: glFinish is required so that the timer covers the GPU work, not just command submission
+        Stopwatch stopwatch;
+        {
+            TRACE_SCOPE("benchmark_frame");
+            renderScene(false);
+            glFinish();
+        }
+        frameTimes.push_back(stopwatch.elapsedMs());
+
+        if (!dumpPrefix.empty())
+        {
+            TRACE_SCOPE("dump_frame");
+            glPixelStorei(GL_PACK_ALIGNMENT, 1);
+            glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, frame.data);
+            cv::Mat flipped;
+            cv::flip(frame, flipped, 0); // GL rows run bottom-up
+            stringstream filename;
+            filename << dumpPrefix << setw(5) << setfill('0') << frame_i << ".png";
+            cv::imwrite(filename.str(), flipped);
+        }
+    }
+
+    // report per-frame render time percentiles and throughput
+    TimingSummary summary = summarizeTimings(frameTimes);
+    cout.setf(ios_base::fixed);
+    cout.precision(3);
+    cout << "frames: " << summary.count << endl;
+    cout << "points per frame: " << _points.size() << endl;
+    cout << "frame time (ms): min " << summary.min << ", mean " << summary.mean << ", p50 " << summary.p50
+         << ", p90 " << summary.p90 << ", p99 " << summary.p99 << ", max " << summary.max << endl;
+    cout.precision(0);
+    cout << "points per second: " << _points.size()/(summary.mean*1e-3) << endl;
+
+    return 0;
+}
+
+#endif
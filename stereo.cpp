@@ -0,0 +1,1545 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#include "stereo.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include <opencv2/imgproc.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+
+bool loadCameraData(const string &filename, CameraData &camera)
+{
+    TRACE_SCOPE("load_camera_data");
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        return false;
+    }
+    fs["camera_matrix"] >> camera.cameraMatrix;
+    fs["distortion_coefficients"] >> camera.distortionCoefficients;
+    fs.release();
+    return true;
+}
+
+
+void computeRectification(const CameraData &camera, Size imageSize, double baseline, StereoRectification &rectification)
+{
+    TRACE_SCOPE("compute_rectification");
+    rectification.imageSize = imageSize;
+
+    // note: I assume that R and t in stereoRectify are the rotation matrix and translation vector, respectively, that convert a coordinate in the first (left) position camera coordinates to a coordinate in the second (right) position camera coordinates.  In other words, I assume that R and t represent this relationship: x2 = Rx1 + t.
+
+    // estimated rotation matrix
+    // note: this should be the Identity matrix since I made an effort not to rotate the second camera position w.r.t the first; that is, each of the coordinate axes of the second camera position are (roughly) parallel to those of the first camera position.
+    rectification.R = Mat::eye(3, 3, CV_64F);
+
+    // estimated tranlation vector
+    // note: assuming that x2 = Rx1 + t is the correct relationship for R and t, the origin of the first camera position w.r.t. the second should be along the second camera's x-axis in the negative direction.
+    rectification.T = Mat::zeros(3, 1, CV_64F);
+    rectification.T.at<double>(0) = -baseline;
+
+    stereoRectify(camera.cameraMatrix, camera.distortionCoefficients, camera.cameraMatrix, camera.distortionCoefficients, imageSize,
+                  rectification.R, rectification.T, rectification.R1, rectification.R2, rectification.P1, rectification.P2, rectification.Q,
+                  CALIB_ZERO_DISPARITY, 0, imageSize, &rectification.leftValidROI, &rectification.rightValidROI);
+    rectification.validROI = rectification.leftValidROI & rectification.rightValidROI;
+    if (rectification.validROI.area() == 0)
+    {
+        rectification.validROI = Rect(Point(0, 0), imageSize);
+    }
+
+    // determine rectification maps from rectification transforms
+    initUndistortRectifyMap(camera.cameraMatrix, camera.distortionCoefficients, rectification.R1, rectification.P1, imageSize, CV_32FC1,
+                            rectification.leftXMap, rectification.leftYMap);
+    initUndistortRectifyMap(camera.cameraMatrix, camera.distortionCoefficients, rectification.R2, rectification.P2, imageSize, CV_32FC1,
+                            rectification.rightXMap, rectification.rightYMap);
+}
+
+
+void rectifyPair(const StereoRectification &rectification, const Mat &left, const Mat &right, Mat &leftRectified, Mat &rightRectified,
+                 bool cropToValid)
+{
+    TRACE_SCOPE("rectify_remap");
+    if (cropToValid)
+    {
+        // note: the maps give the source pixel of each output pixel, so remapping through the valid region of the maps
+        // produces the cropped images directly and skips the border entirely
+        const Rect &roi = rectification.validROI;
+        remap(left, leftRectified, rectification.leftXMap(roi), rectification.leftYMap(roi), INTER_LINEAR);
+        remap(right, rightRectified, rectification.rightXMap(roi), rectification.rightYMap(roi), INTER_LINEAR);
+        return;
+    }
+    remap(left, leftRectified, rectification.leftXMap, rectification.leftYMap, INTER_LINEAR);
+    remap(right, rightRectified, rectification.rightXMap, rectification.rightYMap, INTER_LINEAR);
+}
+
+
+bool saveRectification(const string &filename, const StereoRectification &rectification)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        return false;
+    }
+    fs << "image_Size" << rectification.imageSize;
+    fs << "valid_ROI" << rectification.validROI;
+    fs << "left_valid_ROI" << rectification.leftValidROI;
+    fs << "right_valid_ROI" << rectification.rightValidROI;
+    fs << "R1" << rectification.R1;
+    fs << "R2" << rectification.R2;
+    fs << "P1" << rectification.P1;
+    fs << "P2" << rectification.P2;
+    fs << "Q" << rectification.Q;
+    return true;
+}
+
+
+bool loadValidROI(const string &filename, Size &imageSize, Rect &validROI)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened() || fs["valid_ROI"].empty())
+    {
+        return false;
+    }
+    fs["image_Size"] >> imageSize;
+    fs["valid_ROI"] >> validROI;
+    return validROI.area() > 0;
+}
+
+
+void computeTextureMask(const Mat &gray, int blockSize, double threshold, Mat &blockMask)
+{
+    TRACE_SCOPE("texture_mask");
+    CV_Assert(gray.type() == CV_8UC1 && blockSize > 0);
+
+    // note: |dx| saturates at 255, which only matters far above any useful threshold
+    Mat dx, absDx, sums;
+    Sobel(gray, dx, CV_16S, 1, 0, 3);
+    convertScaleAbs(dx, absDx);
+    integral(absDx, sums, CV_32S);
+
+    int blockRows = (gray.rows + blockSize - 1)/blockSize;
+    int blockCols = (gray.cols + blockSize - 1)/blockSize;
+    blockMask.create(blockRows, blockCols, CV_8UC1);
+    for (int blockRow_i = 0; blockRow_i < blockRows; blockRow_i++)
+    {
+        int y0 = blockRow_i*blockSize;
+        int y1 = min(gray.rows, y0 + blockSize);
+        const int *top = sums.ptr<int>(y0);
+        const int *bottom = sums.ptr<int>(y1);
+        uchar *mask_p = blockMask.ptr<uchar>(blockRow_i);
+        for (int blockCol_i = 0; blockCol_i < blockCols; blockCol_i++)
+        {
+            int x0 = blockCol_i*blockSize;
+            int x1 = min(gray.cols, x0 + blockSize);
+            int sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+            mask_p[blockCol_i] = sum >= threshold*(x1 - x0)*(y1 - y0) ? 255 : 0;
+        }
+    }
+}
+
+
+DisparityMatcher::DisparityMatcher(int ndisparities, int SADWindowSize):
+    _ndisparities(ndisparities),
+    _SADWindowSize(SADWindowSize),
+    _textureThreshold(0.0),
+    _textureBlockSize(16),
+    _textureBandBlocks(8),
+    _textureFullFraction(0.8),
+    _skippedFraction(0.0),
+    _windowFraction(1.0),
+    _sbm(StereoBM::create(ndisparities, SADWindowSize))
+{
+}
+
+
+void DisparityMatcher::setTextureThreshold(double threshold, int blockSize)
+{
+    _textureThreshold = threshold;
+    _textureBlockSize = blockSize;
+}
+
+
+void DisparityMatcher::compute(const Mat &left, const Mat &right, Mat &disparity8U, double *minVal, double *maxVal)
+{
+    TRACE_SCOPE("disparity");
+
+    // StereoBM only accepts grayscale images
+    const Mat *leftGray = &left;
+    const Mat *rightGray = &right;
+    if (left.channels() != 1 || right.channels() != 1)
+    {
+        TRACE_SCOPE("convert_to_gray");
+        if (left.channels() != 1)
+        {
+            cvtColor(left, _leftGray, COLOR_BGR2GRAY);
+            leftGray = &_leftGray;
+        }
+        if (right.channels() != 1)
+        {
+            cvtColor(right, _rightGray, COLOR_BGR2GRAY);
+            rightGray = &_rightGray;
+        }
+    }
+
+    if (_textureThreshold > 0.0)
+    {
+        computeTextured(*leftGray, *rightGray);
+    }
+    else
+    {
+        TRACE_SCOPE("stereo_bm_compute");
+        _sbm->compute(*leftGray, *rightGray, _disparity16S);
+        _skippedFraction = 0.0;
+        _windowFraction = 1.0;
+    }
+
+    // scale to the full 8 bit range
+    TRACE_SCOPE("normalize_disparity");
+    double minDisparity, maxDisparity;
+    minMaxLoc(_disparity16S, &minDisparity, &maxDisparity);
+    _disparity16S.convertTo(disparity8U, CV_8UC1, 255/(maxDisparity - minDisparity));
+
+    if (minVal)
+    {
+        *minVal = minDisparity;
+    }
+    if (maxVal)
+    {
+        *maxVal = maxDisparity;
+    }
+}
+
+
+// runs of set elements of mask_p[0, n), merging runs separated by at most mergeGap clear elements; each run is a
+// [first, last] pair
+static void textureRuns(const uchar *mask_p, int n, int mergeGap, vector<pair<int, int> > &runs)
+{
+    runs.clear();
+    int col_i = 0;
+    while (col_i < n)
+    {
+        if (!mask_p[col_i])
+        {
+            col_i++;
+            continue;
+        }
+        int first = col_i;
+        int last = col_i;
+        for (int next_i = col_i + 1; next_i < n && next_i - last <= mergeGap; next_i++)
+        {
+            if (mask_p[next_i])
+            {
+                last = next_i;
+            }
+        }
+        runs.push_back(make_pair(first, last));
+        col_i = last + 1;
+    }
+}
+
+
+// StereoBM over the textured blocks only
+// note: along each block row, runs of textured blocks closer than the search range are merged, since matching a run
+// re-reads ndisparities columns to its left anyway. block rows are matched in bands of up to _textureBandBlocks: each
+// run of the band's combined mask is matched once, inside a window grown by the matching window and prefilter margins
+// (and the search range to the left), and the block row runs inside it are copied out. so inside every run the result
+// is what matching the whole image gives, while the margins are paid once per band rather than once per block row
+// note: where texture is spread across the image the windows add up to about the whole image anyway; past
+// _textureFullFraction of it, the image is matched in one call instead, which keeps StereoBM's own row parallelism
+// and is never slower than the full search
+void DisparityMatcher::computeTextured(const Mat &leftGray, const Mat &rightGray)
+{
+    TRACE_SCOPE("stereo_bm_textured");
+    int blockSize = _textureBlockSize;
+    computeTextureMask(leftGray, blockSize, _textureThreshold, _blockMask);
+
+    // skipped pixels get StereoBM's own invalid value, (minDisparity - 1)*16
+    _disparity16S.create(leftGray.size(), CV_16SC1);
+    _disparity16S.setTo(Scalar(-16));
+
+    // plan the band windows: [first, last] block columns and [top, bottom) block rows of each band run
+    struct BandRun
+    {
+        int first, last, top, bottom;
+        Rect window;
+    };
+    int margin = _SADWindowSize/2 + 5;
+    int mergeGap = (_ndisparities + 2*margin)/blockSize + 1;
+    Rect image(0, 0, leftGray.cols, leftGray.rows);
+    vector<BandRun> bandRuns;
+    double windowArea = 0.0;
+    vector<uchar> bandMask(_blockMask.cols);
+    vector<pair<int, int> > runs;
+    for (int bandRow_i = 0; bandRow_i < _blockMask.rows; bandRow_i += _textureBandBlocks)
+    {
+        int bandEnd = std::min(bandRow_i + _textureBandBlocks, _blockMask.rows);
+        std::fill(bandMask.begin(), bandMask.end(), 0);
+        for (int blockRow_i = bandRow_i; blockRow_i < bandEnd; blockRow_i++)
+        {
+            const uchar *mask_p = _blockMask.ptr<uchar>(blockRow_i);
+            for (int blockCol_i = 0; blockCol_i < _blockMask.cols; blockCol_i++)
+            {
+                bandMask[blockCol_i] |= mask_p[blockCol_i];
+            }
+        }
+        textureRuns(&bandMask[0], _blockMask.cols, mergeGap, runs);
+        for (size_t run_i = 0; run_i < runs.size(); run_i++)
+        {
+            // only the block rows with texture in this run's columns
+            BandRun bandRun;
+            bandRun.first = runs[run_i].first;
+            bandRun.last = runs[run_i].second;
+            bandRun.top = bandEnd;
+            bandRun.bottom = bandRow_i;
+            for (int blockRow_i = bandRow_i; blockRow_i < bandEnd; blockRow_i++)
+            {
+                const uchar *mask_p = _blockMask.ptr<uchar>(blockRow_i);
+                if (std::find(mask_p + bandRun.first, mask_p + bandRun.last + 1, 255) != mask_p + bandRun.last + 1)
+                {
+                    bandRun.top = std::min(bandRun.top, blockRow_i);
+                    bandRun.bottom = blockRow_i + 1;
+                }
+            }
+            Rect run = Rect(bandRun.first*blockSize, bandRun.top*blockSize, (bandRun.last + 1 - bandRun.first)*blockSize,
+                            (bandRun.bottom - bandRun.top)*blockSize) & image;
+            bandRun.window = Rect(Point(run.x - _ndisparities - margin, run.y - margin), Point(run.br().x + margin, run.br().y + margin)) & image;
+            windowArea += bandRun.window.area();
+            bandRuns.push_back(bandRun);
+        }
+    }
+    bool matchWhole = windowArea >= _textureFullFraction*image.area();
+    if (matchWhole)
+    {
+        TRACE_SCOPE("stereo_bm_compute");
+        _sbm->compute(leftGray, rightGray, _windowDisparity);
+    }
+
+    // match each window (or take the whole image's result), and copy out the runs of each block row in it, as matching
+    // that block row alone would have found them
+    size_t matched = 0;
+    for (size_t bandRun_i = 0; bandRun_i < bandRuns.size(); bandRun_i++)
+    {
+        const BandRun &bandRun = bandRuns[bandRun_i];
+        Rect window = matchWhole ? image : bandRun.window;
+        if (!matchWhole)
+        {
+            TRACE_SCOPE("stereo_bm_compute");
+            _sbm->compute(leftGray(window), rightGray(window), _windowDisparity);
+        }
+        for (int blockRow_i = bandRun.top; blockRow_i < bandRun.bottom; blockRow_i++)
+        {
+            textureRuns(_blockMask.ptr<uchar>(blockRow_i) + bandRun.first, bandRun.last + 1 - bandRun.first, mergeGap, runs);
+            for (size_t run_i = 0; run_i < runs.size(); run_i++)
+            {
+                Rect rowRun = Rect((bandRun.first + runs[run_i].first)*blockSize, blockRow_i*blockSize,
+                                   (runs[run_i].second + 1 - runs[run_i].first)*blockSize, blockSize) & image;
+                Mat target = _disparity16S(rowRun);
+                _windowDisparity(Rect(rowRun.tl() - window.tl(), rowRun.size())).copyTo(target);
+                matched += rowRun.area();
+            }
+        }
+    }
+    _skippedFraction = 1.0 - static_cast<double>(matched)/image.area();
+    _windowFraction = matchWhole ? 1.0 : windowArea/image.area();
+}
+
+
+TemporalDisparityMatcher::TemporalDisparityMatcher(int ndisparities, int SADWindowSize, int band, Warp warp, int refreshInterval, int tileSize):
+    _ndisparities(ndisparities),
+    _SADWindowSize(SADWindowSize),
+    _band(band),
+    _warp(warp),
+    _refreshInterval(refreshInterval),
+    _tileSize(tileSize),
+    _frame_i(0),
+    _fullSearchFraction(1.0),
+    _meanSearchRange(ndisparities),
+    _sbm(StereoBM::create(ndisparities, SADWindowSize))
+{
+}
+
+
+void TemporalDisparityMatcher::reset(void)
+{
+    _prior.release();
+    _frame_i = 0;
+}
+
+
+// forward warp of the prior to the next pair of a rail sequence: a pixel at x with disparity d is at x - d in the next
+// left image; where two pixels land on the same spot the nearer (larger disparity) one wins
+void TemporalDisparityMatcher::warpPrior(void)
+{
+    TRACE_SCOPE("warp_prior");
+    _warped.create(_prior.size(), CV_16SC1);
+    _warped.setTo(Scalar(-16));
+    for (int row_i = 0; row_i < _prior.rows; row_i++)
+    {
+        const short *prior_p = _prior.ptr<short>(row_i);
+        short *warped_p = _warped.ptr<short>(row_i);
+        for (int col_i = 0; col_i < _prior.cols; col_i++)
+        {
+            short d = prior_p[col_i];
+            int warpedCol = col_i - (d + 8)/16;
+            if (d >= 0 && warpedCol >= 0 && d > warped_p[warpedCol])
+            {
+                warped_p[warpedCol] = d;
+            }
+        }
+    }
+}
+
+
+// StereoBM over run with the given disparity range, written into _disparity16S; returns the fraction of the run's
+// pixels whose result is suspect: invalid where the prior was valid, or on the first or last disparity of a range
+// that does not reach the end of the full range (the true match probably lies beyond it)
+double TemporalDisparityMatcher::matchRun(const Mat &leftGray, const Mat &rightGray, Rect run, int minDisparity, int ndisparities)
+{
+    int margin = _SADWindowSize/2 + 5;
+    Rect image(0, 0, leftGray.cols, leftGray.rows);
+    Rect window = Rect(Point(run.x - (minDisparity + ndisparities - 1) - margin, run.y - margin),
+                       Point(run.br().x + margin, run.br().y + margin)) & image;
+    {
+        TRACE_SCOPE("stereo_bm_compute");
+        _sbm->setMinDisparity(minDisparity);
+        _sbm->setNumDisparities(ndisparities);
+        _sbm->compute(leftGray(window), rightGray(window), _windowDisparity);
+    }
+
+    // note: StereoBM marks invalid pixels with (minDisparity - 1)*16; they are stored as -16 whatever the range
+    int low = minDisparity*16;
+    int lowEdge = minDisparity > 0 ? low + 16 : low;
+    int highEdge = minDisparity + ndisparities < _ndisparities ? (minDisparity + ndisparities - 1)*16 : (1 << 15) - 1;
+    size_t suspect = 0;
+    for (int row_i = 0; row_i < run.height; row_i++)
+    {
+        const short *result_p = _windowDisparity.ptr<short>(run.y - window.y + row_i) + (run.x - window.x);
+        const short *prior_p = _warped.empty() ? 0 : _warped.ptr<short>(run.y + row_i) + run.x;
+        short *disparity_p = _disparity16S.ptr<short>(run.y + row_i) + run.x;
+        for (int col_i = 0; col_i < run.width; col_i++)
+        {
+            short d = result_p[col_i];
+            if (d < low)
+            {
+                disparity_p[col_i] = -16;
+                suspect += prior_p && prior_p[col_i] >= 0;
+            }
+            else
+            {
+                disparity_p[col_i] = d;
+                suspect += d < lowEdge || d >= highEdge;
+            }
+        }
+    }
+    return static_cast<double>(suspect)/run.area();
+}
+
+
+void TemporalDisparityMatcher::compute(const Mat &left, const Mat &right, Mat &disparity8U, double *minVal, double *maxVal)
+{
+    TRACE_SCOPE("temporal_disparity");
+
+    // StereoBM only accepts grayscale images
+    const Mat *leftGray = &left;
+    const Mat *rightGray = &right;
+    if (left.channels() != 1)
+    {
+        cvtColor(left, _leftGray, COLOR_BGR2GRAY);
+        leftGray = &_leftGray;
+    }
+    if (right.channels() != 1)
+    {
+        cvtColor(right, _rightGray, COLOR_BGR2GRAY);
+        rightGray = &_rightGray;
+    }
+
+    bool refresh = _refreshInterval > 0 && _frame_i % _refreshInterval == 0;
+    _frame_i++;
+    if (_prior.empty() || _prior.size() != leftGray->size() || refresh)
+    {
+        TRACE_SCOPE("stereo_bm_compute");
+        _sbm->setMinDisparity(0);
+        _sbm->setNumDisparities(_ndisparities);
+        _sbm->compute(*leftGray, *rightGray, _disparity16S);
+        _fullSearchFraction = 1.0;
+        _meanSearchRange = _ndisparities;
+    }
+    else
+    {
+        if (_warp == WARP_RAIL)
+        {
+            warpPrior();
+        }
+        else
+        {
+            _prior.copyTo(_warped);
+        }
+        _disparity16S.create(leftGray->size(), CV_16SC1);
+
+        // each tile's range from the prior; runs of neighboring tiles with the same range are matched together
+        Rect image(0, 0, leftGray->cols, leftGray->rows);
+        size_t fullPixels = 0;
+        double searched = 0.0;
+        for (int tileRow = 0; tileRow < leftGray->rows; tileRow += _tileSize)
+        {
+            vector<int> minDisparities, ranges;
+            for (int tileCol = 0; tileCol < leftGray->cols; tileCol += _tileSize)
+            {
+                Rect tile = Rect(tileCol, tileRow, _tileSize, _tileSize) & image;
+                int lowest = 1 << 15, highest = -1;
+                int nvalid = 0;
+                for (int row_i = tile.y; row_i < tile.br().y; row_i++)
+                {
+                    const short *prior_p = _warped.ptr<short>(row_i);
+                    for (int col_i = tile.x; col_i < tile.br().x; col_i++)
+                    {
+                        short d = prior_p[col_i];
+                        if (d >= 0)
+                        {
+                            lowest = min<int>(lowest, d);
+                            highest = max<int>(highest, d);
+                            nvalid++;
+                        }
+                    }
+                }
+                int minDisparity = 0, ndisparities = _ndisparities;
+                if (2*nvalid >= tile.area())
+                {
+                    int low = max(0, lowest/16 - _band);
+                    int high = min(_ndisparities - 1, (highest + 15)/16 + _band);
+                    int range = (high - low + 16)/16*16;
+                    if (range < _ndisparities)
+                    {
+                        minDisparity = min(low, _ndisparities - range);
+                        ndisparities = range;
+                    }
+                }
+                minDisparities.push_back(minDisparity);
+                ranges.push_back(ndisparities);
+            }
+
+            for (size_t tile_i = 0; tile_i < ranges.size(); )
+            {
+                size_t end_i = tile_i + 1;
+                while (end_i < ranges.size() && minDisparities[end_i] == minDisparities[tile_i] && ranges[end_i] == ranges[tile_i])
+                {
+                    end_i++;
+                }
+                Rect run = Rect(static_cast<int>(tile_i)*_tileSize, tileRow, static_cast<int>(end_i - tile_i)*_tileSize, _tileSize) & image;
+                int ndisparities = ranges[tile_i];
+                double suspect = matchRun(*leftGray, *rightGray, run, minDisparities[tile_i], ndisparities);
+                if (ndisparities < _ndisparities && suspect > 0.25)
+                {
+                    searched += static_cast<double>(ndisparities)*run.area();
+                    matchRun(*leftGray, *rightGray, run, 0, _ndisparities);
+                    ndisparities = _ndisparities;
+                }
+                if (ndisparities == _ndisparities)
+                {
+                    fullPixels += run.area();
+                }
+                searched += static_cast<double>(ndisparities)*run.area();
+                tile_i = end_i;
+            }
+        }
+        _fullSearchFraction = static_cast<double>(fullPixels)/image.area();
+        _meanSearchRange = searched/image.area();
+    }
+    _disparity16S.copyTo(_prior);
+
+    // scale to the full 8 bit range, as DisparityMatcher does
+    TRACE_SCOPE("normalize_disparity");
+    double minDisparity, maxDisparity;
+    minMaxLoc(_disparity16S, &minDisparity, &maxDisparity);
+    _disparity16S.convertTo(disparity8U, CV_8UC1, 255/(maxDisparity - minDisparity));
+    if (minVal)
+    {
+        *minVal = minDisparity;
+    }
+    if (maxVal)
+    {
+        *maxVal = maxDisparity;
+    }
+}
+
+
+void DisparityWinners::reset(Size size)
+{
+    cost.create(size, CV_32F);
+    cost.setTo(Scalar(numeric_limits<float>::max()));
+    disparity.create(size, CV_16S);
+    disparity.setTo(Scalar(-1));
+    costBelow.create(size, CV_32F);
+    costBelow.setTo(Scalar(0));
+    costAbove.create(size, CV_32F);
+    costAbove.setTo(Scalar(0));
+}
+
+
+void DisparityWinners::update(const Mat &slice, const Mat &previous, int d, bool candidate)
+{
+    for (int row_i = 0; row_i < slice.rows; row_i++)
+    {
+        const float *slice_p = slice.ptr<float>(row_i);
+        const float *previous_p = d > 0 ? previous.ptr<float>(row_i) : slice_p;
+        float *cost_p = cost.ptr<float>(row_i);
+        short *disparity_p = disparity.ptr<short>(row_i);
+        float *costBelow_p = costBelow.ptr<float>(row_i);
+        float *costAbove_p = costAbove.ptr<float>(row_i);
+        for (int col_i = 0; col_i < slice.cols; col_i++)
+        {
+            float c = slice_p[col_i];
+            if (disparity_p[col_i] == d - 1)
+            {
+                costAbove_p[col_i] = c;
+            }
+            if (candidate && c < cost_p[col_i])
+            {
+                cost_p[col_i] = c;
+                disparity_p[col_i] = static_cast<short>(d);
+                costBelow_p[col_i] = previous_p[col_i];
+            }
+        }
+    }
+}
+
+
+void DisparityWinners::merge(const DisparityWinners &other)
+{
+    for (int row_i = 0; row_i < cost.rows; row_i++)
+    {
+        const float *otherCost_p = other.cost.ptr<float>(row_i);
+        const short *otherDisparity_p = other.disparity.ptr<short>(row_i);
+        const float *otherBelow_p = other.costBelow.ptr<float>(row_i);
+        const float *otherAbove_p = other.costAbove.ptr<float>(row_i);
+        float *cost_p = cost.ptr<float>(row_i);
+        short *disparity_p = disparity.ptr<short>(row_i);
+        float *costBelow_p = costBelow.ptr<float>(row_i);
+        float *costAbove_p = costAbove.ptr<float>(row_i);
+        for (int col_i = 0; col_i < cost.cols; col_i++)
+        {
+            // note: ties go to the lower disparity, as within a chunk, so the result does not depend on the order the
+            // chunks finish in
+            if (otherCost_p[col_i] < cost_p[col_i] || (otherCost_p[col_i] == cost_p[col_i] && otherDisparity_p[col_i] < disparity_p[col_i]))
+            {
+                cost_p[col_i] = otherCost_p[col_i];
+                disparity_p[col_i] = otherDisparity_p[col_i];
+                costBelow_p[col_i] = otherBelow_p[col_i];
+                costAbove_p[col_i] = otherAbove_p[col_i];
+            }
+        }
+    }
+}
+
+
+void DisparityWinners::refine(int ndisparities, Mat &disparity16S) const
+{
+    TRACE_SCOPE("subpixel_disparity");
+    disparity16S.create(cost.size(), CV_16S);
+    for (int row_i = 0; row_i < cost.rows; row_i++)
+    {
+        const short *disparity_p = disparity.ptr<short>(row_i);
+        const float *cost_p = cost.ptr<float>(row_i);
+        const float *costBelow_p = costBelow.ptr<float>(row_i);
+        const float *costAbove_p = costAbove.ptr<float>(row_i);
+        short *disparity16S_p = disparity16S.ptr<short>(row_i);
+        for (int col_i = 0; col_i < cost.cols; col_i++)
+        {
+            int d = disparity_p[col_i];
+            float offset = 0.0F;
+            if (d > 0 && d < ndisparities - 1)
+            {
+                float curvature = costBelow_p[col_i] - 2.0F*cost_p[col_i] + costAbove_p[col_i];
+                if (curvature > 0.0F)
+                {
+                    offset = std::min(std::max((costBelow_p[col_i] - costAbove_p[col_i])/(2.0F*curvature), -0.5F), 0.5F);
+                }
+            }
+            disparity16S_p[col_i] = static_cast<short>(cvRound((d + offset)*16.0F));
+        }
+    }
+}
+
+
+// the winners over the cost volume of disparities [0, ndisparities), computed in chunks of disparities in parallel;
+// sliceCost(d, slice, scratch) fills the CV_32F cost slice of disparity d, with scratch buffers of its own per chunk
+// note: the slices just outside a chunk are computed too, when they exist, so every winner has the costs on both sides.
+// chunks are sized to give each thread one or two, within limits: small chunks compute proportionally more slices
+// twice, large ones leave threads idle
+template <typename SliceCost>
+static void streamCostVolume(Size size, int ndisparities, int nthreads, SliceCost sliceCost, DisparityWinners &winners)
+{
+    TRACE_SCOPE("stream_cost_volume");
+    int chunkThreads = nthreads > 0 ? nthreads : defaultThreadCount();
+    int chunkSize = std::min(32, std::max(8, (ndisparities + chunkThreads - 1)/chunkThreads));
+    int nchunks = (ndisparities + chunkSize - 1)/chunkSize;
+    winners.reset(size);
+    mutex mergeMutex;
+    parallelFor(nchunks, [&](size_t chunk_i)
+    {
+        TRACE_SCOPE("cost_volume_chunk");
+        int first = static_cast<int>(chunk_i)*chunkSize, end = std::min(first + chunkSize, ndisparities);
+        DisparityWinners chunkWinners;
+        chunkWinners.reset(size);
+        Mat slice(size, CV_32F), previous(size, CV_32F);
+        vector<Mat> scratch;
+        for (int d = std::max(first - 1, 0); d <= std::min(end, ndisparities - 1); d++)
+        {
+            sliceCost(d, slice, scratch);
+            chunkWinners.update(slice, previous, d, d >= first && d < end);
+            std::swap(slice, previous);
+        }
+        lock_guard<mutex> lock(mergeMutex);
+        winners.merge(chunkWinners);
+    }, nthreads);
+}
+
+
+// guided filter matching cost: (1 - alpha)*min(color difference, tauColor) + alpha*min(gradient difference, tauGradient),
+// with images in [0, 1]; the values are Hosni et al.'s
+static const float _costAlpha = 0.9F;
+static const float _costTauColor = 7.0F/255.0F;
+static const float _costTauGradient = 2.0F/255.0F;
+
+
+GuidedFilterMatcher::GuidedFilterMatcher(int ndisparities, int radius, double epsilon, int nthreads):
+    _ndisparities(ndisparities),
+    _radius(radius),
+    _epsilon(epsilon),
+    _nthreads(nthreads)
+{
+}
+
+
+// the filtered cost slice of disparity d
+void GuidedFilterMatcher::sliceCost(int d, Mat &slice, vector<Mat> &scratch) const
+{
+    const int rows = _left.rows, cols = _left.cols;
+    const Size window(2*_radius + 1, 2*_radius + 1);
+    const float borderCost = (1.0F - _costAlpha)*_costTauColor + _costAlpha*_costTauGradient;
+    scratch.resize(4);
+    Mat &cost = scratch[0], &guidedCost = scratch[1], &costMean = scratch[2], &guidedCostMean = scratch[3];
+    cost.create(rows, cols, CV_32F);
+    guidedCost.create(rows, cols, CV_32F);
+
+    // the cost slice, and its product with the guide
+    // note: pixels whose match would fall off the right image's left edge get the largest cost
+    for (int row_i = 0; row_i < rows; row_i++)
+    {
+        const Vec3f *left_p = _left.ptr<Vec3f>(row_i);
+        const Vec3f *right_p = _right.ptr<Vec3f>(row_i);
+        const float *leftGradient_p = _leftGradient.ptr<float>(row_i);
+        const float *rightGradient_p = _rightGradient.ptr<float>(row_i);
+        const float *guide_p = _guide.ptr<float>(row_i);
+        float *cost_p = cost.ptr<float>(row_i);
+        float *guidedCost_p = guidedCost.ptr<float>(row_i);
+        int border = std::min(d, cols);
+        for (int col_i = 0; col_i < border; col_i++)
+        {
+            cost_p[col_i] = borderCost;
+            guidedCost_p[col_i] = borderCost*guide_p[col_i];
+        }
+        for (int col_i = border; col_i < cols; col_i++)
+        {
+            const Vec3f &l = left_p[col_i], &r = right_p[col_i - d];
+            float color = (std::fabs(l[0] - r[0]) + std::fabs(l[1] - r[1]) + std::fabs(l[2] - r[2]))*(1.0F/3.0F);
+            float gradient = std::fabs(leftGradient_p[col_i] - rightGradient_p[col_i - d]);
+            float c = (1.0F - _costAlpha)*std::min(color, _costTauColor) + _costAlpha*std::min(gradient, _costTauGradient);
+            cost_p[col_i] = c;
+            guidedCost_p[col_i] = c*guide_p[col_i];
+        }
+    }
+
+    // the guided filter: per window, the linear fit a*I + b of the cost to the guide, then the fits of every window
+    // covering a pixel averaged; cost and guidedCost are reused for a and b
+    boxFilter(cost, costMean, CV_32F, window);
+    boxFilter(guidedCost, guidedCostMean, CV_32F, window);
+    for (int row_i = 0; row_i < rows; row_i++)
+    {
+        const float *guideMean_p = _guideMean.ptr<float>(row_i);
+        const float *guideVariance_p = _guideVariance.ptr<float>(row_i);
+        const float *costMean_p = costMean.ptr<float>(row_i);
+        const float *guidedCostMean_p = guidedCostMean.ptr<float>(row_i);
+        float *a_p = cost.ptr<float>(row_i);
+        float *b_p = guidedCost.ptr<float>(row_i);
+        for (int col_i = 0; col_i < cols; col_i++)
+        {
+            float a = (guidedCostMean_p[col_i] - guideMean_p[col_i]*costMean_p[col_i])/guideVariance_p[col_i];
+            a_p[col_i] = a;
+            b_p[col_i] = costMean_p[col_i] - a*guideMean_p[col_i];
+        }
+    }
+    boxFilter(cost, costMean, CV_32F, window);
+    boxFilter(guidedCost, guidedCostMean, CV_32F, window);
+    for (int row_i = 0; row_i < rows; row_i++)
+    {
+        const float *guide_p = _guide.ptr<float>(row_i);
+        const float *aMean_p = costMean.ptr<float>(row_i);
+        const float *bMean_p = guidedCostMean.ptr<float>(row_i);
+        float *slice_p = slice.ptr<float>(row_i);
+        for (int col_i = 0; col_i < cols; col_i++)
+        {
+            slice_p[col_i] = aMean_p[col_i]*guide_p[col_i] + bMean_p[col_i];
+        }
+    }
+}
+
+
+void GuidedFilterMatcher::compute(const Mat &left, const Mat &right, Mat &disparity8U, double *minVal, double *maxVal)
+{
+    TRACE_SCOPE("disparity");
+    CV_Assert(left.size() == right.size() && _ndisparities > 0 && _radius >= 1);
+
+    // color images in [0, 1], the guide and the horizontal gradients
+    {
+        TRACE_SCOPE("guided_prepare");
+        Mat image[2] = {left, right};
+        Mat *scaled[2] = {&_left, &_right};
+        for (int image_i = 0; image_i < 2; image_i++)
+        {
+            if (image[image_i].channels() == 1)
+            {
+                Mat color;
+                cvtColor(image[image_i], color, COLOR_GRAY2BGR);
+                color.convertTo(*scaled[image_i], CV_32FC3, 1.0/255.0);
+            }
+            else
+            {
+                image[image_i].convertTo(*scaled[image_i], CV_32FC3, 1.0/255.0);
+            }
+        }
+        Mat rightGray;
+        cvtColor(_left, _guide, COLOR_BGR2GRAY);
+        cvtColor(_right, rightGray, COLOR_BGR2GRAY);
+        Sobel(_guide, _leftGradient, CV_32F, 1, 0, 1);
+        Sobel(rightGray, _rightGradient, CV_32F, 1, 0, 1);
+
+        // the guide's window means and variances are the same for every slice
+        const Size window(2*_radius + 1, 2*_radius + 1);
+        Mat guideSquareMean;
+        boxFilter(_guide, _guideMean, CV_32F, window);
+        sqrBoxFilter(_guide, guideSquareMean, CV_32F, window);
+        _guideVariance.create(_guide.size(), CV_32F);
+        for (int row_i = 0; row_i < _guide.rows; row_i++)
+        {
+            const float *mean_p = _guideMean.ptr<float>(row_i);
+            const float *square_p = guideSquareMean.ptr<float>(row_i);
+            float *variance_p = _guideVariance.ptr<float>(row_i);
+            for (int col_i = 0; col_i < _guide.cols; col_i++)
+            {
+                variance_p[col_i] = std::max(square_p[col_i] - mean_p[col_i]*mean_p[col_i], 0.0F) + static_cast<float>(_epsilon);
+            }
+        }
+    }
+
+    // the filtered cost volume, streamed in parallel chunks of disparities
+    streamCostVolume(_left.size(), _ndisparities, _nthreads, [this](int d, Mat &slice, vector<Mat> &scratch) { sliceCost(d, slice, scratch); },
+                     _winners);
+    _winners.refine(_ndisparities, _disparity16S);
+
+    // scale to the full 8 bit range, as DisparityMatcher does
+    TRACE_SCOPE("normalize_disparity");
+    double minDisparity, maxDisparity;
+    minMaxLoc(_disparity16S, &minDisparity, &maxDisparity);
+    _disparity16S.convertTo(disparity8U, CV_8UC1, 255/(maxDisparity - minDisparity));
+    if (minVal)
+    {
+        *minVal = minDisparity;
+    }
+    if (maxVal)
+    {
+        *maxVal = maxDisparity;
+    }
+}
+
+
+MultiBaselineMatcher::MultiBaselineMatcher(int ndisparities, int windowSize, int truncation, int nthreads):
+    _ndisparities(ndisparities),
+    _windowSize(windowSize),
+    _truncation(truncation),
+    _nthreads(nthreads)
+{
+}
+
+
+// add min(|reference - neighbor|, truncation) to cost, where the neighbor pixel is shift columns to the left of the
+// reference's; truncation is added where that falls outside the neighbor
+static void accumulateTruncatedDifferences(const uchar *reference_p, const uchar *neighbor_p, int cols, int shift, int truncation, ushort *cost_p)
+{
+    int begin = std::min(std::max(shift, 0), cols), end = std::max(std::min(cols + shift, cols), begin);
+    for (int col_i = 0; col_i < begin; col_i++)
+    {
+        cost_p[col_i] += static_cast<ushort>(truncation);
+    }
+    int col_i = begin;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i cap = _mm_set1_epi8(static_cast<char>(truncation));
+    for (; col_i + 16 <= end; col_i += 16)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reference_p + col_i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(neighbor_p + col_i - shift));
+        __m128i difference = _mm_min_epu8(_mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)), cap);
+        __m128i *cost = reinterpret_cast<__m128i *>(cost_p + col_i);
+        _mm_storeu_si128(cost, _mm_add_epi16(_mm_loadu_si128(cost), _mm_unpacklo_epi8(difference, zero)));
+        _mm_storeu_si128(cost + 1, _mm_add_epi16(_mm_loadu_si128(cost + 1), _mm_unpackhi_epi8(difference, zero)));
+    }
+#endif
+    for (; col_i < end; col_i++)
+    {
+        cost_p[col_i] += static_cast<ushort>(std::min(std::abs(reference_p[col_i] - neighbor_p[col_i - shift]), truncation));
+    }
+    for (col_i = end; col_i < cols; col_i++)
+    {
+        cost_p[col_i] += static_cast<ushort>(truncation);
+    }
+}
+
+
+// the window mean of the summed differences to every neighbor at disparity d
+void MultiBaselineMatcher::sliceCost(int d, Mat &slice, vector<Mat> &scratch) const
+{
+    scratch.resize(1);
+    Mat &sum = scratch[0];
+    sum.create(_reference.size(), CV_16U);
+    sum.setTo(Scalar(0));
+    for (size_t neighbor_i = 0; neighbor_i < _neighbors.size(); neighbor_i++)
+    {
+        int shift = _offsets[neighbor_i]*d;
+        for (int row_i = 0; row_i < _reference.rows; row_i++)
+        {
+            accumulateTruncatedDifferences(_reference.ptr<uchar>(row_i), _neighbors[neighbor_i].ptr<uchar>(row_i), _reference.cols, shift,
+                                           _truncation, sum.ptr<ushort>(row_i));
+        }
+    }
+    boxFilter(sum, slice, CV_32F, Size(_windowSize, _windowSize));
+}
+
+
+void MultiBaselineMatcher::compute(const Mat &reference, const vector<Mat> &neighbors, const vector<int> &offsets, Mat &disparity8U,
+                                   double *minVal, double *maxVal)
+{
+    TRACE_SCOPE("disparity");
+    CV_Assert(!neighbors.empty() && neighbors.size() == offsets.size() && _truncation >= 1 && _truncation <= 255);
+    CV_Assert(neighbors.size()*_truncation <= 65535 && _ndisparities > 0 && _windowSize >= 1);
+
+    // everything in grayscale
+    {
+        TRACE_SCOPE("convert_to_gray");
+        _neighbors.resize(neighbors.size());
+        for (size_t image_i = 0; image_i <= neighbors.size(); image_i++)
+        {
+            const Mat &image = image_i == 0 ? reference : neighbors[image_i - 1];
+            Mat &gray = image_i == 0 ? _reference : _neighbors[image_i - 1];
+            CV_Assert(image.size() == reference.size() && (image_i == 0 || offsets[image_i - 1] != 0));
+            if (image.channels() == 1)
+            {
+                gray = image;
+            }
+            else
+            {
+                cvtColor(image, gray, COLOR_BGR2GRAY);
+            }
+        }
+        _offsets = offsets;
+    }
+
+    // the summed cost volume, streamed in parallel chunks of disparities
+    streamCostVolume(_reference.size(), _ndisparities, _nthreads, [this](int d, Mat &slice, vector<Mat> &scratch) { sliceCost(d, slice, scratch); },
+                     _winners);
+    _winners.refine(_ndisparities, _disparity16S);
+
+    // invalidate the pixels that no neighbor sees at their disparity, which won on the truncation penalties alone
+    {
+        TRACE_SCOPE("invalidate_unseen");
+        const int cols = _reference.cols;
+        for (int row_i = 0; row_i < _reference.rows; row_i++)
+        {
+            const short *winner_p = _winners.disparity.ptr<short>(row_i);
+            short *disparity_p = _disparity16S.ptr<short>(row_i);
+            for (int col_i = 0; col_i < cols; col_i++)
+            {
+                bool seen = false;
+                for (size_t neighbor_i = 0; neighbor_i < _offsets.size() && !seen; neighbor_i++)
+                {
+                    int neighborCol = col_i - _offsets[neighbor_i]*winner_p[col_i];
+                    seen = neighborCol >= 0 && neighborCol < cols;
+                }
+                if (!seen)
+                {
+                    disparity_p[col_i] = -16;
+                }
+            }
+        }
+    }
+
+    // scale to the full 8 bit range, as DisparityMatcher does
+    TRACE_SCOPE("normalize_disparity");
+    double minDisparity, maxDisparity;
+    minMaxLoc(_disparity16S, &minDisparity, &maxDisparity);
+    _disparity16S.convertTo(disparity8U, CV_8UC1, 255/(maxDisparity - minDisparity));
+    if (minVal)
+    {
+        *minVal = minDisparity;
+    }
+    if (maxVal)
+    {
+        *maxVal = maxDisparity;
+    }
+}
+
+
+// the first element of [begin, end) that is invalid (negative), or end
+static int findInvalid(const short *row_p, int begin, int end)
+{
+    int col_i = begin;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    while (col_i + 8 <= end && !_mm_movemask_epi8(_mm_cmplt_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row_p + col_i)), zero)))
+    {
+        col_i += 8;
+    }
+#endif
+    while (col_i < end && row_p[col_i] >= 0)
+    {
+        col_i++;
+    }
+    return col_i;
+}
+
+
+// the first element of [begin, end) that is valid, or end
+static int findValid(const short *row_p, int begin, int end)
+{
+    int col_i = begin;
+#ifdef __SSE2__
+    const __m128i minusOne = _mm_set1_epi16(-1);
+    while (col_i + 8 <= end && !_mm_movemask_epi8(_mm_cmpgt_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row_p + col_i)), minusOne)))
+    {
+        col_i += 8;
+    }
+#endif
+    while (col_i < end && row_p[col_i] < 0)
+    {
+        col_i++;
+    }
+    return col_i;
+}
+
+
+size_t fillDisparityHoles(const Mat &disparity16S, const Mat &guide, Mat &filled16S, Mat &filledMask, int radius, int nthreads)
+{
+    TRACE_SCOPE("fill_disparity_holes");
+    CV_Assert(disparity16S.type() == CV_16SC1 && guide.size() == disparity16S.size() && radius >= 1);
+    const int rows = disparity16S.rows, cols = disparity16S.cols;
+    Mat guideGray;
+    if (guide.channels() == 1)
+    {
+        guideGray = guide;
+    }
+    else
+    {
+        cvtColor(guide, guideGray, COLOR_BGR2GRAY);
+    }
+
+    // scanline background propagation
+    // note: the filled rows go to a scratch image first, since the median below reads them around each pixel it replaces
+    Mat scanline;
+    disparity16S.copyTo(scanline);
+    filledMask.create(disparity16S.size(), CV_8UC1);
+    filledMask.setTo(Scalar(0));
+    vector<uchar> rowHasValid(rows);
+    {
+        TRACE_SCOPE("fill_scanlines");
+        parallelFor(rows, [&](size_t row)
+        {
+            int row_i = static_cast<int>(row);
+            short *row_p = scanline.ptr<short>(row_i);
+            uchar *mask_p = filledMask.ptr<uchar>(row_i);
+            int start = findInvalid(row_p, 0, cols);
+            rowHasValid[row_i] = start > 0 || findValid(row_p, start, cols) < cols;
+            while (start < cols && rowHasValid[row_i])
+            {
+                int end = findValid(row_p, start, cols);
+                short left = start > 0 ? row_p[start - 1] : -1, right = end < cols ? row_p[end] : -1;
+                short background = left < 0 ? right : (right < 0 ? left : std::min(left, right));
+                std::fill(row_p + start, row_p + end, background);
+                std::fill(mask_p + start, mask_p + end, 255);
+                start = findInvalid(row_p, end, cols);
+            }
+        }, nthreads);
+    }
+
+    // rows with nothing to propagate, from the rows around them
+    {
+        TRACE_SCOPE("fill_empty_rows");
+        int above = -1;
+        for (int row_i = 0; row_i < rows; row_i++)
+        {
+            if (rowHasValid[row_i])
+            {
+                above = row_i;
+                continue;
+            }
+            int below = row_i + 1;
+            while (below < rows && !rowHasValid[below])
+            {
+                below++;
+            }
+            if (above < 0 && below == rows)
+            {
+                // no valid pixel anywhere
+                break;
+            }
+            for (; row_i < below; row_i++)
+            {
+                short *row_p = scanline.ptr<short>(row_i);
+                const short *above_p = above >= 0 ? scanline.ptr<short>(above) : scanline.ptr<short>(below);
+                const short *below_p = below < rows ? scanline.ptr<short>(below) : above_p;
+                int col_i = 0;
+#ifdef __SSE2__
+                for (; col_i + 8 <= cols; col_i += 8)
+                {
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(above_p + col_i));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(below_p + col_i));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(row_p + col_i), _mm_min_epi16(a, b));
+                }
+#endif
+                for (; col_i < cols; col_i++)
+                {
+                    row_p[col_i] = std::min(above_p[col_i], below_p[col_i]);
+                }
+                filledMask.row(row_i).setTo(Scalar(255));
+            }
+            row_i--;
+        }
+    }
+
+    // edge-aware smoothing of the filled pixels: the median of the window's disparities, each weighted by its distance
+    // and its guide similarity to the center
+    // note: the weights come from tables, the guide's by absolute gray level difference
+    scanline.copyTo(filled16S);
+    const int side = 2*radius + 1;
+    const double sigmaSpace = radius, sigmaGray = 10.0;
+    vector<float> spaceWeight(side*side), grayWeight(256);
+    for (int dy = -radius; dy <= radius; dy++)
+    {
+        for (int dx = -radius; dx <= radius; dx++)
+        {
+            spaceWeight[(dy + radius)*side + dx + radius] = static_cast<float>(std::exp(-(dx*dx + dy*dy)/(2.0*sigmaSpace*sigmaSpace)));
+        }
+    }
+    for (int difference = 0; difference < 256; difference++)
+    {
+        grayWeight[difference] = static_cast<float>(std::exp(-difference/sigmaGray));
+    }
+    const int blockRows = 16;
+    TRACE_SCOPE("fill_weighted_median");
+    parallelFor((rows + blockRows - 1)/blockRows, [&](size_t block_i)
+    {
+        vector<pair<short, float> > window(side*side);
+        int end = std::min(rows, static_cast<int>(block_i + 1)*blockRows);
+        for (int row_i = static_cast<int>(block_i)*blockRows; row_i < end; row_i++)
+        {
+            const uchar *mask_p = filledMask.ptr<uchar>(row_i);
+            const uchar *guide_p = guideGray.ptr<uchar>(row_i);
+            short *filled_p = filled16S.ptr<short>(row_i);
+            for (int col_i = 0; col_i < cols; col_i++)
+            {
+                if (!mask_p[col_i] || filled_p[col_i] < 0)
+                {
+                    continue;
+                }
+                size_t n = 0;
+                float total = 0.0F;
+                for (int y = std::max(row_i - radius, 0); y <= std::min(row_i + radius, rows - 1); y++)
+                {
+                    const short *scanline_p = scanline.ptr<short>(y);
+                    const uchar *neighborGuide_p = guideGray.ptr<uchar>(y);
+                    const float *spaceWeight_p = &spaceWeight[(y - row_i + radius)*side];
+                    for (int x = std::max(col_i - radius, 0); x <= std::min(col_i + radius, cols - 1); x++)
+                    {
+                        float weight = spaceWeight_p[x - col_i + radius]*grayWeight[std::abs(neighborGuide_p[x] - guide_p[col_i])];
+                        window[n++] = make_pair(scanline_p[x], weight);
+                        total += weight;
+                    }
+                }
+                std::sort(window.begin(), window.begin() + n);
+                float half = 0.5F*total, sum = 0.0F;
+                size_t median_i = 0;
+                for (; median_i + 1 < n; median_i++)
+                {
+                    sum += window[median_i].second;
+                    if (sum >= half)
+                    {
+                        break;
+                    }
+                }
+                filled_p[col_i] = window[median_i].first;
+            }
+        }
+    }, nthreads);
+
+    return static_cast<size_t>(countNonZero(filledMask));
+}
+
+
+DisparityAccuracy evaluateDisparity(const Mat &disparity16S, const Mat &groundTruth, double scale, double threshold)
+{
+    TRACE_SCOPE("evaluate_disparity");
+    CV_Assert(disparity16S.type() == CV_16SC1 && groundTruth.type() == CV_8UC1 && disparity16S.size() == groundTruth.size());
+
+    // the ground truth's range over each 5x5 neighborhood, ignoring unknown pixels
+    Mat known = groundTruth.clone();
+    known.setTo(Scalar(255), groundTruth == 0);
+    Mat neighborhoodMin, neighborhoodMax;
+    Mat kernel = getStructuringElement(MORPH_RECT, Size(5, 5));
+    erode(known, neighborhoodMin, kernel);
+    dilate(groundTruth, neighborhoodMax, kernel);
+
+    DisparityAccuracy accuracy;
+    accuracy.pixels = 0;
+    accuracy.edgePixels = 0;
+    size_t bad = 0, invalid = 0, edgeBad = 0, valid = 0;
+    double errorSum = 0.0;
+    for (int row_i = 0; row_i < groundTruth.rows; row_i++)
+    {
+        const short *disparity_p = disparity16S.ptr<short>(row_i);
+        const uchar *truth_p = groundTruth.ptr<uchar>(row_i);
+        const uchar *min_p = neighborhoodMin.ptr<uchar>(row_i);
+        const uchar *max_p = neighborhoodMax.ptr<uchar>(row_i);
+        for (int col_i = 0; col_i < groundTruth.cols; col_i++)
+        {
+            if (truth_p[col_i] == 0)
+            {
+                continue;
+            }
+            bool isBad = true;
+            if (disparity_p[col_i] >= 0)
+            {
+                double error = std::fabs(disparity_p[col_i]/16.0 - truth_p[col_i]/scale);
+                errorSum += error;
+                valid++;
+                isBad = error > threshold;
+            }
+            else
+            {
+                invalid++;
+            }
+            bool isEdge = max_p[col_i] - min_p[col_i] > 2.0*scale;
+            accuracy.pixels++;
+            accuracy.edgePixels += isEdge;
+            bad += isBad;
+            edgeBad += isBad && isEdge;
+        }
+    }
+    accuracy.badFraction = static_cast<double>(bad)/std::max<size_t>(accuracy.pixels, 1);
+    accuracy.invalidFraction = static_cast<double>(invalid)/std::max<size_t>(accuracy.pixels, 1);
+    accuracy.edgeBadFraction = static_cast<double>(edgeBad)/std::max<size_t>(accuracy.edgePixels, 1);
+    accuracy.meanError = errorSum/std::max<size_t>(valid, 1);
+    return accuracy;
+}
+
+
+Mat simpleQ(double cx, double cy, double focalLength, double baseline)
+{
+    Mat Q = Mat::zeros(4, 4, CV_64F);
+    Q.at<double>(0,0) = 1.0;
+    Q.at<double>(0,3) = -cx;
+    Q.at<double>(1,1) = 1.0;
+    Q.at<double>(1,3) = -cy;
+    Q.at<double>(2,3) = focalLength; // focal length (in pixels)
+    Q.at<double>(3,2) = -1.0/baseline; // -1.0/baseline (baseline in world units: m or mm)
+    Q.at<double>(3,3) = 0.0; // (cx - cx')/baseline -- assume (cx - cx') is 0
+    return Q;
+}
+
+
+Mat cropQ(const Mat &Q, Rect roi)
+{
+    // Q*(u + x, v + y, d, 1) = Q'*(u, v, d, 1) with the offset folded into the last column
+    Mat croppedQ;
+    Q.convertTo(croppedQ, CV_64F);
+    for (int row_i = 0; row_i < 4; row_i++)
+    {
+        croppedQ.at<double>(row_i, 3) += roi.x*croppedQ.at<double>(row_i, 0) + roi.y*croppedQ.at<double>(row_i, 1);
+    }
+    return croppedQ;
+}
+
+
+void reprojectDisparity(const Mat &disparity8U, const Mat &Q, Mat &XYZ)
+{
+    TRACE_SCOPE("reproject_image_to_3d");
+    reprojectImageTo3D(disparity8U, XYZ, Q, false, CV_32F);
+}
+
+
+// the smallest eigenvalue's unit eigenvector of the symmetric 3x3 matrix
+// [a00 a01 a02; a01 a11 a12; a02 a12 a22]; false if it is not well defined (e.g. isotropic spread)
+// note: closed form (trigonometric solution of the characteristic cubic), so no iteration per pixel
+static bool smallestEigenvector(double a00, double a01, double a02, double a11, double a12, double a22, double v[3])
+{
+    double q = (a00 + a11 + a22)/3.0;
+    double b00 = a00 - q, b11 = a11 - q, b22 = a22 - q;
+    double p2 = b00*b00 + b11*b11 + b22*b22 + 2.0*(a01*a01 + a02*a02 + a12*a12);
+    if (!(p2 > 0.0))
+    {
+        return false;
+    }
+    double p = sqrt(p2/6.0);
+    double det = b00*(b11*b22 - a12*a12) - a01*(a01*b22 - a12*a02) + a02*(a01*a12 - b11*a02);
+    double r = std::max(-1.0, std::min(1.0, det/(2.0*p*p*p)));
+    double lambda = q + 2.0*p*cos(acos(r)/3.0 + 2.0*M_PI/3.0);
+
+    // the eigenvector is orthogonal to the rows of A - lambda*I; take the best conditioned cross product of two rows
+    double m[3][3] = {{a00 - lambda, a01, a02}, {a01, a11 - lambda, a12}, {a02, a12, a22 - lambda}};
+    double best = 0.0;
+    for (int row_i = 0; row_i < 3; row_i++)
+    {
+        const double *u = m[row_i];
+        const double *w = m[(row_i + 1) % 3];
+        double c[3] = {u[1]*w[2] - u[2]*w[1], u[2]*w[0] - u[0]*w[2], u[0]*w[1] - u[1]*w[0]};
+        double norm2 = c[0]*c[0] + c[1]*c[1] + c[2]*c[2];
+        if (norm2 > best)
+        {
+            best = norm2;
+            v[0] = c[0];
+            v[1] = c[1];
+            v[2] = c[2];
+        }
+    }
+    if (!(best > 1e-24*p2*p2))
+    {
+        return false;
+    }
+    double scale = 1.0/sqrt(best);
+    v[0] *= scale;
+    v[1] *= scale;
+    v[2] *= scale;
+    return true;
+}
+
+
+void estimateNormals(const Mat &XYZ, int radius, Mat &normals, int minPoints, int nthreads)
+{
+    TRACE_SCOPE("estimate_normals");
+    CV_Assert(XYZ.type() == CV_32FC3 && radius >= 1);
+    const int rows = XYZ.rows, cols = XYZ.cols;
+    normals.create(XYZ.size(), CV_32FC3);
+    minPoints = std::max(minPoints, 3);
+
+    // note: sums are taken relative to the mean point, which keeps the covariance (sum of squares minus squared sum)
+    // from cancelling catastrophically when the cloud is far from the origin
+    double center[3] = {0.0, 0.0, 0.0};
+    size_t nvalid = 0;
+    for (int row_i = 0; row_i < rows; row_i++)
+    {
+        const Vec3f *XYZ_p = XYZ.ptr<Vec3f>(row_i);
+        for (int col_i = 0; col_i < cols; col_i++)
+        {
+            const Vec3f &p = XYZ_p[col_i];
+            if (std::isfinite(p[0]) && std::isfinite(p[1]) && std::isfinite(p[2]))
+            {
+                center[0] += p[0];
+                center[1] += p[1];
+                center[2] += p[2];
+                nvalid++;
+            }
+        }
+    }
+    for (int axis = 0; axis < 3; axis++)
+    {
+        center[axis] /= std::max<size_t>(nvalid, 1);
+    }
+
+    // integral images of the count, x, y, z and the six distinct products, interleaved per pixel and with a zero
+    // first row and column; rows are summed across in parallel, then column strips are summed down in parallel
+    const int nsums = 10;
+    const size_t stride = static_cast<size_t>(cols + 1)*nsums;
+    vector<double> integral((rows + 1)*stride, 0.0);
+    {
+        TRACE_SCOPE("normals_integral");
+        parallelFor(rows, [&](size_t row_i)
+        {
+            const Vec3f *XYZ_p = XYZ.ptr<Vec3f>(static_cast<int>(row_i));
+            double *sum_p = &integral[(row_i + 1)*stride];
+            for (int col_i = 0; col_i < cols; col_i++)
+            {
+                const double *left = sum_p + col_i*nsums;
+                double *sum = sum_p + (col_i + 1)*nsums;
+                const Vec3f &p = XYZ_p[col_i];
+                if (std::isfinite(p[0]) && std::isfinite(p[1]) && std::isfinite(p[2]))
+                {
+                    double x = p[0] - center[0], y = p[1] - center[1], z = p[2] - center[2];
+                    double values[nsums] = {1.0, x, y, z, x*x, x*y, x*z, y*y, y*z, z*z};
+                    for (int sum_i = 0; sum_i < nsums; sum_i++)
+                    {
+                        sum[sum_i] = left[sum_i] + values[sum_i];
+                    }
+                }
+                else
+                {
+                    std::copy(left, left + nsums, sum);
+                }
+            }
+        }, nthreads);
+
+        const size_t stripWidth = 1024;
+        parallelFor((stride + stripWidth - 1)/stripWidth, [&](size_t strip_i)
+        {
+            size_t begin = strip_i*stripWidth, end = std::min(begin + stripWidth, stride);
+            for (int row_i = 1; row_i <= rows; row_i++)
+            {
+                const double *above = &integral[(row_i - 1)*stride];
+                double *sum = &integral[row_i*stride];
+                for (size_t sum_i = begin; sum_i < end; sum_i++)
+                {
+                    sum[sum_i] += above[sum_i];
+                }
+            }
+        }, nthreads);
+    }
+
+    // one covariance and eigenvector per valid pixel from four integral image lookups, whatever the radius
+    TRACE_SCOPE("normals_eigen");
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    parallelFor(rows, [&](size_t row)
+    {
+        int row_i = static_cast<int>(row);
+        int top = std::max(row_i - radius, 0), bottom = std::min(row_i + radius + 1, rows);
+        const double *top_p = &integral[top*stride];
+        const double *bottom_p = &integral[bottom*stride];
+        const Vec3f *XYZ_p = XYZ.ptr<Vec3f>(row_i);
+        Vec3f *normals_p = normals.ptr<Vec3f>(row_i);
+        for (int col_i = 0; col_i < cols; col_i++)
+        {
+            const Vec3f &p = XYZ_p[col_i];
+            normals_p[col_i] = Vec3f(nan, nan, nan);
+            if (!std::isfinite(p[0]) || !std::isfinite(p[1]) || !std::isfinite(p[2]))
+            {
+                continue;
+            }
+            int left = std::max(col_i - radius, 0)*nsums, right = std::min(col_i + radius + 1, cols)*nsums;
+            double s[nsums];
+            for (int sum_i = 0; sum_i < nsums; sum_i++)
+            {
+                s[sum_i] = bottom_p[right + sum_i] - bottom_p[left + sum_i] - top_p[right + sum_i] + top_p[left + sum_i];
+            }
+            double n = s[0];
+            if (n < minPoints)
+            {
+                continue;
+            }
+            double mx = s[1]/n, my = s[2]/n, mz = s[3]/n;
+            double v[3];
+            if (!smallestEigenvector(s[4]/n - mx*mx, s[5]/n - mx*my, s[6]/n - mx*mz, s[7]/n - my*my, s[8]/n - my*mz, s[9]/n - mz*mz, v))
+            {
+                continue;
+            }
+
+            // orient the normal towards the camera at the origin
+            if (v[0]*p[0] + v[1]*p[1] + v[2]*p[2] > 0.0)
+            {
+                v[0] = -v[0];
+                v[1] = -v[1];
+                v[2] = -v[2];
+            }
+            normals_p[col_i] = Vec3f(static_cast<float>(v[0]), static_cast<float>(v[1]), static_cast<float>(v[2]));
+        }
+    }, nthreads);
+}
+
+
+size_t writePointCloud(ostream &out, const Mat &XYZ, const Mat &texture, const Mat &normals, bool organized)
+{
+    TRACE_SCOPE("write_pts");
+    CV_Assert(XYZ.type() == CV_32FC3 && texture.type() == CV_8UC3 && XYZ.size() == texture.size());
+    CV_Assert(normals.empty() || (normals.type() == CV_32FC3 && normals.size() == XYZ.size()));
+
+    // note: lines are formatted into a buffer and written in blocks; the format matches the original
+    // "fixed, precision 6, width 11" stream output byte for byte
+    size_t npoints = 0;
+    vector<char> buffer;
+    buffer.reserve(1 << 16);
+    char line[256];   // note: large enough for three FLT_MAX values in %11.6f plus a normal
+    if (organized)
+    {
+        int n = snprintf(line, sizeof(line), "# organized %d %d\n", XYZ.cols, XYZ.rows);
+        buffer.insert(buffer.end(), line, line + n);
+    }
+    for (int row_i = 0; row_i < XYZ.rows; row_i++)
+    {
+        const float *XYZ_p = XYZ.ptr<float>(row_i);
+        const uchar *texture_p = texture.ptr<uchar>(row_i);
+        const float *normals_p = normals.empty() ? 0 : normals.ptr<float>(row_i);
+        for (int col_i = 0; col_i < XYZ.cols; col_i++)
+        {
+            const float *p = XYZ_p + col_i*3;
+            bool valid = std::isfinite(p[0]) && std::isfinite(p[1]) && std::isfinite(p[2]);
+            if (!valid && !organized)
+            {
+                continue;
+            }
+            int n;
+            if (valid)
+            {
+                // output color in RGB order; note: opencv uses BGR order by default
+                const uchar *c = texture_p + col_i*3;
+                n = snprintf(line, sizeof(line), "%11.6f %11.6f %11.6f %3d %3d %3d ", p[0], p[1], p[2], c[2], c[1], c[0]);
+                npoints++;
+            }
+            else
+            {
+                n = snprintf(line, sizeof(line), "nan nan nan 0 0 0 ");
+            }
+            if (normals_p)
+            {
+                const float *normal = normals_p + col_i*3;
+                bool hasNormal = valid && std::isfinite(normal[0]) && std::isfinite(normal[1]) && std::isfinite(normal[2]);
+                n += snprintf(line + n, sizeof(line) - n, "%9.6f %9.6f %9.6f ", hasNormal ? normal[0] : 0.0F,
+                              hasNormal ? normal[1] : 0.0F, hasNormal ? normal[2] : 0.0F);
+            }
+            line[n++] = '\n';
+            buffer.insert(buffer.end(), line, line + n);
+        }
+        if (buffer.size() > (1 << 16) - 1024)
+        {
+            out.write(&buffer[0], buffer.size());
+            buffer.clear();
+        }
+    }
+    buffer.push_back('\n');
+    out.write(&buffer[0], buffer.size());
+    return npoints;
+}
+
+
+bool writePointCloud(const string &filename, const Mat &XYZ, const Mat &texture, size_t *npoints, const Mat &normals, bool organized)
+{
+    ofstream fout(filename.c_str(), ios::binary);
+    if (!fout)
+    {
+        return false;
+    }
+    size_t n = writePointCloud(fout, XYZ, texture, normals, organized);
+    if (npoints)
+    {
+        *npoints = n;
+    }
+    return static_cast<bool>(fout);
+}
@@ -0,0 +1,327 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef STEREO_HPP
+#define STEREO_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+
+// stereo processing shared by stereo_rectify_images, disparity_map, generate_point_cloud and stereo_pipeline:
+// rectify -> block match -> reproject -> write points file
+
+
+// camera and distortion matrices from a camera_calibration output file
+struct CameraData
+{
+    cv::Mat cameraMatrix;
+    cv::Mat distortionCoefficients;
+};
+
+// rectification transforms and remap tables for a pair of views taken by the same camera
+struct StereoRectification
+{
+    cv::Size imageSize;
+    cv::Mat R;      // rotation from the first (left) camera position to the second
+    cv::Mat T;      // translation from the first (left) camera position to the second
+    cv::Mat R1, R2, P1, P2, Q;
+    cv::Rect leftValidROI, rightValidROI;
+    cv::Rect validROI;      // where both rectified views hold image data (the whole frame if they do not overlap)
+    cv::Mat leftXMap, leftYMap;
+    cv::Mat rightXMap, rightYMap;
+};
+
+
+// returns false if the file cannot be opened
+bool loadCameraData(const std::string &filename, CameraData &camera);
+
+// set up rectification for a camera slid to the right by baseline (in world units) without rotating
+// note: this is how the extra credit scenes were taken, on a rail in 10.0mm steps
+void computeRectification(const CameraData &camera, cv::Size imageSize, double baseline, StereoRectification &rectification);
+
+// with cropToValid, only validROI is remapped and the outputs are validROI sized
+void rectifyPair(const StereoRectification &rectification, const cv::Mat &left, const cv::Mat &right, cv::Mat &leftRectified, cv::Mat &rightRectified,
+                 bool cropToValid = false);
+
+// save the rectification (image size, valid regions, R1, R2, P1, P2, Q) so later steps know how the images were cropped
+bool saveRectification(const std::string &filename, const StereoRectification &rectification);
+
+// the image size and valid region from a file written by saveRectification; returns false if it cannot be read
+bool loadValidROI(const std::string &filename, cv::Size &imageSize, cv::Rect &validROI);
+
+
+// which blockSize x blockSize blocks of a grayscale image have texture: 255 where the mean absolute horizontal
+// gradient (3x3 Sobel) reaches threshold, 0 elsewhere; one CV_8UC1 element per block
+// note: block sums come from an integral image, so the cost does not depend on the block size
+void computeTextureMask(const cv::Mat &gray, int blockSize, double threshold, cv::Mat &blockMask);
+
+
+// StereoBM disparity, normalized to an 8 bit image the way disparity_map has always saved it
+// note: the work buffers are kept between calls, so matching a sequence of same-sized frames does not reallocate
+class DisparityMatcher
+{
+public:
+    // note: the number of disparities must be positive and divisible by 16
+    DisparityMatcher(int ndisparities = 16*8, int SADWindowSize = 21);
+
+    // left and right may be color or grayscale; minVal and maxVal receive the raw 16 bit disparity range
+    void compute(const cv::Mat &left, const cv::Mat &right, cv::Mat &disparity8U, double *minVal = 0, double *maxVal = 0);
+
+    // skip matching in blocks of the left image without texture (see computeTextureMask); 0 (the default) matches everything
+    // note: skipped blocks come out invalid, like the pixels StereoBM itself rejects, and are left for a later fill step
+    void setTextureThreshold(double threshold, int blockSize = 16);
+
+    int ndisparities(void) const { return _ndisparities; }
+    int SADWindowSize(void) const { return _SADWindowSize; }
+    double textureThreshold(void) const { return _textureThreshold; }
+
+    // raw StereoBM disparity (16ths of a pixel, negative where invalid) of the last compute
+    const cv::Mat &rawDisparity(void) const { return _disparity16S; }
+
+    // the block mask and the fraction of pixels skipped by the last compute
+    const cv::Mat &blockMask(void) const { return _blockMask; }
+    double skippedFraction(void) const { return _skippedFraction; }
+
+    // the area StereoBM actually matched in the last compute, as a fraction of the image (1 when it matched the whole image)
+    double windowFraction(void) const { return _windowFraction; }
+
+private:
+    void computeTextured(const cv::Mat &leftGray, const cv::Mat &rightGray);
+
+    int _ndisparities;
+    int _SADWindowSize;
+    double _textureThreshold;
+    int _textureBlockSize;
+    int _textureBandBlocks;     // block rows matched together, so the window margins are paid once per band
+    double _textureFullFraction;        // window area (fraction of the image) past which the whole image is matched at once
+    double _skippedFraction;
+    double _windowFraction;
+    cv::Ptr<cv::StereoBM> _sbm;
+    cv::Mat _leftGray;
+    cv::Mat _rightGray;
+    cv::Mat _disparity16S;
+    cv::Mat _blockMask;
+    cv::Mat _windowDisparity;
+};
+
+
+// StereoBM disparity for consecutive frames of a sequence, searching only a band of disparities around the previous
+// frame's result; otherwise a drop-in for DisparityMatcher
+// note: the image is matched in tiles, each over the range of the prior within it widened by band on both sides (rounded
+// up to a multiple of 16). tiles with too little prior, and tiles whose band result runs into the band's edge or loses
+// pixels the prior had, are matched over the full range again; so is every refreshInterval-th frame, to bound drift
+// note: with WARP_RAIL the prior is first forward-warped by its own disparity, which is exact for a sequence like the
+// extra credit scenes, where the left image of each pair is the right image of the pair before; with WARP_NONE
+// (a fixed stereo rig filming a slowly changing scene) it is used as it is
+class TemporalDisparityMatcher
+{
+public:
+    enum Warp { WARP_NONE, WARP_RAIL };
+
+    TemporalDisparityMatcher(int ndisparities = 16*8, int SADWindowSize = 21, int band = 8, Warp warp = WARP_NONE,
+                             int refreshInterval = 0, int tileSize = 64);
+
+    void compute(const cv::Mat &left, const cv::Mat &right, cv::Mat &disparity8U, double *minVal = 0, double *maxVal = 0);
+
+    // forget the prior, e.g. at a scene cut or when a sequence starts over
+    void reset(void);
+
+    // raw StereoBM disparity (16ths of a pixel, negative where invalid) of the last frame
+    const cv::Mat &rawDisparity(void) const { return _disparity16S; }
+
+    // of the last frame: the fraction of pixels matched over the full range and the mean disparities searched per pixel
+    double fullSearchFraction(void) const { return _fullSearchFraction; }
+    double meanSearchRange(void) const { return _meanSearchRange; }
+
+private:
+    void warpPrior(void);
+    double matchRun(const cv::Mat &leftGray, const cv::Mat &rightGray, cv::Rect run, int minDisparity, int ndisparities);
+
+    int _ndisparities;
+    int _SADWindowSize;
+    int _band;
+    Warp _warp;
+    int _refreshInterval;
+    int _tileSize;
+    size_t _frame_i;
+    double _fullSearchFraction;
+    double _meanSearchRange;
+    cv::Ptr<cv::StereoBM> _sbm;
+    cv::Mat _leftGray;
+    cv::Mat _rightGray;
+    cv::Mat _disparity16S;
+    cv::Mat _prior;
+    cv::Mat _warped;
+    cv::Mat _windowDisparity;
+};
+
+
+// the lowest cost disparity of every pixel over the cost slices seen so far, with the costs of the disparities on either
+// side for a subpixel fit; kept by the matchers that stream a cost volume one disparity slice at a time
+struct DisparityWinners
+{
+    cv::Mat cost;           // CV_32F
+    cv::Mat disparity;      // CV_16S
+    cv::Mat costBelow;
+    cv::Mat costAbove;
+
+    void reset(cv::Size size);
+
+    // slice (CV_32F) is the cost of disparity d and previous that of d - 1 (unused when d is 0); only candidates can
+    // win, the other slices just supply the costs beside the winners
+    void update(const cv::Mat &slice, const cv::Mat &previous, int d, bool candidate);
+
+    // take the other's winners where they are better, or as good at a lower disparity
+    void merge(const DisparityWinners &other);
+
+    // disparities in 16ths of a pixel, each at the vertex of the parabola through its winner and the costs beside it
+    void refine(int ndisparities, cv::Mat &disparity16S) const;
+};
+
+
+// disparity from a cost volume whose disparity slices are each smoothed by a guided filter (He et al.) guided by the
+// left image, so the aggregation window follows the image's edges instead of blurring depth across them; otherwise a
+// drop-in for DisparityMatcher
+// the matching cost is a truncated mix of the color and horizontal gradient differences; each pixel takes the lowest
+// filtered cost, refined to subpixel by a parabola through its neighbors
+// note: the filter is four normalized box filters per slice, so the cost does not depend on the radius. the disparities
+// are split into chunks matched in parallel; a chunk streams its slices through a few slice-sized buffers and merges
+// its winners into the result when done, so memory grows with the thread count rather than the number of disparities
+class GuidedFilterMatcher
+{
+public:
+    // note: epsilon is the guided filter's regularization for an image scaled to [0, 1]; larger values smooth across
+    // weaker edges
+    GuidedFilterMatcher(int ndisparities = 16*8, int radius = 9, double epsilon = 1e-4, int nthreads = 0);
+
+    // left and right may be color or grayscale; minVal and maxVal receive the raw 16 bit disparity range
+    void compute(const cv::Mat &left, const cv::Mat &right, cv::Mat &disparity8U, double *minVal = 0, double *maxVal = 0);
+
+    int ndisparities(void) const { return _ndisparities; }
+    int radius(void) const { return _radius; }
+    double epsilon(void) const { return _epsilon; }
+
+    // raw disparity (16ths of a pixel, as StereoBM's) of the last compute
+    const cv::Mat &rawDisparity(void) const { return _disparity16S; }
+
+private:
+    void sliceCost(int d, cv::Mat &slice, std::vector<cv::Mat> &scratch) const;
+
+    int _ndisparities;
+    int _radius;
+    double _epsilon;
+    int _nthreads;
+    cv::Mat _left;              // CV_32FC3 in [0, 1]
+    cv::Mat _right;
+    cv::Mat _guide;             // the left image's gray levels
+    cv::Mat _guideMean;
+    cv::Mat _guideVariance;     // plus epsilon
+    cv::Mat _leftGradient;
+    cv::Mat _rightGradient;
+    DisparityWinners _winners;
+    cv::Mat _disparity16S;
+};
+
+
+// disparity of a reference frame from several frames taken along a rail at a constant step, such as the extra credit
+// scenes: a point at disparity d (per step) appears k*d pixels over in the frame k steps away, so the truncated
+// absolute differences to every neighbor are summed at their proportional disparities before one box filter and
+// winner-take-all. false matches of weak or repeating texture at one baseline rarely line up at the others
+// note: all frames must be rectified with the same (left) maps, which is exact for a camera that only slides along x.
+// each disparity's sum is accumulated in place in a single slice, and the disparities are streamed in parallel chunks
+// as in GuidedFilterMatcher, so memory does not grow with the number of views
+class MultiBaselineMatcher
+{
+public:
+    // note: disparities are per step; truncation caps each view's absolute difference (gray levels, at most 255)
+    MultiBaselineMatcher(int ndisparities = 16*8, int windowSize = 21, int truncation = 32, int nthreads = 0);
+
+    // offsets[i] is the position of neighbors[i] relative to the reference, in steps (positive: slid to the right, as
+    // the right image of a pair is); images may be color or grayscale; minVal and maxVal receive the raw disparity range
+    void compute(const cv::Mat &reference, const std::vector<cv::Mat> &neighbors, const std::vector<int> &offsets, cv::Mat &disparity8U,
+                 double *minVal = 0, double *maxVal = 0);
+
+    int ndisparities(void) const { return _ndisparities; }
+    int windowSize(void) const { return _windowSize; }
+    int truncation(void) const { return _truncation; }
+
+    // raw disparity per step (16ths of a pixel, -16 where no neighbor sees the pixel at its disparity) of the last compute
+    const cv::Mat &rawDisparity(void) const { return _disparity16S; }
+
+private:
+    void sliceCost(int d, cv::Mat &slice, std::vector<cv::Mat> &scratch) const;
+
+    int _ndisparities;
+    int _windowSize;
+    int _truncation;
+    int _nthreads;
+    cv::Mat _reference;
+    std::vector<cv::Mat> _neighbors;
+    std::vector<int> _offsets;
+    DisparityWinners _winners;
+    cv::Mat _disparity16S;
+};
+
+
+// fill the invalid (negative) pixels of a raw disparity, e.g. DisparityMatcher::rawDisparity, from the background
+// around them; filledMask (CV_8UC1) is 255 where a pixel was filled, so later steps can trust those pixels less
+// each invalid run along a row takes the smaller (farther) of the disparities at its ends, since holes are mostly
+// occluded or untextured background; rows with no valid pixel take the smaller of the nearest rows above and below.
+// the filled pixels are then replaced by the weighted median of their (2*radius + 1)^2 window, weighted by distance and
+// by similarity to the guide (the left image), which removes the streaks of scanline filling without blurring across
+// the guide's edges; measured pixels are never changed
+// returns the number of pixels filled
+// note: rows, and then the median's row blocks, are processed in parallel; the scans for invalid runs and the filling
+// use SSE2
+size_t fillDisparityHoles(const cv::Mat &disparity16S, const cv::Mat &guide, cv::Mat &filled16S, cv::Mat &filledMask, int radius = 3,
+                          int nthreads = 0);
+
+// accuracy of a raw disparity (16ths of a pixel, negative where invalid) against a ground truth disparity image such as
+// conesH/disp2.pgm, whose values are scale times the disparity (0 where unknown)
+// a pixel is bad where it is invalid or off by more than threshold pixels; edge pixels are those within 2 pixels of a
+// ground truth disparity jump of more than 2 pixels, where fixed matching windows do the most damage
+struct DisparityAccuracy
+{
+    size_t pixels;              // pixels with a known ground truth
+    double badFraction;
+    double invalidFraction;
+    size_t edgePixels;
+    double edgeBadFraction;
+    double meanError;           // mean absolute error of the valid pixels, in pixels
+};
+
+DisparityAccuracy evaluateDisparity(const cv::Mat &disparity16S, const cv::Mat &groundTruth, double scale = 4.0, double threshold = 1.0);
+
+// the simple disparity-to-depth matrix used for the cones images: Z = f*B/d
+// note: the defaults are the cones image center, an 800 pixel focal length and a 100 unit baseline
+cv::Mat simpleQ(double cx = 450.0, double cy = 375.0, double focalLength = 800.0, double baseline = 100.0);
+
+// Q for images cropped to roi: cropped pixel coordinates reproject to the same points as in the full image
+cv::Mat cropQ(const cv::Mat &Q, cv::Rect roi);
+
+// 3D coordinates (CV_32FC3) for every pixel of an 8 bit disparity image
+void reprojectDisparity(const cv::Mat &disparity8U, const cv::Mat &Q, cv::Mat &XYZ);
+
+// unit surface normals (CV_32FC3) of an organized point cloud: the least-variance direction of the valid points in the
+// (2*radius + 1)^2 window around each pixel, oriented towards the camera; NaN where the pixel is invalid or fewer than
+// minPoints of its window are valid
+// note: the window sums come from integral images of the points and of their outer products, so a normal costs the
+// same whatever the radius
+void estimateNormals(const cv::Mat &XYZ, int radius, cv::Mat &normals, int minPoints = 6, int nthreads = 0);
+
+// write the finite points of XYZ, colored from texture, in pts format: "x y z r g b" per line
+// with normals (CV_32FC3, e.g. from estimateNormals), "nx ny nz" is appended to each line (0 0 0 where there is none)
+// organized output keeps the image grid: a "# organized <width> <height>" line, then every pixel in row order, with
+// invalid pixels written as nan coordinates
+// returns the number of valid points written
+size_t writePointCloud(std::ostream &out, const cv::Mat &XYZ, const cv::Mat &texture, const cv::Mat &normals = cv::Mat(),
+                       bool organized = false);
+bool writePointCloud(const std::string &filename, const cv::Mat &XYZ, const cv::Mat &texture, size_t *npoints = 0,
+                     const cv::Mat &normals = cv::Mat(), bool organized = false);
+
+#endif // STEREO_HPP
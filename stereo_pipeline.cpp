@@ -0,0 +1,928 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <climits>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include "bounded_queue.hpp"
+#include "buffer_pool.hpp"
+#include "image_source.hpp"
+#include "parallel.hpp"
+#include "stereo.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+
+// for convenience
+using namespace std;
+
+
+// user defined types
+
+// everything one stereo pair needs on its way through the pipeline
+// note: the images are backed by a FrameBuffers, so they are only valid until that frame's buffers are released
+struct StereoFrame
+{
+    cv::Mat leftRectified;
+    cv::Mat rightRectified;
+    cv::Mat disparity8U;
+    cv::Mat XYZ;
+    size_t npoints;
+};
+
+// per stage times for one frame (in milliseconds)
+struct StageTimes
+{
+    double rectify;
+    double match;
+    double reproject;
+    double write;
+    double total(void) const { return rectify + match + reproject + write; }
+};
+
+
+// rectify -> match -> reproject -> write for one pair, entirely in memory except for the final points file
+// note: when rectification is null the images are assumed to be rectified already (e.g. the cones images); otherwise
+// everything after rectification works on the valid region only, and Q must be offset for it (see cropQ)
+void processPair(const StereoRectification *rectification, DisparityMatcher &matcher, const cv::Mat &Q,
+                 const cv::Mat &left, const cv::Mat &right, const string &outputFile, FrameBuffers &buffers, StereoFrame &frame, StageTimes &times)
+{
+    TRACE_SCOPE("process_pair");
+
+    // per frame images come from the pool, so a stream of frames allocates them only once
+    cv::Size size = rectification ? rectification->validROI.size() : left.size();
+    frame.disparity8U = buffers.mat(size, CV_8UC1);
+    frame.XYZ = buffers.mat(size, CV_32FC3);
+
+    Stopwatch stopwatch;
+    if (rectification)
+    {
+        frame.leftRectified = buffers.mat(size, left.type());
+        frame.rightRectified = buffers.mat(size, right.type());
+        rectifyPair(*rectification, left, right, frame.leftRectified, frame.rightRectified, true);
+    }
+    else
+    {
+        frame.leftRectified = left;
+        frame.rightRectified = right;
+    }
+    times.rectify = stopwatch.elapsedMs();
+
+    stopwatch.restart();
+    matcher.compute(frame.leftRectified, frame.rightRectified, frame.disparity8U);
+    times.match = stopwatch.elapsedMs();
+
+    stopwatch.restart();
+    reprojectDisparity(frame.disparity8U, Q, frame.XYZ);
+    times.reproject = stopwatch.elapsedMs();
+
+    stopwatch.restart();
+    frame.npoints = 0;
+    if (!outputFile.empty() && !writePointCloud(outputFile, frame.XYZ, frame.leftRectified, &frame.npoints))
+    {
+        cerr << "error: could not write \"" << outputFile << "\"" << endl;
+    }
+    times.write = stopwatch.elapsedMs();
+}
+
+
+// the same pair pushed through the separate tools' steps, passing PNG files between them the way
+// stereo_rectify_images, disparity_map and generate_point_cloud do when run by hand
+// note: each step starts from scratch like a new process would: camera data, rectification maps and the matcher are rebuilt every time
+bool processPairThroughFiles(const string &cameraDataFile, double baseline, const string &leftFile, const string &rightFile,
+                             const string &outputFile, cv::Mat &disparity8U, StageTimes &times)
+{
+    TRACE_SCOPE("process_pair_through_files");
+    // stereo_rectify_images
+    Stopwatch stopwatch;
+    cv::Mat left = cv::imread(leftFile, cv::IMREAD_COLOR);
+    cv::Mat right = cv::imread(rightFile, cv::IMREAD_COLOR);
+    if (left.empty() || right.empty())
+    {
+        return false;
+    }
+    string leftRectifiedFile = leftFile;
+    string rightRectifiedFile = rightFile;
+    cv::Mat Q = simpleQ();
+    if (!cameraDataFile.empty())
+    {
+        CameraData camera;
+        if (!loadCameraData(cameraDataFile, camera))
+        {
+            return false;
+        }
+        StereoRectification rectification;
+        computeRectification(camera, left.size(), baseline, rectification);
+        cv::Mat leftRectified, rightRectified;
+        rectifyPair(rectification, left, right, leftRectified, rightRectified, true);
+        leftRectifiedFile = "left_image_rectified.png";
+        rightRectifiedFile = "right_image_rectified.png";
+        cv::imwrite(leftRectifiedFile, leftRectified);
+        cv::imwrite(rightRectifiedFile, rightRectified);
+        saveRectification("rectification.xml", rectification);
+
+        // generate_point_cloud reads the valid region back from rectification.xml
+        cv::Size imageSize;
+        cv::Rect validROI;
+        loadValidROI("rectification.xml", imageSize, validROI);
+        Q = cropQ(Q, validROI);
+    }
+    times.rectify = stopwatch.elapsedMs();
+
+    // disparity_map
+    stopwatch.restart();
+    cv::Mat leftGray = cv::imread(leftRectifiedFile, cv::IMREAD_GRAYSCALE);
+    cv::Mat rightGray = cv::imread(rightRectifiedFile, cv::IMREAD_GRAYSCALE);
+    DisparityMatcher matcher;
+    matcher.compute(leftGray, rightGray, disparity8U);
+    cv::imwrite("disparity_image.png", disparity8U);
+    times.match = stopwatch.elapsedMs();
+
+    // generate_point_cloud
+    stopwatch.restart();
+    cv::Mat disparityImage = cv::imread("disparity_image.png", cv::IMREAD_GRAYSCALE);
+    cv::Mat textureImage = cv::imread(leftRectifiedFile, cv::IMREAD_COLOR);
+    cv::Mat XYZ;
+    reprojectDisparity(disparityImage, Q, XYZ);
+    times.reproject = stopwatch.elapsedMs();
+
+    stopwatch.restart();
+    bool written = outputFile.empty() || writePointCloud(outputFile, XYZ, textureImage);
+    times.write = stopwatch.elapsedMs();
+    return written;
+}
+
+
+// how far a disparity image is from a reference one
+struct DisparityDrift
+{
+    double meanError;       // mean absolute difference (pixels) where both are valid
+    double badFraction;     // of the pixels valid in both, those more than one pixel apart
+    double lostFraction;    // of the pixels valid in the reference, those invalid in the other
+};
+
+
+DisparityDrift compareDisparities(const cv::Mat &disparity16S, const cv::Mat &reference16S)
+{
+    double sumError = 0.0;
+    size_t nboth = 0, nbad = 0, nreference = 0, nlost = 0;
+    for (int row_i = 0; row_i < reference16S.rows; row_i++)
+    {
+        const short *disparity_p = disparity16S.ptr<short>(row_i);
+        const short *reference_p = reference16S.ptr<short>(row_i);
+        for (int col_i = 0; col_i < reference16S.cols; col_i++)
+        {
+            if (reference_p[col_i] < 0)
+            {
+                continue;
+            }
+            nreference++;
+            if (disparity_p[col_i] < 0)
+            {
+                nlost++;
+                continue;
+            }
+            double error = abs(disparity_p[col_i] - reference_p[col_i])/16.0;
+            sumError += error;
+            nbad += error > 1.0;
+            nboth++;
+        }
+    }
+    DisparityDrift drift;
+    drift.meanError = nboth ? sumError/nboth : 0.0;
+    drift.badFraction = nboth ? static_cast<double>(nbad)/nboth : 0.0;
+    drift.lostFraction = nreference ? static_cast<double>(nlost)/nreference : 0.0;
+    return drift;
+}
+
+
+// match every pair both over the full range and with the temporal prior, and report the time saved and how far the
+// temporal result drifts from the full search along the sequence
+// note: the prior starts over with each repetition, since the last pair of a sequence does not lead into its first
+void compareTemporal(const StereoRectification *rectification, const vector<cv::Mat> &images, int repeat, int band,
+                     TemporalDisparityMatcher::Warp warp, int refreshInterval)
+{
+    TRACE_SCOPE("compare_temporal");
+    DisparityMatcher fullMatcher;
+    TemporalDisparityMatcher temporalMatcher(fullMatcher.ndisparities(), fullMatcher.SADWindowSize(), band, warp, refreshInterval);
+    cv::Mat leftRectified, rightRectified, disparity8U;
+    vector<double> fullMs, temporalMs;
+    double sumError = 0.0, sumSearchRange = 0.0;
+    cout << "temporal matching (band +-" << band << " pixels, " << (warp == TemporalDisparityMatcher::WARP_RAIL ? "rail" : "no")
+         << " warp, " << (refreshInterval > 0 ? "full search every " : "no full refresh");
+    if (refreshInterval > 0)
+    {
+        cout << refreshInterval << " frames";
+    }
+    cout << "):" << endl;
+    for (int repeat_i = 0; repeat_i < repeat; repeat_i++)
+    {
+        temporalMatcher.reset();
+        for (size_t pair_i = 0; pair_i + 1 < images.size(); pair_i++)
+        {
+            const cv::Mat *left = &images[pair_i];
+            const cv::Mat *right = &images[pair_i + 1];
+            if (rectification)
+            {
+                rectifyPair(*rectification, *left, *right, leftRectified, rightRectified, true);
+                left = &leftRectified;
+                right = &rightRectified;
+            }
+
+            Stopwatch stopwatch;
+            fullMatcher.compute(*left, *right, disparity8U);
+            fullMs.push_back(stopwatch.elapsedMs());
+            stopwatch.restart();
+            temporalMatcher.compute(*left, *right, disparity8U);
+            temporalMs.push_back(stopwatch.elapsedMs());
+
+            DisparityDrift drift = compareDisparities(temporalMatcher.rawDisparity(), fullMatcher.rawDisparity());
+            sumError += drift.meanError;
+            sumSearchRange += temporalMatcher.meanSearchRange();
+            if (repeat_i == 0)
+            {
+                cout << "  frame " << setw(4) << pair_i << ": full " << setw(9) << fullMs.back() << " ms, temporal " << setw(9) << temporalMs.back()
+                     << " ms (" << setw(6) << 100.0*(1.0 - temporalMs.back()/fullMs.back()) << "% less), " << setw(6) << temporalMatcher.meanSearchRange()
+                     << " disparities/pixel, " << setw(6) << 100.0*temporalMatcher.fullSearchFraction() << "% full range; drift "
+                     << drift.meanError << " px mean, " << 100.0*drift.badFraction << "% > 1 px, " << 100.0*drift.lostFraction << "% lost" << endl;
+            }
+        }
+    }
+    TimingSummary full = summarizeTimings(fullMs);
+    TimingSummary temporal = summarizeTimings(temporalMs);
+    cout << "full search: mean " << full.mean << " ms, p90 " << full.p90 << " ms; temporal: mean " << temporal.mean << " ms, p90 "
+         << temporal.p90 << " ms (" << 100.0*(1.0 - temporal.mean/full.mean) << "% less latency)" << endl;
+    cout << "mean search range " << sumSearchRange/temporalMs.size() << " of " << fullMatcher.ndisparities()
+         << " disparities; mean drift from the full search " << sumError/temporalMs.size() << " px" << endl;
+}
+
+
+// match each frame against up to views neighbors on either side at once, and against each of them separately (what
+// matching every pair and fusing the results costs, before any fusing), and report the time and how often the separate
+// pairs disagree, which is the ambiguity the summed cost resolves
+// note: every frame is rectified once, with the left maps; for a camera sliding along x the maps of every pair are the same
+void compareMultiBaseline(const StereoRectification *rectification, const vector<cv::Mat> &images, int repeat, int views)
+{
+    TRACE_SCOPE("compare_multi_baseline");
+    vector<cv::Mat> rectified(images.size());
+    for (size_t image_i = 0; image_i < images.size(); image_i++)
+    {
+        if (rectification)
+        {
+            const cv::Rect &roi = rectification->validROI;
+            cv::remap(images[image_i], rectified[image_i], rectification->leftXMap(roi), rectification->leftYMap(roi), cv::INTER_LINEAR);
+        }
+        else
+        {
+            rectified[image_i] = images[image_i];
+        }
+    }
+
+    DisparityMatcher pairMatcher;
+    MultiBaselineMatcher matcher(pairMatcher.ndisparities(), pairMatcher.SADWindowSize());
+    cv::Mat disparity8U;
+    vector<double> jointMs, separateMs;
+    double sumAmbiguous = 0.0;
+    cout << "multi-baseline matching (up to " << views << " neighbors on either side, " << matcher.ndisparities() << " disparities per step):" << endl;
+    for (int repeat_i = 0; repeat_i < repeat; repeat_i++)
+    {
+        for (size_t frame_i = 0; frame_i < rectified.size(); frame_i++)
+        {
+            vector<cv::Mat> neighbors;
+            vector<int> offsets;
+            for (int offset = -views; offset <= views; offset++)
+            {
+                long neighbor_i = static_cast<long>(frame_i) + offset;
+                if (offset != 0 && neighbor_i >= 0 && neighbor_i < static_cast<long>(rectified.size()))
+                {
+                    neighbors.push_back(rectified[neighbor_i]);
+                    offsets.push_back(offset);
+                }
+            }
+
+            Stopwatch stopwatch;
+            matcher.compute(rectified[frame_i], neighbors, offsets, disparity8U);
+            jointMs.push_back(stopwatch.elapsedMs());
+
+            // each neighbor on its own; a pixel is ambiguous where the valid pair results span more than a pixel per step
+            cv::Mat low(rectified[frame_i].size(), CV_16S, cv::Scalar(SHRT_MAX)), high(rectified[frame_i].size(), CV_16S, cv::Scalar(-1));
+            double pairMs = 0.0;
+            for (size_t neighbor_i = 0; neighbor_i < neighbors.size(); neighbor_i++)
+            {
+                stopwatch.restart();
+                matcher.compute(rectified[frame_i], vector<cv::Mat>(1, neighbors[neighbor_i]), vector<int>(1, offsets[neighbor_i]), disparity8U);
+                pairMs += stopwatch.elapsedMs();
+                const cv::Mat &pair16S = matcher.rawDisparity();
+                for (int row_i = 0; row_i < pair16S.rows; row_i++)
+                {
+                    const short *pair_p = pair16S.ptr<short>(row_i);
+                    short *low_p = low.ptr<short>(row_i);
+                    short *high_p = high.ptr<short>(row_i);
+                    for (int col_i = 0; col_i < pair16S.cols; col_i++)
+                    {
+                        if (pair_p[col_i] >= 0)
+                        {
+                            low_p[col_i] = min(low_p[col_i], pair_p[col_i]);
+                            high_p[col_i] = max(high_p[col_i], pair_p[col_i]);
+                        }
+                    }
+                }
+            }
+            separateMs.push_back(pairMs);
+            size_t nambiguous = 0;
+            for (int row_i = 0; row_i < low.rows; row_i++)
+            {
+                const short *low_p = low.ptr<short>(row_i);
+                const short *high_p = high.ptr<short>(row_i);
+                for (int col_i = 0; col_i < low.cols; col_i++)
+                {
+                    nambiguous += high_p[col_i] >= 0 && high_p[col_i] - low_p[col_i] > 16;
+                }
+            }
+            double ambiguous = static_cast<double>(nambiguous)/low.total();
+            sumAmbiguous += ambiguous;
+            if (repeat_i == 0)
+            {
+                cout << "  frame " << setw(4) << frame_i << ": " << neighbors.size() << " neighbors, summed " << setw(9) << jointMs.back()
+                     << " ms, separately " << setw(9) << separateMs.back() << " ms; pairs disagree on " << setw(6) << 100.0*ambiguous
+                     << "% of pixels" << endl;
+            }
+        }
+    }
+    TimingSummary joint = summarizeTimings(jointMs);
+    TimingSummary separate = summarizeTimings(separateMs);
+    cout << "summed: mean " << joint.mean << " ms, p90 " << joint.p90 << " ms; every pair separately: mean " << separate.mean << " ms, p90 "
+         << separate.p90 << " ms (" << 100.0*(1.0 - joint.mean/separate.mean) << "% less); the pairs disagree on "
+         << 100.0*sumAmbiguous/jointMs.size() << "% of pixels on average" << endl;
+}
+
+
+// a frame travelling through the streaming pipeline; its images are released to the pool when the last stage drops it
+struct StreamFrame
+{
+    size_t index;
+    FrameBuffers buffers;
+    cv::Mat left;
+    cv::Mat right;
+    cv::Mat leftRectified;
+    cv::Mat rightRectified;
+    cv::Mat disparity8U;
+    cv::Mat XYZ;
+    Stopwatch age;      // started when decoding begins, for the end-to-end latency
+    StreamFrame(BufferPool &pool, size_t index): index(index), buffers(pool){}
+};
+typedef shared_ptr<StreamFrame> StreamFramePtr;
+
+// what one pipeline stage measured: time spent per frame and the depth of its output queue after each push
+struct StageStats
+{
+    vector<double> latencies;
+    vector<double> queueDepths;
+};
+
+
+// pull frames from in, process them and push them to out (if any) until in is closed and drained
+template <typename Process>
+void runStage(const char *name, BoundedQueue<StreamFramePtr> &in, BoundedQueue<StreamFramePtr> *out, StageStats &stats, Process process)
+{
+    trace::setThreadName(name);
+    StreamFramePtr frame;
+    while (in.pop(frame))
+    {
+        Stopwatch stopwatch;
+        process(*frame);
+        stats.latencies.push_back(stopwatch.elapsedMs());
+        if (out)
+        {
+            if (!out->push(frame))
+            {
+                break;
+            }
+            stats.queueDepths.push_back(static_cast<double>(out->size()));
+        }
+        frame.reset();
+    }
+    if (out)
+    {
+        out->close();
+    }
+}
+
+
+// depth from a stereo video: two synchronized files (rightVideo not empty) or one side-by-side file
+// note: decode, rectify, match and reproject (+ write) run on their own threads joined by bounded queues, so the
+// frame rate is set by the slowest stage rather than the sum of the stages
+// note: with temporalBand > 0 each frame searches only around the previous frame's disparities (see TemporalDisparityMatcher)
+int runVideo(const string &cameraDataFile, double baseline, const string &leftVideo, const string &rightVideo, const string &outputPrefix, size_t queueCapacity,
+             int temporalBand, int refreshInterval)
+{
+    cv::VideoCapture leftCapture(leftVideo);
+    cv::VideoCapture rightCapture;
+    if (!leftCapture.isOpened())
+    {
+        cerr << "error: could not open video \"" << leftVideo << "\"; exiting..." << endl;
+        return 1;
+    }
+    if (!rightVideo.empty())
+    {
+        rightCapture.open(rightVideo);
+        if (!rightCapture.isOpened())
+        {
+            cerr << "error: could not open video \"" << rightVideo << "\"; exiting..." << endl;
+            return 1;
+        }
+    }
+
+    // the first frame gives the image size for the rectification maps; it is kept and decoded as frame 0 rather than
+    // rewinding, since many backends seek inexactly (or not at all) and would leave the two streams out of step
+    cv::Mat first;
+    if (!leftCapture.read(first) || first.empty())
+    {
+        cerr << "error: no frames in video \"" << leftVideo << "\"; exiting..." << endl;
+        return 1;
+    }
+    cv::Size imageSize = rightVideo.empty() ? cv::Size(first.cols/2, first.rows) : first.size();
+
+    StereoRectification rectification;
+    if (!cameraDataFile.empty())
+    {
+        CameraData camera;
+        if (!loadCameraData(cameraDataFile, camera))
+        {
+            cerr << "error: could not open the camera data file: \"" << cameraDataFile << "\"; exiting..." << endl;
+            return 1;
+        }
+        computeRectification(camera, imageSize, baseline, rectification);
+    }
+    // note: with rectification, everything after it works on the valid region only
+    cv::Size validSize = cameraDataFile.empty() ? imageSize : rectification.validROI.size();
+    DisparityMatcher matcher;
+    TemporalDisparityMatcher temporalMatcher(matcher.ndisparities(), matcher.SADWindowSize(), temporalBand,
+                                             TemporalDisparityMatcher::WARP_NONE, refreshInterval);
+    vector<double> searchRanges;
+    cv::Mat Q = cameraDataFile.empty() ? simpleQ() : cropQ(simpleQ(), rectification.validROI);
+    BufferPool pool;
+
+    BoundedQueue<StreamFramePtr> decoded(queueCapacity), rectified(queueCapacity), matched(queueCapacity);
+    StageStats decodeStats, rectifyStats, matchStats, reprojectStats;
+    vector<double> endToEnd;
+    size_t npoints = 0;
+
+    Stopwatch wallClock;
+
+    // decode: reads straight into pooled buffers whenever the decoder's output matches their size and type
+    thread decodeThread([&]()
+    {
+        trace::setThreadName("decode");
+        for (size_t frame_i = 0; ; frame_i++)
+        {
+            StreamFramePtr frame(new StreamFrame(pool, frame_i));
+            Stopwatch stopwatch;
+            bool ok;
+            {
+                TRACE_SCOPE("decode_frame");
+                if (rightVideo.empty())
+                {
+                    cv::Mat sideBySide = frame->buffers.mat(imageSize.height, imageSize.width*2, CV_8UC3);
+                    if (frame_i == 0)
+                    {
+                        sideBySide = first;
+                    }
+                    ok = (frame_i == 0 || leftCapture.read(sideBySide)) && sideBySide.cols == imageSize.width*2 && sideBySide.rows == imageSize.height;
+                    if (ok)
+                    {
+                        frame->left = sideBySide(cv::Rect(0, 0, imageSize.width, imageSize.height));
+                        frame->right = sideBySide(cv::Rect(imageSize.width, 0, imageSize.width, imageSize.height));
+                    }
+                }
+                else
+                {
+                    frame->left = frame_i == 0 ? first : frame->buffers.mat(imageSize, CV_8UC3);
+                    frame->right = frame->buffers.mat(imageSize, CV_8UC3);
+                    ok = (frame_i == 0 || leftCapture.read(frame->left)) && rightCapture.read(frame->right) &&
+                         frame->left.size() == imageSize && frame->right.size() == imageSize;
+                }
+            }
+            if (!ok)
+            {
+                break;
+            }
+            decodeStats.latencies.push_back(stopwatch.elapsedMs());
+            if (!decoded.push(frame))
+            {
+                break;
+            }
+            decodeStats.queueDepths.push_back(static_cast<double>(decoded.size()));
+        }
+        decoded.close();
+    });
+
+    thread rectifyThread([&]()
+    {
+        runStage("rectify", decoded, &rectified, rectifyStats, [&](StreamFrame &frame)
+        {
+            if (cameraDataFile.empty())
+            {
+                frame.leftRectified = frame.left;
+                frame.rightRectified = frame.right;
+                return;
+            }
+            frame.leftRectified = frame.buffers.mat(validSize, CV_8UC3);
+            frame.rightRectified = frame.buffers.mat(validSize, CV_8UC3);
+            rectifyPair(rectification, frame.left, frame.right, frame.leftRectified, frame.rightRectified, true);
+        });
+    });
+
+    thread matchThread([&]()
+    {
+        runStage("match", rectified, &matched, matchStats, [&](StreamFrame &frame)
+        {
+            frame.disparity8U = frame.buffers.mat(validSize, CV_8UC1);
+            if (temporalBand > 0)
+            {
+                temporalMatcher.compute(frame.leftRectified, frame.rightRectified, frame.disparity8U);
+                searchRanges.push_back(temporalMatcher.meanSearchRange());
+                return;
+            }
+            matcher.compute(frame.leftRectified, frame.rightRectified, frame.disparity8U);
+        });
+    });
+
+    // reproject (and write) on the main thread
+    runStage("reproject", matched, 0, reprojectStats, [&](StreamFrame &frame)
+    {
+        frame.XYZ = frame.buffers.mat(validSize, CV_32FC3);
+        reprojectDisparity(frame.disparity8U, Q, frame.XYZ);
+        if (!outputPrefix.empty())
+        {
+            stringstream filename;
+            filename << outputPrefix << setw(5) << setfill('0') << frame.index << ".pts";
+            size_t n = 0;
+            writePointCloud(filename.str(), frame.XYZ, frame.leftRectified, &n);
+            npoints += n;
+        }
+        endToEnd.push_back(frame.age.elapsedMs());
+    });
+
+    decodeThread.join();
+    rectifyThread.join();
+    matchThread.join();
+    double wallMs = wallClock.elapsedMs();
+
+    // report
+    size_t nframes = endToEnd.size();
+    if (nframes == 0)
+    {
+        cerr << "error: no stereo frames could be decoded; exiting..." << endl;
+        return 1;
+    }
+    cout.setf(ios_base::fixed);
+    cout.precision(3);
+    cout << nframes << " frames of " << imageSize.width << "x" << imageSize.height << " (" << validSize.width << "x" << validSize.height
+         << " valid) in " << wallMs << " ms: "
+         << nframes/(wallMs*1e-3) << " frames/s" << endl;
+    cout << "stage latency (ms) and output queue depth (capacity " << queueCapacity << "):" << endl;
+    const char *names[] = {"decode", "rectify", "match", "reproject"};
+    StageStats *stats[] = {&decodeStats, &rectifyStats, &matchStats, &reprojectStats};
+    for (int stage_i = 0; stage_i < 4; stage_i++)
+    {
+        TimingSummary latency = summarizeTimings(stats[stage_i]->latencies);
+        TimingSummary depth = summarizeTimings(stats[stage_i]->queueDepths);
+        cout << "  " << setw(10) << left << names[stage_i] << right << " mean " << setw(9) << latency.mean << ", p90 " << setw(9) << latency.p90
+             << ", max " << setw(9) << latency.max;
+        if (!stats[stage_i]->queueDepths.empty())
+        {
+            cout << "; queue depth mean " << setprecision(2) << depth.mean << ", max " << setprecision(0) << depth.max << setprecision(3);
+        }
+        cout << endl;
+    }
+    TimingSummary latency = summarizeTimings(endToEnd);
+    cout << "end-to-end latency (ms): mean " << latency.mean << ", p90 " << latency.p90 << ", max " << latency.max << endl;
+    if (temporalBand > 0)
+    {
+        TimingSummary range = summarizeTimings(searchRanges);
+        cout << "temporal matching: mean search range " << range.mean << " of " << matcher.ndisparities() << " disparities (max " << range.max << ")" << endl;
+    }
+    if (!outputPrefix.empty())
+    {
+        cout << npoints << " points written" << endl;
+    }
+    BufferPoolStats poolStats = pool.stats();
+    cout << "buffer pool: " << poolStats.allocations << " buffers allocated, " << poolStats.reuses << " allocations avoided, peak "
+         << poolStats.peakPooledBytes/(1024.0*1024.0) << " MiB pooled" << endl;
+    return 0;
+}
+
+
+// write consecutive image pairs side by side into a video, e.g. to test --sbs with the extra credit scenes
+int writeSideBySideVideo(const vector<cv::Mat> &images, const string &filename, int repeat)
+{
+    cv::Size size(images[0].cols*2, images[0].rows);
+    cv::VideoWriter writer(filename, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 10.0, size);
+    if (!writer.isOpened())
+    {
+        cerr << "error: couldn't open video \"" << filename << "\" for output" << endl;
+        return 1;
+    }
+    cv::Mat sideBySide;
+    size_t nframes = 0;
+    for (int repeat_i = 0; repeat_i < repeat; repeat_i++)
+    {
+        for (size_t pair_i = 0; pair_i + 1 < images.size(); pair_i++)
+        {
+            cv::hconcat(images[pair_i], images[pair_i + 1], sideBySide);
+            writer.write(sideBySide);
+            nframes++;
+        }
+    }
+    cout << nframes << " side-by-side frames written to " << filename << endl;
+    return 0;
+}
+
+
+void printStage(const string &name, const vector<double> &samples)
+{
+    TimingSummary summary = summarizeTimings(samples);
+    cout << "  " << setw(10) << left << name << right << " mean " << setw(9) << summary.mean << ", p50 " << setw(9) << summary.p50
+         << ", p90 " << setw(9) << summary.p90 << ", max " << setw(9) << summary.max << endl;
+}
+
+
+void printStages(const vector<StageTimes> &times)
+{
+    vector<double> rectify, match, reproject, write, total;
+    for (size_t time_i = 0; time_i < times.size(); time_i++)
+    {
+        rectify.push_back(times[time_i].rectify);
+        match.push_back(times[time_i].match);
+        reproject.push_back(times[time_i].reproject);
+        write.push_back(times[time_i].write);
+        total.push_back(times[time_i].total());
+    }
+    printStage("rectify", rectify);
+    printStage("match", match);
+    printStage("reproject", reproject);
+    printStage("write", write);
+    printStage("total", total);
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cerr << "Usage: stereo_pipeline <camera_data_file | -> <image_0> <image_1> [<image_2> ...] [--baseline <distance>] [--repeat <n>] [--output <pts_prefix>] [--no-write] [--compare-files] [--make-sbs <video_file>]" << endl;
+        cerr << "                       [--temporal <band> [--warp rail|none] [--refresh <n>]] [--multi-baseline <views>]" << endl;
+        cerr << "       stereo_pipeline <camera_data_file | -> (--video <left_video> <right_video> | --sbs <side_by_side_video>) [--baseline <distance>] [--queue <n>] [--output <pts_prefix>]" << endl;
+        cerr << "                       [--temporal <band> [--refresh <n>]]" << endl;
+        cerr << "each consecutive pair of images is a left/right stereo pair (e.g. a rail sequence); use - in place of the camera data file for images that are already rectified" << endl;
+        cerr << "video input is processed as a stream of concurrent stages; points are only written if --output is given" << endl;
+        cerr << "--temporal matches each frame only within <band> pixels of the previous frame's disparities (warped along the rail for image sequences);" << endl;
+        cerr << "for image sequences it also reports the latency saved and the drift from a full search" << endl;
+        cerr << "--multi-baseline matches each image of a rail sequence against up to <views> images on either side at once, at disparities" << endl;
+        cerr << "proportional to their distance along the rail, and compares that with matching each of those pairs separately" << endl;
+        return 1;
+    }
+
+    // parse options
+    string cameraDataFile = argv[1];
+    if (cameraDataFile == "-")
+    {
+        cameraDataFile.clear();
+    }
+    vector<string> imageFiles;
+    double baseline = 10.0;
+    int repeat = 1;
+    string outputPrefix = "point_cloud_";
+    bool outputGiven = false;
+    bool compareFiles = false;
+    string leftVideo, rightVideo, sideBySideVideo, makeSideBySide;
+    size_t queueCapacity = 4;
+    int temporalBand = 0;
+    TemporalDisparityMatcher::Warp warp = TemporalDisparityMatcher::WARP_RAIL;
+    int refreshInterval = 0;
+    int multiBaselineViews = 0;
+    for (int arg_i = 2; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        if (arg == "--baseline" && arg_i + 1 < argc)
+        {
+            baseline = atof(argv[++arg_i]);
+        }
+        else if (arg == "--repeat" && arg_i + 1 < argc)
+        {
+            repeat = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--output" && arg_i + 1 < argc)
+        {
+            outputPrefix = argv[++arg_i];
+            outputGiven = true;
+        }
+        else if (arg == "--no-write")
+        {
+            outputPrefix.clear();
+        }
+        else if (arg == "--compare-files")
+        {
+            compareFiles = true;
+        }
+        else if (arg == "--video" && arg_i + 2 < argc)
+        {
+            leftVideo = argv[++arg_i];
+            rightVideo = argv[++arg_i];
+        }
+        else if (arg == "--sbs" && arg_i + 1 < argc)
+        {
+            sideBySideVideo = argv[++arg_i];
+        }
+        else if (arg == "--queue" && arg_i + 1 < argc)
+        {
+            queueCapacity = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--make-sbs" && arg_i + 1 < argc)
+        {
+            makeSideBySide = argv[++arg_i];
+        }
+        else if (arg == "--temporal" && arg_i + 1 < argc)
+        {
+            temporalBand = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--warp" && arg_i + 1 < argc)
+        {
+            warp = string(argv[++arg_i]) == "none" ? TemporalDisparityMatcher::WARP_NONE : TemporalDisparityMatcher::WARP_RAIL;
+        }
+        else if (arg == "--refresh" && arg_i + 1 < argc)
+        {
+            refreshInterval = max(0, atoi(argv[++arg_i]));
+        }
+        else if (arg == "--multi-baseline" && arg_i + 1 < argc)
+        {
+            multiBaselineViews = max(1, atoi(argv[++arg_i]));
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            cerr << "error: unrecognized option \"" << arg << "\"" << endl;
+            return 1;
+        }
+        else
+        {
+            imageFiles.push_back(arg);
+        }
+    }
+    if (!leftVideo.empty() || !sideBySideVideo.empty())
+    {
+        return runVideo(cameraDataFile, baseline, leftVideo.empty() ? sideBySideVideo : leftVideo, rightVideo,
+                        outputGiven ? outputPrefix : "", queueCapacity, temporalBand, refreshInterval);
+    }
+    if (imageFiles.size() < 2)
+    {
+        cerr << "error: at least two images are needed; exiting..." << endl;
+        return 1;
+    }
+
+    // decode all images up front (on every core) so that the timings cover only the pipeline itself
+    Stopwatch stopwatch;
+    vector<cv::Mat> images;
+    ImageSource source(imageFiles, cv::IMREAD_COLOR, defaultThreadCount());
+    SourceImage decoded;
+    for (size_t image_i = 0; source.next(decoded); image_i++)
+    {
+        images.push_back(decoded.image);
+        if (images.back().empty())
+        {
+            cerr << "error: no image data for image \"" << imageFiles[image_i] << "\"; exiting..." << endl;
+            return 1;
+        }
+        if (images.back().size() != images[0].size())
+        {
+            cerr << "error: all images must have the same size; exiting..." << endl;
+            return 1;
+        }
+    }
+    cout << images.size() << " images loaded in " << stopwatch.elapsedMs() << " ms" << endl;
+    if (!makeSideBySide.empty())
+    {
+        return writeSideBySideVideo(images, makeSideBySide, repeat);
+    }
+
+    // one time setup: rectification maps, matcher and Q are shared by every frame
+    stopwatch.restart();
+    StereoRectification rectification;
+    if (!cameraDataFile.empty())
+    {
+        CameraData camera;
+        if (!loadCameraData(cameraDataFile, camera))
+        {
+            cerr << "error: could not open the camera data file: \"" << cameraDataFile << "\"; exiting..." << endl;
+            return 1;
+        }
+        computeRectification(camera, images[0].size(), baseline, rectification);
+    }
+    DisparityMatcher matcher;
+    cv::Mat Q = cameraDataFile.empty() ? simpleQ() : cropQ(simpleQ(), rectification.validROI);
+    double setupMs = stopwatch.elapsedMs();
+    if (!cameraDataFile.empty())
+    {
+        const cv::Rect &roi = rectification.validROI;
+        cout << "valid region: " << roi.width << "x" << roi.height << " at (" << roi.x << ", " << roi.y << "), "
+             << 100.0*roi.area()/images[0].size().area() << "% of the image" << endl;
+    }
+
+    // run the in-memory pipeline
+    cout.setf(ios_base::fixed);
+    cout.precision(3);
+    size_t npairs = images.size() - 1;
+    BufferPool pool;
+    StereoFrame frame;
+    vector<StageTimes> times;
+    vector<cv::Mat> disparities(npairs);
+    stopwatch.restart();
+    for (int repeat_i = 0; repeat_i < repeat; repeat_i++)
+    {
+        for (size_t pair_i = 0; pair_i < npairs; pair_i++)
+        {
+            string outputFile;
+            if (!outputPrefix.empty())
+            {
+                stringstream filename;
+                filename << outputPrefix << setw(5) << setfill('0') << pair_i << ".pts";
+                outputFile = filename.str();
+            }
+            StageTimes frameTimes;
+            FrameBuffers buffers(pool);
+            processPair(cameraDataFile.empty() ? 0 : &rectification, matcher, Q, images[pair_i], images[pair_i + 1], outputFile, buffers, frame, frameTimes);
+            times.push_back(frameTimes);
+            if (repeat_i == 0)
+            {
+                frame.disparity8U.copyTo(disparities[pair_i]);
+                cout << (outputFile.empty() ? imageFiles[pair_i] : outputFile) << ": " << frame.npoints << " points, "
+                     << frameTimes.total() << " ms" << endl;
+            }
+        }
+    }
+    double pipelineMs = stopwatch.elapsedMs();
+
+    cout << "setup: " << setupMs << " ms" << endl;
+    cout << "in-memory stage times (ms) over " << times.size() << " frames:" << endl;
+    printStages(times);
+    cout << "in-memory throughput: " << times.size()/(pipelineMs*1e-3) << " frames/s" << endl;
+    BufferPoolStats poolStats = pool.stats();
+    cout << "buffer pool: " << poolStats.allocations << " buffers allocated, " << poolStats.reuses << " allocations avoided, peak "
+         << poolStats.peakPooledBytes/(1024.0*1024.0) << " MiB pooled" << endl;
+
+    if (temporalBand > 0)
+    {
+        compareTemporal(cameraDataFile.empty() ? 0 : &rectification, images, repeat, temporalBand, warp, refreshInterval);
+    }
+    if (multiBaselineViews > 0)
+    {
+        compareMultiBaseline(cameraDataFile.empty() ? 0 : &rectification, images, repeat, multiBaselineViews);
+    }
+
+    // run the same pairs through the file based workflow
+    if (compareFiles)
+    {
+        vector<StageTimes> fileTimes;
+        size_t ndifferent = 0;
+        stopwatch.restart();
+        for (int repeat_i = 0; repeat_i < repeat; repeat_i++)
+        {
+            for (size_t pair_i = 0; pair_i < npairs; pair_i++)
+            {
+                cv::Mat disparity8U;
+                StageTimes frameTimes;
+                if (!processPairThroughFiles(cameraDataFile, baseline, imageFiles[pair_i], imageFiles[pair_i + 1],
+                                             outputPrefix.empty() ? "" : "point_cloud.pts", disparity8U, frameTimes))
+                {
+                    cerr << "error: file based workflow failed for \"" << imageFiles[pair_i] << "\"; exiting..." << endl;
+                    return 1;
+                }
+                fileTimes.push_back(frameTimes);
+                if (repeat_i == 0 && cv::countNonZero(disparity8U != disparities[pair_i]) > 0)
+                {
+                    ndifferent++;
+                }
+            }
+        }
+        double filesMs = stopwatch.elapsedMs();
+
+        cout << "file based stage times (ms) over " << fileTimes.size() << " frames:" << endl;
+        printStages(fileTimes);
+        cout << "file based throughput: " << fileTimes.size()/(filesMs*1e-3) << " frames/s" << endl;
+        cout << "speedup: " << filesMs/pipelineMs << "x" << endl;
+        cout << "disparity images that differ from the file based workflow: " << ndifferent << " of " << npairs << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,296 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "image_source.hpp"
+#include "stereo.hpp"
+#include "structured_light.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+using namespace cv;
+using namespace std;
+
+
+// the file holding the camera image of pattern (or inverse) bit_i: <prefix><bit_i, 2 digits>[_inverse].png
+string captureFilename(const string &prefix, int bit_i, bool inverse)
+{
+    stringstream filename;
+    filename << prefix << setw(2) << setfill('0') << bit_i << (inverse ? "_inverse" : "") << ".png";
+    return filename.str();
+}
+
+
+// ray/sphere intersection: the nearest t > 0 with |origin + t*direction - center| = radius, or -1
+double intersectSphere(const Vec3d &origin, const Vec3d &direction, const Vec3d &center, double radius)
+{
+    Vec3d offset = origin - center;
+    double a = direction.dot(direction);
+    double b = 2.0*direction.dot(offset);
+    double c = offset.dot(offset) - radius*radius;
+    double discriminant = b*b - 4.0*a*c;
+    if (discriminant < 0.0)
+    {
+        return -1.0;
+    }
+    double t = (-b - sqrt(discriminant))/(2.0*a);
+    return t > 0.0 ? t : -1.0;
+}
+
+
+// camera images of the Gray-code patterns projected onto a synthetic scene, plus the true disparity (0 where the
+// projector does not light the surface)
+// the scene is untextured, the case passive stereo fails on: a tilted back wall and a sphere in front of it, which
+// casts a projector shadow on the wall; the projector is rectified with the camera and baseline to its right
+void renderSyntheticCaptures(Size size, double focalLength, double baseline, vector<Mat> &captures, Mat &trueDisparity)
+{
+    TRACE_SCOPE("render_synthetic_captures");
+    const int projectorWidth = size.width;
+    vector<Mat> patterns;
+    makeGrayCodePatterns(projectorWidth, 1, patterns);
+
+    const double cx = size.width/2.0, cy = size.height/2.0;
+    const Vec3d projector(baseline, 0.0, 0.0);
+    const Vec3d sphereCenter(0.0, 50.0, 1400.0);
+    const double sphereRadius = 300.0;
+    const double ambient = 20.0, brightness = 200.0, noiseSigma = 3.0;
+
+    // the projector column and albedo seen by each camera pixel (column < 0 where the projector does not reach)
+    Mat projectorColumn(size, CV_32F), albedo(size, CV_32F);
+    trueDisparity = Mat::zeros(size, CV_32F);
+    for (int row_i = 0; row_i < size.height; row_i++)
+    {
+        for (int col_i = 0; col_i < size.width; col_i++)
+        {
+            Vec3d direction((col_i + 0.5 - cx)/focalLength, (row_i + 0.5 - cy)/focalLength, 1.0);
+            double Z = intersectSphere(Vec3d(0.0, 0.0, 0.0), direction, sphereCenter, sphereRadius);
+            bool onSphere = Z > 0.0;
+            if (!onSphere)
+            {
+                // back wall Z = 2000 + 0.25*X
+                Z = 2000.0/(1.0 - 0.25*direction[0]);
+            }
+            Vec3d point = direction*Z;
+            double column = col_i + 0.5 - focalLength*baseline/Z;
+            bool shadowed = !onSphere && intersectSphere(projector, point - projector, sphereCenter, sphereRadius) > 0.0;
+            bool lit = !shadowed && column >= 0.0 && column < projectorWidth;
+            projectorColumn.at<float>(row_i, col_i) = lit ? static_cast<float>(column) : -1.0F;
+            albedo.at<float>(row_i, col_i) = onSphere ? 0.5F : 0.7F;
+            if (lit)
+            {
+                trueDisparity.at<float>(row_i, col_i) = static_cast<float>(focalLength*baseline/Z);
+            }
+        }
+    }
+
+    // one noisy camera image per projector pattern
+    std::mt19937 random(12345);
+    std::normal_distribution<double> noise(0.0, noiseSigma);
+    captures.clear();
+    for (size_t pattern_i = 0; pattern_i < patterns.size(); pattern_i++)
+    {
+        const uchar *pattern_p = patterns[pattern_i].ptr<uchar>(0);
+        Mat capture(size, CV_8U);
+        for (int row_i = 0; row_i < size.height; row_i++)
+        {
+            for (int col_i = 0; col_i < size.width; col_i++)
+            {
+                float column = projectorColumn.at<float>(row_i, col_i);
+                double light = column >= 0.0F ? pattern_p[static_cast<int>(column)]/255.0 : 0.0;
+                double value = ambient + albedo.at<float>(row_i, col_i)*brightness*light + noise(random);
+                capture.at<uchar>(row_i, col_i) = saturate_cast<uchar>(value);
+            }
+        }
+        captures.push_back(capture);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    TRACE_SCOPE("structured_light");
+    // parse the arguments
+    string capturePrefix, writePrefix;
+    bool synthetic = false;
+    int projectorWidth = 0;
+    int minContrast = 10;
+    double focalLength = 800.0, baseline = 100.0;
+    int repeat = 5;
+    bool badArgument = false;
+    for (int arg_i = 1; arg_i < argc; arg_i++)
+    {
+        string arg = argv[arg_i];
+        if (arg == "--captures" && arg_i + 2 < argc)
+        {
+            capturePrefix = argv[++arg_i];
+            projectorWidth = atoi(argv[++arg_i]);
+        }
+        else if (arg == "--synthetic")
+        {
+            synthetic = true;
+        }
+        else if (arg == "--write-captures" && arg_i + 1 < argc)
+        {
+            writePrefix = argv[++arg_i];
+        }
+        else if (arg == "--min-contrast" && arg_i + 1 < argc)
+        {
+            minContrast = min(max(0, atoi(argv[++arg_i])), 255);
+        }
+        else if (arg == "--focal" && arg_i + 1 < argc)
+        {
+            focalLength = atof(argv[++arg_i]);
+        }
+        else if (arg == "--baseline" && arg_i + 1 < argc)
+        {
+            baseline = atof(argv[++arg_i]);
+        }
+        else if (arg == "--repeat" && arg_i + 1 < argc)
+        {
+            repeat = max(1, atoi(argv[++arg_i]));
+        }
+        else
+        {
+            badArgument = true;
+        }
+    }
+    if (badArgument || synthetic == !capturePrefix.empty() || (!synthetic && (projectorWidth < 2 || projectorWidth > 32768)))
+    {
+        cout << "Usage: structured_light --captures <prefix> <projector_width> [options]" << endl;
+        cout << "       structured_light --synthetic [--write-captures <prefix>] [options]" << endl;
+        cout << "options: [--min-contrast <levels>] [--focal <pixels>] [--baseline <units>] [--repeat <n>]" << endl;
+        cout << "captures are <prefix>NN.png and <prefix>NN_inverse.png, the camera images of the Gray-code pattern for bit NN" << endl;
+        cout << "(most significant first) and of its inverse; the projector is assumed rectified with the camera, to its right" << endl;
+        cout << "the decoded points are written to point_cloud.pts" << endl;
+        return 1;
+    }
+
+    // get the captures: render them, or load them
+    vector<Mat> captures;
+    Mat trueDisparity;
+    if (synthetic)
+    {
+        Stopwatch stopwatch;
+        renderSyntheticCaptures(Size(1024, 768), focalLength, baseline, captures, trueDisparity);
+        projectorWidth = 1024;
+        cout << captures.size() << " synthetic captures rendered in " << stopwatch.elapsedMs() << " ms" << endl;
+        for (size_t capture_i = 0; capture_i < captures.size() && !writePrefix.empty(); capture_i++)
+        {
+            string filename = captureFilename(writePrefix, static_cast<int>(capture_i/2), capture_i % 2 == 1);
+            if (!imwrite(filename, captures[capture_i]))
+            {
+                cout << "error: could not write \"" << filename << "\"; exiting..." << endl;
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        // note: the stack is decoded ahead on the image source's threads
+        vector<string> filenames;
+        for (int bit_i = 0; bit_i < grayCodeBits(projectorWidth); bit_i++)
+        {
+            filenames.push_back(captureFilename(capturePrefix, bit_i, false));
+            filenames.push_back(captureFilename(capturePrefix, bit_i, true));
+        }
+        Stopwatch stopwatch;
+        ImageSource source(filenames, IMREAD_GRAYSCALE);
+        SourceImage frame;
+        while (source.next(frame))
+        {
+            if (frame.image.empty() || (!captures.empty() && frame.image.size() != captures[0].size()))
+            {
+                cout << "error: no image data for image \"" << frame.filename << "\", or its size differs; exiting..." << endl;
+                return 1;
+            }
+            captures.push_back(frame.image);
+        }
+        cout << captures.size() << " captures loaded in " << stopwatch.elapsedMs() << " ms" << endl;
+    }
+    cout << "image: " << captures[0].cols << "x" << captures[0].rows << ", projector width " << projectorWidth << " ("
+         << grayCodeBits(projectorWidth) << " bits)" << endl;
+
+    // decode, timing the bit-sliced decode against the per-pixel reference
+    Mat columns, referenceColumns;
+    vector<double> decodeMs, referenceMs;
+    for (int repeat_i = 0; repeat_i < repeat; repeat_i++)
+    {
+        Stopwatch stopwatch;
+        decodeGrayCode(captures, projectorWidth, minContrast, columns);
+        decodeMs.push_back(stopwatch.elapsedMs());
+        stopwatch.restart();
+        decodeGrayCodeReference(captures, projectorWidth, minContrast, referenceColumns);
+        referenceMs.push_back(stopwatch.elapsedMs());
+    }
+    TimingSummary decodeSummary = summarizeTimings(decodeMs), referenceSummary = summarizeTimings(referenceMs);
+    int mismatches = countNonZero(columns != referenceColumns);
+    int decoded = countNonZero(columns != invalidGrayCode);
+    cout << "decode: " << decodeSummary.p50 << " ms (per-pixel reference " << referenceSummary.p50 << " ms, " << mismatches
+         << " pixels differ)" << endl;
+    cout << decoded << " of " << columns.total() << " pixels decoded" << endl;
+
+    // triangulate as a stereo pair: disparity against the projector, then the usual reprojection
+    Stopwatch stopwatch;
+    Mat disparity, XYZ;
+    grayCodeDisparity(columns, disparity);
+    {
+        TRACE_SCOPE("reproject_image_to_3d");
+        reprojectImageTo3D(disparity, XYZ, simpleQ(captures[0].cols/2.0, captures[0].rows/2.0, focalLength, baseline), false, CV_32F);
+    }
+    cout << "triangulate: " << stopwatch.elapsedMs() << " ms" << endl;
+
+    // against the ground truth
+    if (!trueDisparity.empty())
+    {
+        int lit = countNonZero(trueDisparity > 0.0F);
+        int unlitDecoded = 0;
+        vector<double> errors;
+        double errorSum = 0.0;
+        for (int row_i = 0; row_i < disparity.rows; row_i++)
+        {
+            for (int col_i = 0; col_i < disparity.cols; col_i++)
+            {
+                float truth = trueDisparity.at<float>(row_i, col_i), d = disparity.at<float>(row_i, col_i);
+                if (truth == 0.0F && columns.at<uint16_t>(row_i, col_i) != invalidGrayCode)
+                {
+                    unlitDecoded++;
+                }
+                if (truth > 0.0F && d > 0.0F)
+                {
+                    errors.push_back(std::fabs(d - truth));
+                    errorSum += errors.back();
+                }
+            }
+        }
+        std::sort(errors.begin(), errors.end());
+        cout << "ground truth: " << errors.size() << " of " << lit << " lit pixels decoded, " << unlitDecoded
+             << " unlit pixels decoded; disparity error mean " << (errors.empty() ? 0.0 : errorSum/errors.size()) << ", p99 "
+             << percentile(errors, 99) << ", max " << (errors.empty() ? 0.0 : errors.back()) << " pixels" << endl;
+    }
+
+    // texture the points with the fully lit image: the brighter of the first pattern and its inverse
+    Mat gray, texture;
+    cv::max(captures[0], captures[1], gray);
+    cvtColor(gray, texture, COLOR_GRAY2BGR);
+    size_t npoints;
+    if (!writePointCloud("point_cloud.pts", XYZ, texture, &npoints))
+    {
+        cout << "error: could not write \"point_cloud.pts\"; exiting..." << endl;
+        return 1;
+    }
+    cout << npoints << " points written to point_cloud.pts" << endl;
+
+    return 0;
+}
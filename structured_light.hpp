@@ -0,0 +1,278 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef STRUCTURED_LIGHT_HPP
+#define STRUCTURED_LIGHT_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <opencv2/core.hpp>
+#include "parallel.hpp"
+#include "trace.hpp"
+
+
+// Gray-code structured light: the projector shows vertical stripe patterns, one per bit of the projector column in
+// Gray code (most significant bit first), each followed by its inverse; the camera image of each pair then tells,
+// for every pixel, one bit of the projector column lighting it
+//
+// the projector is assumed to be rectified with the camera (like the right view of a stereo pair), so that the
+// decoded column gives the disparity x - column directly and the usual Q reprojects it
+// note: each bit is decided by comparing the pattern with its inverse rather than with a fixed threshold, so surface
+// albedo and ambient light cancel out; pixels where any pair differs by less than the minimum contrast (shadows,
+// dark or saturated surfaces, pixels outside the projector's reach) are marked invalid
+// note: decoding is bit-sliced: each row's comparisons are packed into one bit plane per pattern pair (64 pixels per
+// word), Gray-to-binary conversion is done on whole words, and the planes are then unpacked into 16 bit codes with
+// SSE, eight pixels at a time
+
+
+// projector column of a pixel that could not be decoded
+const uint16_t invalidGrayCode = 0xFFFF;
+
+
+// bits needed to encode every column of a projector of the given width (at most 15)
+inline int grayCodeBits(int projectorWidth)
+{
+    int nbits = 1;
+    while ((1 << nbits) < projectorWidth)
+    {
+        nbits++;
+    }
+    CV_Assert(nbits <= 15);
+    return nbits;
+}
+
+
+// the projector images: for each bit (most significant first) the pattern then its inverse (CV_8U, 0 or 255)
+inline void makeGrayCodePatterns(int projectorWidth, int projectorHeight, std::vector<cv::Mat> &patterns)
+{
+    int nbits = grayCodeBits(projectorWidth);
+    patterns.clear();
+    for (int bit_i = 0; bit_i < nbits; bit_i++)
+    {
+        cv::Mat pattern(projectorHeight, projectorWidth, CV_8U), inverse(projectorHeight, projectorWidth, CV_8U);
+        for (int row_i = 0; row_i < projectorHeight; row_i++)
+        {
+            uchar *pattern_p = pattern.ptr<uchar>(row_i);
+            uchar *inverse_p = inverse.ptr<uchar>(row_i);
+            for (int col_i = 0; col_i < projectorWidth; col_i++)
+            {
+                int gray = col_i ^ (col_i >> 1);
+                pattern_p[col_i] = (gray >> (nbits - 1 - bit_i)) & 1 ? 255 : 0;
+                inverse_p[col_i] = 255 - pattern_p[col_i];
+            }
+        }
+        patterns.push_back(pattern);
+        patterns.push_back(inverse);
+    }
+}
+
+
+// straightforward per-pixel decode; the reference for decodeGrayCode (minContrast in [0, 255])
+inline void decodeGrayCodeReference(const std::vector<cv::Mat> &captures, int projectorWidth, int minContrast, cv::Mat &columns)
+{
+    TRACE_SCOPE("decode_gray_code_reference");
+    int nbits = grayCodeBits(projectorWidth);
+    CV_Assert(static_cast<int>(captures.size()) == 2*nbits && minContrast >= 0 && minContrast <= 255);
+    columns.create(captures[0].size(), CV_16U);
+    for (int row_i = 0; row_i < columns.rows; row_i++)
+    {
+        uint16_t *columns_p = columns.ptr<uint16_t>(row_i);
+        for (int col_i = 0; col_i < columns.cols; col_i++)
+        {
+            int gray = 0;
+            bool valid = true;
+            for (int bit_i = 0; bit_i < nbits; bit_i++)
+            {
+                int pattern = captures[2*bit_i].ptr<uchar>(row_i)[col_i];
+                int inverse = captures[2*bit_i + 1].ptr<uchar>(row_i)[col_i];
+                valid = valid && std::abs(pattern - inverse) >= minContrast;
+                gray = (gray << 1) | (pattern > inverse ? 1 : 0);
+            }
+            int column = gray;
+            for (int shift = 1; shift < nbits; shift <<= 1)
+            {
+                column ^= column >> shift;
+            }
+            columns_p[col_i] = valid && column < projectorWidth ? static_cast<uint16_t>(column) : invalidGrayCode;
+        }
+    }
+}
+
+
+// for each byte value, eight 16 bit lanes holding its bits (least significant first), for unpacking bit planes
+struct ByteSpreadTable
+{
+    uint16_t lanes[256][8];
+    ByteSpreadTable(void)
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            for (int lane_i = 0; lane_i < 8; lane_i++)
+            {
+                lanes[value][lane_i] = (value >> lane_i) & 1;
+            }
+        }
+    }
+};
+
+inline const ByteSpreadTable &byteSpreadTable(void)
+{
+    static const ByteSpreadTable table;
+    return table;
+}
+
+
+// decode one row; planes holds nbits*nwords words of scratch, invalid nwords
+inline void decodeGrayCodeRow(const std::vector<const uchar *> &rows, int nbits, int cols, int projectorWidth, int minContrast,
+                              uint64_t *planes, uint64_t *invalid, uint16_t *columns_p)
+{
+    const int nwords = (cols + 63)/64;
+
+    // threshold each pattern against its inverse and pack the results into bit planes, 64 pixels per word
+    std::fill(invalid, invalid + nwords, 0);
+    for (int bit_i = 0; bit_i < nbits; bit_i++)
+    {
+        const uchar *pattern_p = rows[2*bit_i];
+        const uchar *inverse_p = rows[2*bit_i + 1];
+        uint64_t *plane = planes + bit_i*nwords;
+        int col_i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i contrast = _mm_set1_epi8(static_cast<char>(minContrast));
+        for (; col_i + 16 <= cols; col_i += 16)
+        {
+            __m128i pattern = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern_p + col_i));
+            __m128i inverse = _mm_loadu_si128(reinterpret_cast<const __m128i *>(inverse_p + col_i));
+            __m128i brighter = _mm_subs_epu8(pattern, inverse);
+            __m128i darker = _mm_subs_epu8(inverse, pattern);
+            // note: the saturating differences are nonzero exactly where pattern > inverse (resp. <); their OR is
+            // the absolute difference, which is below the contrast where contrast - difference does not saturate
+            uint64_t gray = ~_mm_movemask_epi8(_mm_cmpeq_epi8(brighter, zero)) & 0xFFFF;
+            uint64_t low = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(contrast, _mm_or_si128(brighter, darker)), zero)) & 0xFFFF;
+            int shift = col_i & 63;
+            if (shift == 0)
+            {
+                plane[col_i >> 6] = 0;
+            }
+            plane[col_i >> 6] |= gray << shift;
+            invalid[col_i >> 6] |= low << shift;
+        }
+#endif
+        for (; col_i < cols; col_i++)
+        {
+            int shift = col_i & 63;
+            if (shift == 0)
+            {
+                plane[col_i >> 6] = 0;
+            }
+            int difference = pattern_p[col_i] - inverse_p[col_i];
+            plane[col_i >> 6] |= static_cast<uint64_t>(difference > 0) << shift;
+            invalid[col_i >> 6] |= static_cast<uint64_t>(std::abs(difference) < minContrast) << shift;
+        }
+    }
+
+    // Gray to binary, 64 pixels per operation: each binary bit is the previous binary bit xor the Gray bit
+    for (int bit_i = 1; bit_i < nbits; bit_i++)
+    {
+        const uint64_t *previous = planes + (bit_i - 1)*nwords;
+        uint64_t *plane = planes + bit_i*nwords;
+        for (int word_i = 0; word_i < nwords; word_i++)
+        {
+            plane[word_i] ^= previous[word_i];
+        }
+    }
+
+    // unpack the planes into one 16 bit column per pixel, eight pixels at a time
+    int col_i = 0;
+#ifdef __SSE2__
+    const ByteSpreadTable &spread = byteSpreadTable();
+    const __m128i lastColumn = _mm_set1_epi16(static_cast<short>(projectorWidth - 1));
+    for (; col_i + 8 <= cols; col_i += 8)
+    {
+        int word_i = col_i >> 6, shift = col_i & 63;
+        __m128i column = _mm_setzero_si128();
+        for (int bit_i = 0; bit_i < nbits; bit_i++)
+        {
+            int byte = static_cast<int>((planes[bit_i*nwords + word_i] >> shift) & 0xFF);
+            column = _mm_or_si128(_mm_slli_epi16(column, 1), _mm_loadu_si128(reinterpret_cast<const __m128i *>(spread.lanes[byte])));
+        }
+        // note: 0 - 1 sets a lane to 0xFFFF, i.e. invalidGrayCode
+        int byte = static_cast<int>((invalid[word_i] >> shift) & 0xFF);
+        __m128i bad = _mm_sub_epi16(_mm_setzero_si128(), _mm_loadu_si128(reinterpret_cast<const __m128i *>(spread.lanes[byte])));
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi16(column, lastColumn));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(columns_p + col_i), _mm_or_si128(column, bad));
+    }
+#endif
+    for (; col_i < cols; col_i++)
+    {
+        int word_i = col_i >> 6, shift = col_i & 63;
+        int column = 0;
+        for (int bit_i = 0; bit_i < nbits; bit_i++)
+        {
+            column = (column << 1) | static_cast<int>((planes[bit_i*nwords + word_i] >> shift) & 1);
+        }
+        bool valid = ((invalid[word_i] >> shift) & 1) == 0 && column < projectorWidth;
+        columns_p[col_i] = valid ? static_cast<uint16_t>(column) : invalidGrayCode;
+    }
+}
+
+
+// the projector column lighting each camera pixel (CV_16U), or invalidGrayCode
+// captures are the camera images (CV_8U) of the patterns from makeGrayCodePatterns, in the same order
+// note: rows are decoded in parallel, in blocks that share one set of bit plane scratch buffers
+inline void decodeGrayCode(const std::vector<cv::Mat> &captures, int projectorWidth, int minContrast, cv::Mat &columns, int nthreads = 0)
+{
+    TRACE_SCOPE("decode_gray_code");
+    int nbits = grayCodeBits(projectorWidth);
+    CV_Assert(static_cast<int>(captures.size()) == 2*nbits && minContrast >= 0 && minContrast <= 255);
+    for (size_t capture_i = 0; capture_i < captures.size(); capture_i++)
+    {
+        CV_Assert(captures[capture_i].type() == CV_8U && captures[capture_i].size() == captures[0].size());
+    }
+    columns.create(captures[0].size(), CV_16U);
+    const int rows = columns.rows, cols = columns.cols;
+    const int nwords = (cols + 63)/64;
+    const int blockRows = 16;
+
+    parallelFor((rows + blockRows - 1)/blockRows, [&](size_t block_i)
+    {
+        std::vector<uint64_t> planes(static_cast<size_t>(nbits)*nwords), invalid(nwords);
+        std::vector<const uchar *> rowPointers(captures.size());
+        int end = std::min(static_cast<int>(block_i + 1)*blockRows, rows);
+        for (int row_i = static_cast<int>(block_i)*blockRows; row_i < end; row_i++)
+        {
+            for (size_t capture_i = 0; capture_i < captures.size(); capture_i++)
+            {
+                rowPointers[capture_i] = captures[capture_i].ptr<uchar>(row_i);
+            }
+            decodeGrayCodeRow(rowPointers, nbits, cols, projectorWidth, minContrast, &planes[0], &invalid[0], columns.ptr<uint16_t>(row_i));
+        }
+    }, nthreads);
+}
+
+
+// disparity (CV_32F) of each decoded pixel against the projector: x - column, taking the column's center; 0 (which
+// reprojects to infinity, i.e. is not written as a point) where the pixel was not decoded or the disparity is not positive
+inline void grayCodeDisparity(const cv::Mat &columns, cv::Mat &disparity)
+{
+    TRACE_SCOPE("gray_code_disparity");
+    disparity.create(columns.size(), CV_32F);
+    for (int row_i = 0; row_i < columns.rows; row_i++)
+    {
+        const uint16_t *columns_p = columns.ptr<uint16_t>(row_i);
+        float *disparity_p = disparity.ptr<float>(row_i);
+        for (int col_i = 0; col_i < columns.cols; col_i++)
+        {
+            float d = col_i - (columns_p[col_i] + 0.5F);
+            disparity_p[col_i] = columns_p[col_i] != invalidGrayCode && d > 0.0F ? d : 0.0F;
+        }
+    }
+}
+
+#endif // STRUCTURED_LIGHT_HPP
@@ -0,0 +1,94 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef TIMING_HPP
+#define TIMING_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+
+// simple wall-clock stopwatch; reports elapsed time in milliseconds
+class Stopwatch
+{
+public:
+    Stopwatch(void) { restart(); }
+
+    void restart(void) { _start = std::chrono::steady_clock::now(); }
+
+    double elapsedMs(void) const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point _start;
+};
+
+
+// statistical summary of a set of timing samples (all values in milliseconds)
+struct TimingSummary
+{
+    size_t count;
+    double min;
+    double mean;
+    double stddev;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+    TimingSummary(void): count(0), min(0), mean(0), stddev(0), p50(0), p90(0), p99(0), max(0){}
+};
+
+
+// note: uses the nearest-rank method on the sorted samples
+inline double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    size_t rank = static_cast<size_t>(std::ceil(p/100.0*sorted.size()));
+    rank = std::max<size_t>(rank, 1);
+    return sorted[std::min(rank, sorted.size()) - 1];
+}
+
+
+inline TimingSummary summarizeTimings(std::vector<double> samples)
+{
+    TimingSummary summary;
+    if (samples.empty())
+    {
+        return summary;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        sum += samples[i];
+    }
+    summary.count = samples.size();
+    summary.mean = sum/samples.size();
+
+    double sumSquares = 0.0;
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        sumSquares += (samples[i] - summary.mean)*(samples[i] - summary.mean);
+    }
+    summary.stddev = std::sqrt(sumSquares/samples.size());
+
+    summary.min = samples.front();
+    summary.max = samples.back();
+    summary.p50 = percentile(samples, 50);
+    summary.p90 = percentile(samples, 90);
+    summary.p99 = percentile(samples, 99);
+
+    return summary;
+}
+
+#endif // TIMING_HPP
@@ -0,0 +1,188 @@
+// Paul R. Cannon
+// paul_r_cannon@yahoo.com
+// 240-344-6081
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// scoped timers that write a Chrome trace-event file (load it in chrome://tracing or ui.perfetto.dev)
+//
+// usage: TRACE_SCOPE("stereo_bm_compute"); times the enclosing block
+// tracing is compiled in but only enabled when the VERIZON_TRACE environment variable names an output file, e.g.
+//     VERIZON_TRACE=disparity.json ./disparity_map left.png right.png
+// note: when disabled, a scope costs one predictable branch; when enabled, events go to a buffer owned by the
+// recording thread (no locking) and the file is written when the program exits
+// note: scope names must be string literals (or otherwise outlive the program), since only the pointer is stored
+
+namespace trace
+{
+
+// one completed scope: a Chrome "X" (complete) event; nesting is recovered from the times
+struct Event
+{
+    const char *name;
+    double startUs;
+    double durationUs;
+};
+
+struct ThreadBuffer
+{
+    int tid;
+    std::string name;
+    std::vector<Event> events;
+};
+
+
+class Tracer
+{
+public:
+    static Tracer &instance(void)
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool enabled(void) const { return _enabled; }
+
+    double nowUs(void) const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+    // the calling thread's buffer, created on first use
+    // note: buffers belong to the tracer, so events of threads that have finished are still written out
+    ThreadBuffer &threadBuffer(void)
+    {
+        static thread_local ThreadBuffer *buffer = 0;
+        if (!buffer)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _buffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+            buffer = _buffers.back().get();
+            buffer->tid = static_cast<int>(_buffers.size());
+            buffer->events.reserve(1024);
+        }
+        return *buffer;
+    }
+
+    ~Tracer(void)
+    {
+        if (_enabled)
+        {
+            write();
+        }
+    }
+
+private:
+    Tracer(void): _enabled(false), _start(std::chrono::steady_clock::now())
+    {
+        const char *filename = std::getenv("VERIZON_TRACE");
+        if (filename && *filename)
+        {
+            _filename = filename;
+            _enabled = true;
+        }
+    }
+
+    void write(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::ofstream fout(_filename.c_str());
+        if (!fout)
+        {
+            std::fprintf(stderr, "error: couldn't open trace file \"%s\" for output\n", _filename.c_str());
+            return;
+        }
+
+        char line[512];
+        size_t nevents = 0;
+        fout << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (size_t buffer_i = 0; buffer_i < _buffers.size(); buffer_i++)
+        {
+            const ThreadBuffer &buffer = *_buffers[buffer_i];
+            if (!buffer.name.empty())
+            {
+                std::snprintf(line, sizeof(line), "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                              nevents++ ? ",\n" : "", buffer.tid, buffer.name.c_str());
+                fout << line;
+            }
+            for (size_t event_i = 0; event_i < buffer.events.size(); event_i++)
+            {
+                const Event &event = buffer.events[event_i];
+                std::snprintf(line, sizeof(line), "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                              nevents++ ? ",\n" : "", event.name, buffer.tid, event.startUs, event.durationUs);
+                fout << line;
+            }
+        }
+        fout << "\n]}\n";
+        std::fprintf(stderr, "%zu trace events written to %s\n", nevents, _filename.c_str());
+    }
+
+    bool _enabled;
+    std::string _filename;
+    std::chrono::steady_clock::time_point _start;
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<ThreadBuffer> > _buffers;
+};
+
+
+// label the calling thread in the trace viewer
+inline void setThreadName(const char *name)
+{
+    Tracer &tracer = Tracer::instance();
+    if (tracer.enabled())
+    {
+        tracer.threadBuffer().name = name;
+    }
+}
+
+
+// records one event covering its own lifetime
+class Scope
+{
+public:
+    explicit Scope(const char *name): _name(name), _startUs(-1.0)
+    {
+        Tracer &tracer = Tracer::instance();
+        if (tracer.enabled())
+        {
+            _startUs = tracer.nowUs();
+        }
+    }
+
+    ~Scope(void)
+    {
+        if (_startUs >= 0.0)
+        {
+            Tracer &tracer = Tracer::instance();
+            Event event = {_name, _startUs, tracer.nowUs() - _startUs};
+            tracer.threadBuffer().events.push_back(event);
+        }
+    }
+
+private:
+    Scope(const Scope &);
+    Scope &operator=(const Scope &);
+
+    const char *_name;
+    double _startUs;
+};
+
+} // namespace trace
+
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) trace::Scope TRACE_CONCAT(_traceScope, __LINE__)(name)
+
+#endif // TRACE_HPP